@@ -14,6 +14,7 @@ CFLAGS  := -Wall -I'./include' -O2 -std=gnu99         \
            -DFIRCD_VERSION_N="$(VERSION_N)"           \
 		   -D_FORTIFY_SOURCE=0
 LDFLAGS ?=
+LDFLAGS += -pthread
 LEX     := flex
 LFLAGS  := -Pcfg_yy
 
@@ -30,6 +31,14 @@ DOCDIR  := $(PREFIX)/share/doc/fircd
 # Enable debugging
 # FIRCD_DEBUG := y
 
+# Use the select() event loop backend even when epoll is available
+# FIRCD_SELECT := y
+
+# Use the io_uring event loop backend when the kernel supports it (Linux 5.11
+# or later, and 5.19 for it to do the reads), falling back to epoll or select()
+# otherwise
+# FIRCD_IO_URING := y
+
 # Show all commands executed by the Makefile
 # VERBOSE := y
 
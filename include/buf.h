@@ -12,12 +12,14 @@
 
 #include <unistd.h> /* close() */
 #include <sys/types.h>
-#include <sys/select.h>
 
 #include "array.h"
 
 #define BUF_BLK_UNUSED(blk) ((blk)->allocsize - (blk)->size)
 
+/* The largest single read the buffer will grow to */
+#define BUF_MAX_READ 32768
+
 struct buf_blk {
     struct buf_blk *next_blk;
 
@@ -35,14 +37,25 @@ struct buf_fd {
     struct buf_blk *head;
     struct buf_blk *tail;
     struct buf_blk *empty_head;
+
+    /* Lines that cross over blocks are copied into here by buf_next_line */
+    char *scratch;
+    size_t scratch_size;
+
     int fd;
     unsigned int empty_count;
     unsigned int block_size;
+    unsigned int read_size;
     unsigned int max_empty;
-    unsigned short has_line;
+    unsigned int has_line;
 
     unsigned int errno_ret;
     unsigned int closed_gracefully :1;
+
+    /* Set while the event loop does the reads (See 'event_add_buf'), in which
+     * case 'buf_handle_input' doesn't read and the loop sets 'errno_ret' and
+     * 'closed_gracefully' */
+    unsigned int loop_reads :1;
 };
 
 #define CLOSE_FD(fd) \
@@ -53,14 +66,6 @@ struct buf_fd {
         } \
     } while (0)
 
-#define ADD_FD_BUF_TO_SET(buf_fd, in, maxfd) \
-    do { \
-        if ((buf_fd).fd != -1) \
-            FD_SET((buf_fd).fd, in); \
-        if ((buf_fd).fd > (maxfd)) \
-            (maxfd) = (buf_fd).fd; \
-    } while (0)
-
 #define BUF_FILE_OPEN_FLAGS (O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK)
 #define BUF_FIFO_OPEN_FLAGS (O_RDWR | O_NONBLOCK)
 
@@ -70,6 +75,17 @@ extern void buf_free(struct buf_fd *);
 
 extern void buf_handle_input(struct buf_fd *);
 
-extern char *buf_read_line(struct buf_fd *);
+/* Adds 'len' bytes that were read from the fd some other way */
+extern void buf_add_input(struct buf_fd *, const char *data, size_t len);
+
+/* Returns the next complete line in the buffer with the trailing newline (And
+ * carriage-return) removed, or NULL if there isn't one. If 'len' isn't NULL,
+ * the length of the line is stored there.
+ *
+ * The line isn't a copy, it's terminated in-place and the memory belongs to
+ * the buffer. It's only valid until the next call to buf_next_line,
+ * buf_handle_input, buf_add_input, or buf_free. Callers are free to modify
+ * the contents of the line (Ex. to tokenize it) */
+extern char *buf_next_line(struct buf_fd *, size_t *len);
 
 #endif
@@ -0,0 +1,34 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_CASEMAP_H
+#define INCLUDE_CASEMAP_H
+
+#include "global.h"
+
+/* The case-mappings an IRC server can advertise through CASEMAPPING in
+ * RPL_ISUPPORT. Under 'rfc1459' the characters {}|^ are the lower-case
+ * versions of []\~, 'strict-rfc1459' leaves out ^ and ~, and 'ascii' only
+ * folds A-Z. RFC 1459 is the default when the server doesn't say. */
+enum irc_casemapping {
+    CASEMAP_RFC1459,
+    CASEMAP_STRICT_RFC1459,
+    CASEMAP_ASCII
+};
+
+/* Returns the 256-entry fold table for a case-mapping. Every character is
+ * mapped to its lower-case version */
+extern const unsigned char *irc_casemap_table (enum irc_casemapping);
+
+/* Returns -1 if the name isn't a case-mapping we know */
+extern int irc_casemap_parse (const char *name);
+
+/* Hash and compare strings with case folded according to 'fold' */
+extern unsigned int irc_casehash (const unsigned char *fold, const char *str);
+extern int irc_casecmp (const unsigned char *fold, const char *s1, const char *s2);
+
+#endif
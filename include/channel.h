@@ -11,35 +11,77 @@
 #include "global.h"
 
 #include <sys/types.h>
-#include <sys/select.h>
 
 #include "buf.h"
+#include "event.h"
 #include "net_cons.h"
 #include "array.h"
 #include "rbtree.h"
+#include "hash.h"
+#include "outbuf.h"
+#include "reclog.h"
 #include "user.h"
 
+/* Users in a channel are kept in two indexes: 'users' is a rb-tree ordered by
+ * nick, used for writing out the sorted 'online' file, and 'user_hash' is
+ * keyed by the case-folded nick for checking membership.
+ *
+ * Each node is also on its 'net_user's list of memberships, which links
+ * together every channel that user is in. 'user.nick' belongs to 'net_user'.
+ */
 struct channel_irc_user_node {
     struct irc_user user;
-    struct channel_irc_user_node *next;
+    struct channel *chan;
+
+    struct irc_net_user *net_user;
+    struct channel_irc_user_node *next_member, **prev_member;
+
+    struct rbnode node;
+    struct hash_node hnode;
+
+    /* Set on every member when a NAMES list starts, and cleared as the user
+     * shows up in it. See 'channel_names_start' */
+    unsigned int stale :1;
 };
 
 /* 'channel' represents a node on a linked-list of channels */
 struct channel {
     struct network *net;
 
-    struct channel_irc_user_node *first_user;
+    struct rbtree users;
+    struct hash_table user_hash;
 
     char *name;
+    char *key;
     char *topic, *topic_user;
 
-    int outfd;
-    int onlinefd;
-    int topicfd;
-    int rawfd;
-    int msgsfd;
+    /* The name of the channel's directory, inside of the network's. No fd
+     * is kept open for it, and the log files in it are opened as needed (See
+     * 'outbuf_open_at') so a channel only holds its 'in' fifo open. */
+    char *dir;
+
+    struct outbuf out;
+    struct outbuf raw;
+    struct outbuf msgs;
+
+    /* Only opened when the network has 'record-log' set */
+    struct reclog reclog;
 
     struct buf_fd in;
+    struct event_fd in_ev;
+
+    /* State files which are out of date, see 'channel_flush'. A channel
+     * with either set is on its network's 'first_dirty' list. */
+    struct channel *next_dirty, **prev_dirty;
+    unsigned int users_dirty :1;
+    unsigned int topic_dirty :1;
+
+    /* Set between the first RPL_NAMREPLY and RPL_ENDOFNAMES */
+    unsigned int names_pending :1;
+
+    /* Set when our own JOIN comes back, and cleared when we part or the
+     * connection is lost */
+    unsigned int joined :1;
 };
 
 /* Call on creation and deletion of a channel
@@ -48,22 +90,21 @@ struct channel {
 extern void channel_init (struct channel *);
 extern void channel_clear (struct channel *);
 
-/* These functions create and delete the channels filesystem
- * When calling these functions, you should be sure to chdir into the directory
- * where you want the channel's directory contained. In most cases this amounts
- * to chdir'ing into the network's directory before calling these functions.
+/* These functions create and delete the channels filesystem. Creating the
+ * files also registers the channel's 'in' fifo with the event loop, and it's
+ * removed again when the channel is cleared.
+ *
+ * The channel's directory is created inside of the network's 'dirfd', so the
+ * network's files have to be setup first. Any '/' in the channel's name is
+ * replaced with a ',' (Which can't be in a name) for the directory's name.
+ * Removing the files closes the channel's logs first.
+ *
+ * With the network's 'record-log' set, the channel also gets a binary record
+ * log of its events, see 'reclog.h'.
  */
 extern void channel_create_files (struct channel *);
 extern void channel_remove_files (struct channel *);
 
-/* These are used for monitoring and handling input. 'reg_select' is
- * registering fd's to be watched by the main-loop's select() call.
- * 'handle_input' is called after select() returns, and checks to see if any
- * input was recieved for this channel.
- */
-extern void channel_reg_select (struct channel *, fd_set *, fd_set *, int *);
-extern void channel_handle_input (struct channel *, fd_set *, fd_set *);
-
 /* These are for modifying the state of this channel. 'new_message' write's a
  * new message to this channel, from 'user', with contents 'line'. 'new_topic'
  * sets the current topic for the channel.
@@ -74,21 +115,54 @@ extern void channel_new_topic (struct channel *, const char *user, const char *t
 /* These functions are for modifying the state of users in the channel.
  * 'online' is used to add a user to the online list without showing a 'joined'
  *     message This is used for adding the users who were in the channel when
- *     you joined.
+ *     you joined. If the user is already here, its flags are updated.
  * 'join' is used when a new user joins.
  * 'part' is used when a user parts from the channel.
  * 'quit' is like part, but used when a user quits the network.
- * 'change' is used when a user changes nicknames.
+ * 'change' is used when a user changes nicknames. It's called by
+ *     'network_user_change' after the user's shared nick has been replaced,
+ *     with the 'old' nick still valid.
+ * 'drop' removes a member without logging anything, for entries that turn
+ *     out to be stale.
  */
 extern void channel_user_online (struct channel *, const struct irc_user *);
 extern void channel_user_join (struct channel *, const struct irc_user *);
 extern void channel_user_part (struct channel *, const char *user);
 extern void channel_user_quit (struct channel *, const char *user);
-extern void channel_user_change (struct channel *, const char *old, const char *new);
+extern void channel_user_change (struct channel_irc_user_node *, const char *old);
+extern void channel_user_drop (struct channel_irc_user_node *);
+
+/* Drops every member (Without logging anything) and marks the channel as not
+ * joined, for when we've parted or the connection is lost. After a
+ * reconnect, the members come back from the rejoin's NAMES reply, and if the
+ * rejoin fails (Ex. the channel is now invite-only) nobody is left listed as
+ * online. */
+extern void channel_left (struct channel *);
+
+/* A NAMES list (Ex. a repeated one, after the channel was joined) replaces the
+ * member list without throwing it away: 'names_start' marks every current
+ * member as stale, 'channel_user_online' clears the mark (And updates the
+ * flags) of each user it's given, and 'names_end' drops whoever is left
+ * marked. Users who didn't change don't generate any writes.
+ */
+extern void channel_names_start (struct channel *);
+extern void channel_names_end   (struct channel *);
+
+/* The 'online' and 'topic' files aren't rewritten on every change. Instead the
+ * channel is marked dirty, and 'flush' writes out whichever files are out of
+ * date. This is called at the end of every event-loop iteration through
+ * 'network_flush' (Which only visits the dirty channels), and directly on
+ * RPL_ENDOFNAMES.
+ */
+extern void channel_flush (struct channel *);
+
+/* Rebuilds 'user_hash' after the network's case-mapping changes */
+extern void channel_rehash_users (struct channel *);
 
+/* Iterates over the users in the channel, in order by nick */
 #define channel_foreach_user(chan, user) \
-    for (user = &(chan->first_user->user); \
-         user != NULL; \
-         user = &(container_of(user, struct channel_irc_user_node, user)->next->user))
+    for (struct rbnode *_user_node, **_user_once = &_user_node; _user_once != NULL; _user_once = NULL) \
+        rb_foreach_inorder(&(chan)->users, _user_node) \
+            if ((user = &container_of(_user_node, struct channel_irc_user_node, node)->user) != NULL)
 
 #endif
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_CLOCK_H
+#define INCLUDE_CLOCK_H
+
+#include "global.h"
+
+#include <time.h>
+
+/* The clock is sampled once per pass through the event loop by
+ * 'clock_update', and everything handled during that pass sees the same time.
+ * The formatted timestamp for the log files is cached, and only reformatted
+ * when the second changes. */
+extern void   clock_update (void);
+extern time_t clock_now    (void);
+
+/* While handling a message that carried an IRCv3 'server-time' tag, the
+ * message's time is used for timestamps instead of the current time.
+ * 'set_message_time' takes the value of the 'time' tag, and returns -1 if it
+ * couldn't be parsed. */
+extern int  clock_set_message_time   (const char *server_time);
+extern void clock_clear_message_time (void);
+
+/* The time of the message being handled, 'clock_now' if it had none */
+extern time_t clock_message_now (void);
+
+/* Returns the timestamp for log lines, as "YYYY-MM-DD HH-MM-SS:". The string
+ * belongs to the clock, and stays valid until the next update. */
+extern const char *clock_timestamp (size_t *len);
+
+/* Formats 't' the same way into 'buf', returning the length */
+extern size_t clock_format (time_t t, char *buf, size_t size);
+
+/* Parses an ISO 8601 timestamp in UTC, as used by 'server-time'. Returns 0 on
+ * success and -1 on failure */
+extern int clock_parse_server_time (const char *server_time, time_t *);
+
+#endif
@@ -14,8 +14,29 @@
 
 struct network;
 
+/* By default, let five lines out at once and then one a second after that */
+#define DEFAULT_FLOOD_BURST 5
+#define DEFAULT_FLOOD_INTERVAL 1000
+
+/* PING the server after 30 seconds, and give up on the connection if the
+ * PONG takes more then 60 */
+#define DEFAULT_PING_INTERVAL 30000
+#define DEFAULT_PING_TIMEOUT 60000
+
 struct network_config {
     unsigned int remove_files_on_close :2;
+
+    /* Keep a binary record log of each channel, see 'reclog.h' */
+    unsigned int record_log :1;
+
+    /* Flood control for lines sent to the server, see sendq_set_rate. An
+     * interval of zero means lines aren't limited. */
+    unsigned int flood_burst;
+    unsigned int flood_interval;
+
+    /* Keepalive, in milliseconds. An interval of zero turns it off. */
+    unsigned int ping_interval;
+    unsigned int ping_timeout;
 };
 
 struct config {
@@ -25,6 +46,9 @@ struct config {
     char *config_file;
     char *root_directory;
 
+    /* How many channel log files are kept open at once */
+    unsigned int max_open_logs;
+
     struct network_config net_global_conf;
 
     unsigned int arg_stay_in_forground :1;
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_EVENT_H
+#define INCLUDE_EVENT_H
+
+#include "global.h"
+
+#define EVENT_IN  0x01
+#define EVENT_OUT 0x02
+#define EVENT_ERR 0x04
+
+struct event_fd;
+struct buf_fd;
+
+typedef void (*event_handler) (struct event_fd *, unsigned int events);
+
+/* 'event_fd' represents a file-descriptor registered with the event loop. It
+ * is meant to be embedded into whatever structure owns the fd (A channel, a
+ * network, etc.), so that the handler can get back to the owner via
+ * container_of. Registrations are persistent: they stay in the loop until
+ * event_del is called, so the fd should always be removed before it's
+ * closed. */
+struct event_fd {
+    int fd;
+    unsigned int events;
+    event_handler handler;
+
+    /* The buffer the fd is read through, if it was added with
+     * 'event_add_buf' */
+    struct buf_fd *in;
+};
+
+/* An fd that is ready, along with the events that were triggered */
+struct event_ready {
+    struct event_fd *ev;
+    unsigned int events;
+};
+
+/* Each backend implements these operations. 'wait' fills in at most 'max'
+ * entries of the ready array, and returns the number filled in (Or -1 on
+ * error). 'timeout' is in milliseconds, with -1 meaning forever. */
+struct event_backend {
+    const char *name;
+    int  (*init)  (void);
+    void (*clear) (void);
+    int  (*add)   (struct event_fd *);
+    int  (*mod)   (struct event_fd *);
+    void (*del)   (struct event_fd *);
+    int  (*wait)  (struct event_ready *, int max, int timeout);
+};
+
+extern const struct event_backend event_uring_backend;
+extern const struct event_backend event_epoll_backend;
+extern const struct event_backend event_select_backend;
+
+/* Picks the best available backend. io_uring is used if the program was
+ * compiled with FIRCD_IO_URING and the kernel supports it, then epoll is used
+ * on Linux unless the program was compiled with FIRCD_SELECT, and select() is
+ * used everywhere else (Or if the others fail to initalize) */
+extern int  event_init  (void);
+extern void event_clear (void);
+
+extern void event_fd_init (struct event_fd *);
+
+extern int  event_add (struct event_fd *, int fd, unsigned int events, event_handler);
+
+/* Adds the fd of 'buf', for a handler which reads it with 'buf_handle_input'.
+ * A backend which can do the reads itself (io_uring) hands what it read to
+ * 'buf' before calling the handler, so 'buf_handle_input' has nothing left
+ * to read. With the others this is the same as 'event_add'. */
+extern int  event_add_buf (struct event_fd *, struct buf_fd *buf, unsigned int events, event_handler);
+extern int  event_mod (struct event_fd *, unsigned int events);
+extern void event_del (struct event_fd *);
+
+/* Waits for events and then calls the handler for every ready fd. Returns
+ * the number of fd's that were ready. */
+extern int event_wait (int timeout);
+
+#endif
@@ -0,0 +1,63 @@
+/*
+ * hash.h - Implementation of a generic intrusive hash table
+ *
+ * Like the rb-tree, the table does no memory management of its own for the
+ * entries. A 'hash_node' is meant to be embedded into another structure, and
+ * container_of used to get back to that structure. The table doesn't know
+ * anything about keys either: The caller computes the hash, and then walks
+ * the matching nodes with hash_foreach_match comparing the keys itself.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_HASH_H
+#define INCLUDE_HASH_H
+
+#include "global.h"
+
+struct hash_node {
+    struct hash_node *next;
+    unsigned int hash;
+};
+
+/*
+ * The number of buckets is always a power of two, and is doubled whenever the
+ * number of entries passes it, so chains stay short.
+ *
+ * The table should be initalized with hash_init before use, and hash_clear
+ * frees the buckets (But not the entries) when done.
+ */
+struct hash_table {
+    struct hash_node **buckets;
+    unsigned int bucket_count;
+    unsigned int count;
+};
+
+extern void hash_init  (struct hash_table *);
+extern void hash_clear (struct hash_table *);
+
+/* 'hash_add' doesn't check for duplicates, that's up to the caller */
+extern void hash_add    (struct hash_table *, struct hash_node *, unsigned int hash);
+extern void hash_remove (struct hash_table *, struct hash_node *);
+
+/* Returns the first/next node with the given hash value */
+extern struct hash_node *hash_first (const struct hash_table *, unsigned int hash);
+extern struct hash_node *hash_next  (const struct hash_node *, unsigned int hash);
+
+#define hash_foreach_match(table, hashval, node) \
+    for (node = hash_first(table, hashval); \
+         node != NULL; \
+         node = hash_next(node, hashval))
+
+/* Iterates over every node in the table. 'tmp' holds the next node, so
+ * 'node' can be removed or moved to another table inside the loop */
+#define hash_foreach_safe(table, i, node, tmp) \
+    for (i = 0; i < (table)->bucket_count; i++) \
+        for (node = (table)->buckets[i]; \
+             node != NULL && ((tmp = node->next), 1); \
+             node = tmp)
+
+#endif
@@ -11,13 +11,22 @@
 #include "global.h"
 
 #include <stdarg.h>
+#include <sys/socket.h>
 
 #include "channel.h"
 #include "network.h"
-#include "array.h"
 
 #define CRLF "\r\n"
 
+/* RFC 2812 allows at most 15 parameters (Including the trailing one) */
+#define IRC_MAX_PARAMS 15
+
+/* IRCv3 message tags past this many are ignored */
+#define IRC_MAX_TAGS 16
+
+/* The longest line we can send, not counting the CRLF */
+#define IRC_MAX_LINE 510
+
 enum irc_reply_code;
 
 /* Enum containing all of the possible reply codes from an IRC server */
@@ -25,6 +34,7 @@ enum irc_reply_code {
     RPL_WELCOME = 1,           RPL_YOURHOST = 2,
     RPL_CREATED = 3,           RPL_MYINFO = 4,
     RPL_BOUNCE = 5,            RPL_USERHOST = 302,
+    RPL_ISUPPORT = 5,
     RPL_ISON = 303,            RPL_AWAY = 301,
     RPL_UNAWAY = 305,          RPL_NOWAWAY = 306,
     RPL_WHOISUSER = 311,       RPL_WHOISSERVER = 312,
@@ -44,7 +54,7 @@ enum irc_reply_code {
     RPL_BANLIST = 367,         RPL_ENDOFBANLIST = 368,
     RPL_INFO = 371,            RPL_ENDOFINFO = 374,
     RPL_MOTDSTART = 375,       RPL_MOTD = 372,
-    RPL_ENDOFMPTD = 367,       RPL_YOUREOPER = 381,
+    RPL_ENDOFMOTD = 376,       RPL_YOUREOPER = 381,
     RPL_REHASHING = 382,       RPL_YOURSERVICE = 383,
     RPL_TIME = 391,            RPL_USERSTART = 392,
     RPL_USERS = 393,           RPL_ENDOFUSERS = 394,
@@ -91,36 +101,121 @@ enum irc_reply_code {
     ERR_CHANOPRIVSNEEDED = 482, ERR_CANTKILLSERVER = 483,
     ERR_RESTRICTED = 484,       ERR_UNIQOPPRIVSNEEDED = 485,
     ERR_NOOPERHOST = 491,       ERR_UMODEUNKNOWNFLAG = 501,
-    ERR_USERSDONTMATCH = 502
+    ERR_USERSDONTMATCH = 502,
+
+    /* Named commands are given codes past the end of the numeric replies, so
+     * that every message can be dispatched through one table indexed by its
+     * code. */
+    IRC_NUMERIC_MAX = 1000,
+
+    CMD_UNKNOWN = IRC_NUMERIC_MAX,
+    CMD_PING,    CMD_PONG,
+    CMD_PRIVMSG, CMD_NOTICE,
+    CMD_JOIN,    CMD_PART,
+    CMD_QUIT,    CMD_NICK,
+    CMD_TOPIC,   CMD_MODE,
+    CMD_KICK,    CMD_INVITE,
+    CMD_KILL,    CMD_ERROR,
+    CMD_AWAY,    CMD_WALLOPS,
+    CMD_CAP,     CMD_AUTHENTICATE,
+
+    IRC_CODE_COUNT
+};
+
+/* A parsed message from the server. Nothing in here is allocated: every
+ * string points into the line that was parsed, which is split up in-place by
+ * replacing the separators with NUL's. Thus, an irc_reply is only valid for as
+ * long as the line it was parsed from.
+ *
+ * For the prefix, 'nick' is the server name when the message didn't come
+ * from a user, and 'user' and 'host' are NULL if they weren't included.
+ *
+ * 'params' contains the middle parameters, and 'trailing' is the last
+ * parameter if there was one (Usually the one starting with a ':').
+ * irc_reply_param treats both as one list, so handlers don't have to care
+ * whether the server sent the last parameter with a ':' or not.
+ *
+ * 'tags' are the IRCv3 message tags, if the server sent any. A tag without a
+ * value has an empty 'value'. The values aren't unescaped. */
+struct irc_tag {
+    char *key;
+    char *value;
 };
 
 struct irc_prefix {
-    char *raw;
+    char *nick;
     char *user;
     char *host;
 };
 
 struct irc_reply {
-    char *raw;
+    int tag_count;
+    struct irc_tag tags[IRC_MAX_TAGS];
 
     struct irc_prefix prefix;
 
+    /* The numeric, or the CMD_* code for named commands */
     enum irc_reply_code code;
     char *cmd;
-    ARRAY(char*, lines);
-    char  *colon;
+
+    int param_count;
+    char *params[IRC_MAX_PARAMS];
+    char *trailing;
 };
 
-extern struct irc_reply *irc_parse_line (const char *line);
+/* Returns 0 on success, and -1 if the line isn't a valid message */
+extern int irc_parse_line (char *line, struct irc_reply *rpl);
+
+extern const char *irc_reply_param (const struct irc_reply *rpl, int index);
+
+/* Returns the value of the tag 'key', or NULL if the message doesn't have it */
+extern const char *irc_reply_tag (const struct irc_reply *rpl, const char *key);
 
-extern void irc_reply_free (struct irc_reply *rpl);
+/* Turns a named command into its CMD_* code (CMD_UNKNOWN if there isn't one) */
+extern enum irc_reply_code irc_cmd_lookup (const char *cmd);
+
+/* Lines aren't written right away, they're added to the network's 'sendq'
+ * and sent together at the end of the loop iteration, as flood control
+ * allows. 'class' decides which lines go first, and 'target' (If not NULL)
+ * is the channel or nick the line is for, so it can be dropped if we leave
+ * before it's sent. 'send_raw' sends an interactive line with no target. */
+extern void irc_sendv      (struct network *, enum sendq_class, const char *target, const char *text, va_list);
+extern void irc_send       (struct network *, enum sendq_class, const char *target, const char *text, ...);
 extern void irc_send_raw   (struct network *, const char *text, ...);
-extern void irc_connect    (struct network *);
+/* 'connect' starts a non-blocking connect to 'addr', and returns the new
+ * socket, or -1 on failure. Once the socket is writable, 'connect_finish'
+ * returns 0 if the connect succeeded, or -1 with errno set if it failed. */
+extern int  irc_connect        (const struct sockaddr *addr, socklen_t len);
+extern int  irc_connect_finish (int fd);
 extern void irc_nick       (struct network *);
 extern void irc_user       (struct network *);
 extern void irc_pass       (struct network *);
+extern void irc_cap_req    (struct network *, const char *caps);
+extern void irc_cap_end    (struct network *);
 extern void irc_privmsg    (struct network *, const char *chan, const char *text);
 extern void irc_join       (struct network *, const char *chan);
+
+/* Packs the JOINs for a list of channels into as few lines as possible,
+ * with at most 'max_targets' channels per line (Zero for no limit). Keys go
+ * with channels by position, so channels with keys should be added before
+ * the ones without. 'flush' sends whatever is left.
+ *
+ * The lines are queued with SENDQ_TARGET_LIST, so leaving a channel before
+ * its JOIN goes out takes it back out of the line. */
+struct irc_join_batch {
+    struct network *net;
+    unsigned int max_targets;
+
+    unsigned int count, key_count;
+    size_t chans_len, keys_len;
+    char chans[IRC_MAX_LINE + 1];
+    char keys[IRC_MAX_LINE + 1];
+};
+
+extern void irc_join_batch_init  (struct irc_join_batch *, struct network *, unsigned int max_targets);
+extern void irc_join_batch_add   (struct irc_join_batch *, const char *chan, const char *key);
+extern void irc_join_batch_flush (struct irc_join_batch *);
+
 extern void irc_part       (struct network *, const char *chan, const char *msg);
 extern void irc_quit       (struct network *, const char *msg);
 
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_ISUPPORT_H
+#define INCLUDE_ISUPPORT_H
+
+#include "global.h"
+
+#include "casemap.h"
+
+/* The most CHANLIMIT groups (Ex. "#&:100,+:10" is two) that are kept */
+#define ISUPPORT_CHANLIMIT_MAX 8
+
+/* What the server uses until it says otherwise in RPL_ISUPPORT */
+#define ISUPPORT_DEFAULT_CHANTYPES "#&+!"
+#define ISUPPORT_DEFAULT_PREFIX "(ov)@+"
+#define ISUPPORT_DEFAULT_NICKLEN 9
+#define ISUPPORT_DEFAULT_MODES 3
+
+/* Bits of 'isupport.class', for each character */
+#define ISUPPORT_CHANTYPE 0x01 /* Starts a channel name */
+#define ISUPPORT_PREFIX   0x02 /* Marks a member's status in NAMES */
+#define ISUPPORT_OP       0x04 /* A status of channel operator or above */
+#define ISUPPORT_VOICE    0x08 /* The status given by +v */
+
+/* The parts of a server's RPL_ISUPPORT that we use, turned into tables so
+ * that looking at a character is a single load.
+ *
+ * 'prefix_mode' maps a PREFIX symbol to its mode letter. 'chanlimit_group'
+ * maps a channel type to its CHANLIMIT group in 'chanlimit' (Plus one, zero
+ * means no limit). 'join_targmax' is how many channels one JOIN can name
+ * (TARGMAX), 'modes' is how many modes one MODE can carry, and both are zero
+ * if there's no limit. */
+struct isupport {
+    unsigned char class[256];
+    unsigned char prefix_mode[256];
+    unsigned char chanlimit_group[256];
+    unsigned int chanlimit[ISUPPORT_CHANLIMIT_MAX];
+
+    enum irc_casemapping casemapping;
+    unsigned int nicklen;
+    unsigned int modes;
+    unsigned int join_targmax;
+};
+
+extern void isupport_init (struct isupport *);
+
+/* Takes one RPL_ISUPPORT token (Ex. "PREFIX=(ov)@+"). Tokens we don't use
+ * are ignored, and a negated one (Ex. "-PREFIX") goes back to the default. */
+extern void isupport_parse (struct isupport *, const char *token);
+
+#define isupport_class(is, ch) ((is)->class[(unsigned char)(ch)])
+
+#define isupport_is_prefix(is, ch) (isupport_class(is, ch) & ISUPPORT_PREFIX)
+#define isupport_is_channel(is, name) (isupport_class(is, (name)[0]) & ISUPPORT_CHANTYPE)
+
+#endif
@@ -10,39 +10,36 @@
 
 #include "global.h"
 
-#include <sys/select.h>
-
 #include "buf.h"
+#include "event.h"
 #include "config.h"
 
 struct network;
 
+/* 'dirfd' is the root directory, which every network's directory is
+ * created in */
 struct network_cons {
     struct network *head;
+    int dirfd;
 
     struct buf_fd cmdfd;
+    struct event_fd cmd_ev;
 };
 
-#define FDADD_FD_TO_CON(con, fd) \
-    do { \
-        if ((fd) != -1) \
-            FD_SET((fd), &con->infd); \
-        if ((fd) > (con->maxfd)) \
-            (con->maxfd) = (fd); \
-    } while (0)
-
-#define FDCLR_FD_FROM_CON(con, fd) \
-    do { \
-        FD_CLR((fd), &con->infd); \
-    } while (0)
-
 extern void network_cons_init  (struct network_cons *);
 extern void network_cons_clear (struct network_cons *);
 
-extern void network_cons_init_directory (struct network_cons *);
+/* Creates the root directory 'root' and everything under it */
+extern void network_cons_init_directory (struct network_cons *, const char *root);
 extern void network_cons_connect_networks (struct network_cons *);
-extern void network_cons_set_select_desc (struct network_cons *, fd_set *, fd_set *, int *);
-extern void network_cons_handle_file_check (struct network_cons *, fd_set *, fd_set *);
+
+/* Flushes the dirty state files of every network, called once per
+ * event-loop iteration */
+extern void network_cons_flush (struct network_cons *);
+
+/* Called after every pass through the event loop, this closes and frees any
+ * networks that were marked to be closed by their handlers */
+extern void network_cons_check_networks (struct network_cons *);
 extern void network_cons_load_config (struct network_cons *);
 
 #endif
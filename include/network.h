@@ -11,49 +11,156 @@
 #include "global.h"
 
 #include <sys/types.h>
-#include <sys/select.h>
 
 #include "array.h"
 #include "channel.h"
+#include "event.h"
+#include "outbuf.h"
+#include "resolver.h"
+#include "sendq.h"
+#include "timer.h"
+#include "hash.h"
+#include "casemap.h"
+#include "isupport.h"
 #include "config.h"
 
 #define DEFAULT_PORT 6667
 
+/* How long to wait on a connect before also trying the next address (The
+ * "Connection Attempt Delay" of RFC 8305) */
+#define NETWORK_ATTEMPT_DELAY 250
+
+/* Bounds on the wait before reconnecting, in milliseconds */
+#define NETWORK_RECONNECT_MIN 1000
+#define NETWORK_RECONNECT_MAX 300000
+
+/* Where the network is in connecting to the server.
+ * RESOLVING   - Waiting on the resolver for the server's addresses
+ * CONNECTING  - Non-blocking connects to the addresses are in progress
+ * REGISTERING - Connected, and NICK/USER have been sent
+ * CONNECTED   - The server welcomed us, and channels have been joined
+ */
+enum network_state {
+    NETWORK_DISCONNECTED,
+    NETWORK_RESOLVING,
+    NETWORK_CONNECTING,
+    NETWORK_REGISTERING,
+    NETWORK_CONNECTED
+};
+
 enum network_login {
     LOGIN_NONE,
     LOGIN_NICKSERV,
     LOGIN_SASL
 };
 
+/* Channels are kept on a linked-list for iterating, and are also indexed in
+ * the network's 'channel_hash' by their case-folded name for lookups. This
+ * includes private-message "channels", which are named after the user. */
 struct network_channel_node {
     struct channel chan;
     struct network_channel_node *next;
+    struct hash_node hnode;
 };
 
 struct network_cons;
+struct network;
+
+/* Round-trip times of our keepalive PINGs, in milliseconds. 'ewma' is
+ * smoothed the same way TCP smooths its RTT (1/8 of each new sample). */
+struct network_lag {
+    long long last, min, max, ewma;
+    long long total;
+    unsigned int samples;
+};
+
+/* A connect to one of the server's addresses that's still in progress */
+struct network_attempt {
+    struct network *net;
+    int fd;
+    struct event_fd ev;
+};
 
 struct network {
     struct network_cons *con;
     struct network *next;
 
     struct network_channel_node *first_channel;
+    struct hash_table channel_hash;
+
+    /* Every user we share a channel with, see 'struct irc_net_user' */
+    struct hash_table user_hash;
+
+    /* What the server told us in RPL_ISUPPORT, reset on every connect.
+     * 'casemap' is the fold table for 'isupport.casemapping' */
+    struct isupport isupport;
+    const unsigned char *casemap;
 
     enum network_login login_type;
+    enum network_state state;
 
     char *name;
     char *url;
     int   portno;
     struct buf_fd sock;
+    struct event_fd sock_ev;
+
+    /* Lines waiting to be sent to the server. They're sent at the end of the
+     * loop iteration they were queued in, and the socket is only watched for
+     * writability while some are left over. Lines held back by flood control
+     * are sent once 'send_timer' goes off. */
+    struct sendq sendq;
+    struct timer send_timer;
+
+    /* Used while connecting. Connects to the addresses in 'addrs' are
+     * started one at a time, 'connect_timer' apart, and the first one to
+     * finish wins (Happy Eyeballs) */
+    struct resolver_req resolve;
+    struct resolver_addr addrs[RESOLVER_MAX_ADDRS];
+    int addr_count, addr_next;
+    struct network_attempt attempts[RESOLVER_MAX_ADDRS];
+    struct timer connect_timer;
+
+    /* When the connection is lost, or can't be made, 'reconnect_timer' is
+     * set to try again. 'reconnect_tries' counts the tries since we were
+     * last registered, and decides the backoff. */
+    struct timer reconnect_timer;
+    unsigned int reconnect_tries;
+
+    /* Keepalive. Once registered, 'ping_timer' sends a PING carrying
+     * 'ping_token' every 'conf.ping_interval', and then waits
+     * 'conf.ping_timeout' for the matching PONG before giving up on the
+     * connection. */
+    struct timer ping_timer;
+    unsigned int ping_token;
+    long long ping_sent;
+    unsigned int ping_pending :1;
+    struct network_lag lag;
+
+    /* Set once our channels have been JOINed on this connection */
+    unsigned int channels_joined :1;
 
     char *realname;
     char *nickname, *password;
 
     ARRAY(char*, joined);
+
+    /* The network's directory, all of its files (And its channels'
+     * directories) are created relative to it */
+    int dirfd;
     struct buf_fd cmdfd;
-    int joinedfd, motdfd, rawfd, realnamefd, nicknamefd;
+    struct event_fd cmd_ev;
+    struct outbuf raw, motd;
+    int joinedfd, realnamefd, nicknamefd, lagfd;
 
     struct network_config conf;
     unsigned int close_network :1;
+
+    /* Channels with state files that need rewriting, and the network's own
+     * out of date files, see 'network_flush' */
+    struct channel *first_dirty;
+    unsigned int joined_dirty :1;
+    unsigned int lag_dirty :1;
 };
 
 #define network_foreach_channel(net, ch) \
@@ -62,15 +169,40 @@ struct network {
          ch = &(container_of(ch, struct network_channel_node, chan)->next->chan))
 
 extern void network_init             (struct network *);
-extern void network_init_select_desc (struct network *, fd_set *infd, fd_set *outfd, int *maxfd);
 extern void network_setup_files      (struct network *);
-extern void network_handle_input     (struct network *, fd_set *, fd_set *);
 extern void network_connect          (struct network *);
+
+/* Called on RPL_WELCOME, finishes registration by joining our channels */
+extern void network_registered       (struct network *);
+
+/* Called at the end of the MOTD, when the server's RPL_ISUPPORT is known.
+ * Joins all of our channels, packed into as few lines as possible. */
+extern void network_join_channels    (struct network *);
+
+/* Takes one RPL_ISUPPORT token, and rebuilds any indexes that depend on the
+ * case-mapping if it changed */
+extern void network_isupport         (struct network *, const char *token);
+
+/* Called on PONG with its token, checks it against our keepalive PING */
+extern void network_pong             (struct network *, const char *token);
 extern struct network *network_copy  (struct network *);
 
 extern struct channel *network_add_channel (struct network *, const char *channel);
 extern struct channel *network_find_channel (struct network *, const char *channel);
 
+/* The network's user registry.
+ * 'find_user' looks up a user by nick without taking a reference.
+ * 'get_user' returns the user with that nick, creating it if needed, and
+ *     takes a reference on it. 'put_user' drops the reference again.
+ * 'user_quit' removes the user from every channel it's in.
+ * 'user_change' renames the user, in every channel it's in.
+ */
+extern struct irc_net_user *network_find_user (struct network *, const char *nick);
+extern struct irc_net_user *network_get_user  (struct network *, const char *nick);
+extern void network_put_user    (struct network *, struct irc_net_user *);
+extern void network_user_quit   (struct network *, const char *nick);
+extern void network_user_change (struct network *, const char *old, const char *new);
+
 extern void network_quit      (struct network *);
 extern void network_clear     (struct network *);
 extern void network_clear_all (struct network *);
@@ -81,6 +213,14 @@ extern void network_write_realname   (struct network *);
 extern void network_write_motd_start (struct network *);
 extern void network_write_motd_line  (struct network *, const char *motd);
 extern void network_write_joined     (struct network *);
+extern void network_write_lag        (struct network *);
+
+/* Drops any lines queued for 'target' that haven't been sent yet */
+extern void network_drop_queued (struct network *, const char *target);
+
+/* Sends any queued lines, and writes out any state files marked dirty since
+ * the last flush */
+extern void network_flush (struct network *);
 
 
 #endif
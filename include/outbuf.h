@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_OUTBUF_H
+#define INCLUDE_OUTBUF_H
+
+#include "global.h"
+
+#include <stdarg.h>
+#include <sys/types.h>
+
+#include "writer.h"
+
+/* Once this many bytes are pending, the buffer is written out right away
+ * instead of waiting for the end of the loop iteration */
+#define OUTBUF_FLUSH_SIZE 4096
+
+/* If the fd won't take any more data, pending output past this is dropped */
+#define OUTBUF_MAX_SIZE (64 * 1024)
+
+/* How many files opened with 'outbuf_open_at' are kept open by default */
+#define OUTBUF_DEFAULT_MAX_OPEN 256
+
+/* A userspace append buffer in front of an output file. Writes are formatted
+ * straight into 'buf', and any buffer with pending data is kept on a global
+ * list, so that they can all be flushed with 'outbuf_flush_all' at the end
+ * of every event-loop iteration.
+ *
+ * The file is either an 'fd' that's always open, or a 'path' relative to
+ * 'dirfd' set with 'outbuf_open_at'. The latter is only opened when there's
+ * data to write (Through 'writer_open_at', so a slow disk doesn't block the
+ * event loop), and is kept on a LRU list of open files. When more then
+ * 'outbuf_set_max_open' of them are open, the least recently written one is
+ * closed, to be opened again (With O_APPEND) the next time it's needed.
+ *
+ * Instead of a file, the data can go to a 'sink' set with 'outbuf_set_sink',
+ * which gets the whole buffer on the writer thread (See 'writer_call'). */
+struct outbuf {
+    int fd;
+
+    int dirfd;
+    char *path;
+
+    writer_fn sink;
+    void *sink_arg;
+
+    char *buf;
+    size_t len, size;
+
+    struct outbuf *next_pending, **prev_pending;
+    struct outbuf *lru_next, *lru_prev;
+};
+
+extern void outbuf_init  (struct outbuf *);
+
+/* Sets the buffer's file to 'path' in 'dirfd', opened when first written */
+extern void outbuf_open_at (struct outbuf *, int dirfd, const char *path);
+extern void outbuf_set_max_open (unsigned int max);
+
+/* Sends the buffer's data to 'sink' instead of a file */
+extern void outbuf_set_sink (struct outbuf *, writer_fn sink, void *arg);
+
+/* Flushes any pending output, and then closes the fd */
+extern void outbuf_close (struct outbuf *);
+
+extern void outbuf_write   (struct outbuf *, const char *data, size_t len);
+extern void outbuf_puts    (struct outbuf *, const char *str);
+extern void outbuf_printf  (struct outbuf *, const char *format, ...);
+extern void outbuf_printfv (struct outbuf *, const char *format, va_list list);
+
+extern void outbuf_flush     (struct outbuf *);
+extern void outbuf_flush_all (void);
+
+#endif
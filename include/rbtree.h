@@ -146,10 +146,11 @@ extern struct rbnode *rb_trav_next_inorder   (rb_trav_state *);
 extern struct rbnode *rb_trav_next_postorder (rb_trav_state *);
 
 /*
- * Macros for each use
+ * Macros for each use. The outer loop only exists to declare the traversal
+ * state, and runs exactly once.
  */
 #define rb_foreach(tree, node, type) \
-    for (rb_trav_state _rb_state; node != NULL;) \
+    for (rb_trav_state _rb_state, *_rb_once = &_rb_state; _rb_once != NULL; _rb_once = NULL) \
         for (node = rb_trav_first_##type##order(tree, &_rb_state); \
              node != NULL; \
              node = rb_trav_next_##type##order(&_rb_state))
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_RECLOG_H
+#define INCLUDE_RECLOG_H
+
+#include "global.h"
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "outbuf.h"
+
+/* A record is added to the index once every this many records */
+#define RECLOG_INDEX_INTERVAL 64
+
+/* Records bigger then this are taken to be corrupt by the reader */
+#define RECLOG_MAX_RECORD (128 * 1024)
+
+enum reclog_type {
+    RECLOG_MSG = 1,
+    RECLOG_TOPIC,
+    RECLOG_JOIN,
+    RECLOG_PART,
+    RECLOG_QUIT,
+    RECLOG_NICK,
+    RECLOG_TYPE_LAST
+};
+
+/* On disk, the 'log' file is a RECLOG_MAGIC header followed by records. Each
+ * record is this header, then 'nick_len' bytes of nick, and then the text
+ * for the rest of 'size' (Which counts the header). Neither is
+ * nul-terminated. Numbers are in the host's byte order. 'seq' is filled in
+ * by the writer thread. */
+struct reclog_hdr {
+    uint32_t size;
+    uint16_t type;
+    uint16_t nick_len;
+    uint64_t seq;
+    int64_t time;
+};
+
+#define RECLOG_MAGIC "FRCL\001\0\0\0"
+#define RECLOG_MAGIC_LEN 8
+
+/* The 'log.idx' file is an array of these, one for every
+ * RECLOG_INDEX_INTERVAL records. 'time' is the latest time of any record up
+ * to this one, so it never goes backwards even when the records' times do
+ * (Ex. from 'server-time' playback), and it can be binary searched. */
+struct reclog_index {
+    uint64_t seq;
+    int64_t time;
+    uint64_t offset;
+};
+
+/* The writing side of a channel's record log. Records are appended to 'out',
+ * and each flush of it is handed to the writer thread (See
+ * 'outbuf_set_sink'), which numbers the records, appends them to the log and
+ * adds any index entries. So nothing here touches the disk on the event
+ * loop.
+ *
+ * The first flush after 'open' picks up where an existing log left off (On
+ * the writer thread): The next sequence number comes from the last record, a
+ * record cut off by a crash is truncated along with any index entries past
+ * it, and an index that's missing or doesn't match the log is rebuilt. */
+struct reclog_file;
+
+struct reclog {
+    struct outbuf out;
+    struct reclog_file *file;
+};
+
+extern void reclog_init  (struct reclog *);
+extern int  reclog_open  (struct reclog *, int dirfd, const char *dir);
+extern void reclog_close (struct reclog *);
+
+/* Does nothing if the log isn't open. 'nick' and 'text' can be NULL. */
+extern void reclog_append (struct reclog *, enum reclog_type, time_t, const char *nick, const char *text);
+
+/* A record read back out of a log. 'nick' and 'text' are nul-terminated, and
+ * belong to the reader until the next call to 'reclog_next'. */
+struct reclog_rec {
+    enum reclog_type type;
+    uint64_t seq;
+    time_t time;
+    const char *nick;
+    const char *text;
+};
+
+/* The reading side, for scrollback. The index is loaded when the reader is
+ * opened, so seeking is a binary search of it followed by a scan of at most
+ * RECLOG_INDEX_INTERVAL records.
+ *
+ * If a record at an indexed offset doesn't match its entry (Ex. output was
+ * dropped while the disk was stalled) the index is ignored from then on, and
+ * seeks fall back to scanning from the start. */
+struct reclog_reader {
+    int fd;
+
+    struct reclog_index *index;
+    size_t index_count;
+    unsigned int index_bad :1;
+
+    /* Where the next record starts, and the size of the file as last seen */
+    uint64_t offset;
+    uint64_t end;
+
+    char *buf;
+    size_t size;
+};
+
+extern int  reclog_reader_open  (struct reclog_reader *, int dirfd, const char *dir);
+extern void reclog_reader_close (struct reclog_reader *);
+
+/* Both leave the reader on the first record with a sequence number (Or time)
+ * of at least the one given, or at the end if there is none. */
+extern void reclog_seek_seq  (struct reclog_reader *, uint64_t seq);
+extern void reclog_seek_time (struct reclog_reader *, time_t);
+
+/* Returns 0 and fills in 'rec' with the next record, or -1 at the end of the
+ * log (Or at a corrupt record) */
+extern int reclog_next (struct reclog_reader *, struct reclog_rec *rec);
+
+/* Formats 'rec' as a line of the 'out' log, with its timestamp in front.
+ * Returns the length it needed, like 'snprintf'. */
+extern int reclog_render (const struct reclog_rec *rec, char *buf, size_t size);
+
+#endif
@@ -11,12 +11,22 @@
 #include "network.h"
 #include "irc.h"
 
+typedef void (*reply_handler_fn) (struct network *, struct irc_reply *);
+
 struct reply_handler {
-    const char *cmd;
     enum irc_reply_code code;
-    void (*handler) (struct network *, struct irc_reply *);
+    reply_handler_fn handler;
 };
 
+/* The list of built-in handlers, which replies_init registers */
 extern struct reply_handler reply_handler_list[];
 
+/* Handlers are kept in a table indexed by the reply's code (Numerics and
+ * CMD_* codes alike), so dispatching a reply is a single lookup no matter how
+ * many handlers there are. Replies without a handler go to a default handler
+ * that ignores them. */
+extern void replies_init   (void);
+extern void reply_register (enum irc_reply_code code, reply_handler_fn handler);
+extern void reply_dispatch (struct network *, struct irc_reply *);
+
 #endif
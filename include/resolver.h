@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_RESOLVER_H
+#define INCLUDE_RESOLVER_H
+
+#include "global.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* The most addresses kept for one host */
+#define RESOLVER_MAX_ADDRS 8
+
+/* How long, in seconds, answers are kept around, and how long a failed
+ * lookup is remembered before it's tried again */
+#define RESOLVER_CACHE_TTL 300
+#define RESOLVER_NEGATIVE_TTL 30
+
+struct resolver_addr {
+    struct sockaddr_storage addr;
+    socklen_t len;
+};
+
+struct resolver_req;
+struct resolver_entry;
+
+/* 'addrs' is ordered for Happy Eyeballs: The families alternate, starting
+ * with the one getaddrinfo preferred. 'count' is zero if the lookup failed.
+ * The addresses belong to the resolver, and are only valid during the
+ * callback. */
+typedef void (*resolver_callback) (struct resolver_req *, const struct resolver_addr *addrs, int count);
+
+/* A request is embedded in the structure waiting on the lookup, and the
+ * callback uses container_of to get back to it. */
+struct resolver_req {
+    struct resolver_req *next;
+    struct resolver_entry *entry;
+    resolver_callback callback;
+};
+
+/* 'init' starts the resolver thread, and 'clear' stops it and frees the
+ * cache */
+extern int  resolver_init  (void);
+extern void resolver_clear (void);
+
+extern void resolver_req_init (struct resolver_req *);
+
+/* Looks up 'host'. If there's a fresh answer in the cache, the callback is
+ * run before this returns. Otherwise the lookup is handed to the resolver
+ * thread, and the callback runs from the event loop once it's done. Requests
+ * for a host that's already being looked up wait on that lookup instead of
+ * starting another one. */
+extern void resolver_lookup (struct resolver_req *, const char *host, int port, resolver_callback);
+
+/* Drops a pending request, its callback won't be run */
+extern void resolver_cancel (struct resolver_req *);
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_SENDQ_H
+#define INCLUDE_SENDQ_H
+
+#include "global.h"
+
+#include <stdarg.h>
+#include <sys/types.h>
+
+/* The most lines handed to the kernel in one call */
+#define SENDQ_MAX_IOV 64
+
+/* Lines are released to the socket in order of their class, so keeping the
+ * connection alive (PONG) and interactive messages don't wait behind a long
+ * list of JOINs. Urgent lines aren't held back by the flood limit at all. */
+enum sendq_class {
+    SENDQ_URGENT,
+    SENDQ_INTERACTIVE,
+    SENDQ_BULK,
+    SENDQ_CLASS_COUNT
+};
+
+/* One complete line waiting to be sent, including the CRLF. 'target' is the
+ * channel or nick the line is for, if any, and is stored after the line.
+ * 'target_list' is set instead for a line sent with SENDQ_TARGET_LIST. */
+struct sendq_line {
+    struct sendq_line *next;
+    const char *target;
+    unsigned int target_list :1;
+    size_t len;
+    char buf[];
+};
+
+/* Given as the 'target' of a line whose first parameter is a comma separated
+ * list of targets, optionally followed by a list of keys which go with the
+ * first few of them by position (Ex. a JOIN of several channels). Dropping
+ * one of the targets takes it and its key out of the line, and the line is
+ * only dropped once none of its targets are left. */
+extern const char sendq_target_list[];
+#define SENDQ_TARGET_LIST sendq_target_list
+
+struct sendq_list {
+    struct sendq_line *head, **tail;
+};
+
+/* Lines wait in 'waiting' until the token bucket lets them go, and are then
+ * moved to 'out' to be written to the socket. 'offset' is how much of the
+ * first line in 'out' has already been sent, and 'bytes' is the total still
+ * waiting on both.
+ *
+ * The bucket holds 'burst' lines and refills at one line every 'interval'
+ * milliseconds. 'credit' is in milliseconds, and an 'interval' of zero turns
+ * the limit off. */
+struct sendq {
+    struct sendq_list waiting[SENDQ_CLASS_COUNT];
+    struct sendq_list out;
+    size_t offset;
+    size_t bytes;
+
+    unsigned int burst, interval;
+    long long credit, last;
+};
+
+extern void sendq_init  (struct sendq *);
+extern void sendq_clear (struct sendq *);
+
+/* Sets the flood limit, and fills the bucket back up */
+extern void sendq_set_rate (struct sendq *, unsigned int burst, unsigned int interval);
+
+/* Formats a line and adds it, along with the CRLF, to the end of the queue
+ * for its class. 'target' may be NULL. */
+extern void sendq_printfv (struct sendq *, enum sendq_class, const char *target, const char *format, va_list list);
+extern void sendq_printf  (struct sendq *, enum sendq_class, const char *target, const char *format, ...);
+
+/* Drops every line that hasn't been released yet for which 'match' returns
+ * true. Used to get rid of queued messages for a channel we've left. Lines
+ * with a SENDQ_TARGET_LIST are rewritten without the matching targets. */
+extern void sendq_drop (struct sendq *, int (*match) (const char *target, void *data), void *data);
+
+/* Releases as many lines as the bucket allows at time 'now' (In
+ * milliseconds), and writes as much as the socket will take, with one call
+ * per SENDQ_MAX_IOV lines. Returns 0 if everything went out or the socket is
+ * full, and -1 if the write failed. */
+extern int sendq_write (struct sendq *, int fd, long long now);
+
+/* Returns the milliseconds until the next waiting line can be released, or -1
+ * if no lines are waiting */
+extern int sendq_next_release (struct sendq *, long long now);
+
+extern int sendq_empty (struct sendq *);
+
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_TIMER_H
+#define INCLUDE_TIMER_H
+
+#include "global.h"
+
+struct timer;
+
+typedef void (*timer_handler) (struct timer *);
+
+/* The timers are kept on a hierarchical timing wheel: TIMER_WHEEL_LEVELS
+ * wheels of TIMER_WHEEL_SIZE slots each, where a slot on level 'n' covers
+ * TIMER_WHEEL_SIZE^n milliseconds. That covers a bit over four and a half
+ * hours, and longer timers just wait on the last slot and get put back. */
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+
+/* Timers are embedded in the structure that owns them, like 'struct
+ * event_fd', and the handler uses container_of to get back to it. A timer
+ * fires once; handlers that want to run again just re-add the timer.
+ *
+ * Times are in milliseconds on CLOCK_MONOTONIC. */
+struct timer {
+    struct timer *next, **prev;
+    long long expires;
+    timer_handler handler;
+
+    unsigned char level, slot;
+    unsigned int pending :1;
+};
+
+extern void timer_init (struct timer *);
+
+/* Both of these are O(1). Adding a timer that's already pending reschedules
+ * it */
+extern void timer_add (struct timer *, unsigned int ms, timer_handler);
+extern void timer_del (struct timer *);
+
+/* Returns the number of milliseconds until the next timer expires, or -1 if
+ * there are no timers. Suitable for passing to event_wait. This may come up
+ * short for timers more then TIMER_WHEEL_SIZE^3 milliseconds away, which
+ * just costs an extra wakeup. */
+extern int  timer_timeout (void);
+
+/* Runs the handlers of every expired timer */
+extern void timer_run (void);
+
+extern long long timer_now (void);
+
+#endif
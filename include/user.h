@@ -9,6 +9,8 @@
 #define INCLUDE_USER_H
 
 #include "rbtree.h"
+#include "hash.h"
+#include "isupport.h"
 
 struct irc_user_flags {
     unsigned int is_op    :1;
@@ -22,7 +24,19 @@ struct irc_user {
     struct irc_user_flags flags;
 };
 
-#define IS_USER_CHAR(ch) ((ch) == '@' || (ch) == '!' || (ch) == '&')
+struct channel_irc_user_node;
+
+/* A user as seen by the whole network, kept in the network's 'user_hash'.
+ * 'nick' is shared with the 'irc_user' of every channel the user is in, and
+ * 'refs' counts those channels. The entry is freed when the last one is
+ * removed. */
+struct irc_net_user {
+    char *nick;
+    unsigned int refs;
+
+    struct channel_irc_user_node *first_member;
+    struct hash_node hnode;
+};
 
 extern void irc_user_init(struct irc_user *);
 extern void irc_user_clear(struct irc_user *);
@@ -30,6 +44,9 @@ extern void irc_user_clear(struct irc_user *);
 extern void irc_user_cpy(struct irc_user *dest, const struct irc_user *src);
 
 extern void irc_user_format_nick(struct irc_user *);
-extern void irc_user_conv(struct irc_user *, char *name);
+/* Takes a name from NAMES, and strips its status prefixes (Using the
+ * server's PREFIX) into the user's flags. There can be more than one with
+ * the 'multi-prefix' capability (Ex. "@+nick"). */
+extern void irc_user_conv(struct irc_user *, const struct isupport *, char *name);
 
 #endif
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#ifndef INCLUDE_WRITER_H
+#define INCLUDE_WRITER_H
+
+#include "global.h"
+
+#include <sys/types.h>
+
+/* How many records can be waiting for the writer thread. Has to be a power
+ * of two. */
+#define WRITER_RING_SIZE 1024
+
+/* Once this many bytes of appends are waiting, 'writer_write' refuses more
+ * until the thread catches up */
+#define WRITER_MAX_BYTES (4 * 1024 * 1024)
+
+/* 'init' starts the writer thread, and 'clear' writes out everything still
+ * queued and then stops it. Without the thread (Ex. 'init' failed), every
+ * function here just does its work before returning. */
+extern int  writer_init  (void);
+extern void writer_clear (void);
+
+extern int writer_running (void);
+
+/* Appends 'len' bytes of 'buf' to 'fd'. 'buf' has to be from malloc, and on
+ * success it belongs to the writer, which frees it once it's written.
+ *
+ * Returns -1 if WRITER_MAX_BYTES are already waiting or the queue is full, in
+ * which case 'buf' still belongs to the caller and should be tried again
+ * later. */
+extern int writer_write (int fd, char *buf, size_t len);
+
+/* Calls 'fn(arg, buf, len)' on the thread, in order with everything else
+ * queued, and then frees 'buf' (Which has to be from malloc, or NULL). For
+ * work that has to be done off of the event loop, but doesn't fit the other
+ * records. With 'len' bytes of data it can be refused, like 'writer_write',
+ * but without any it never is. */
+typedef void (*writer_fn) (void *arg, char *buf, size_t len);
+
+extern int writer_call (writer_fn, void *arg, char *buf, size_t len);
+
+/* The same, but never refused: If the thread is behind they wait for room,
+ * and WRITER_MAX_BYTES is ignored. For the last of a buffer's data when it's
+ * closed, which has no later chance to be written. */
+extern void writer_write_wait (int fd, char *buf, size_t len);
+extern void writer_call_wait  (writer_fn, void *arg, char *buf, size_t len);
+
+/* Replaces the contents of 'fd' (Or of 'path' in 'dirfd') with a copy of
+ * 'buf'. These are small and already coalesced, so they're never refused. */
+extern void writer_replace    (int fd, const char *buf, size_t len);
+extern void writer_replace_at (int dirfd, const char *path, const char *buf, size_t len);
+
+/* Opens 'path' in 'dirfd' for appending to, without blocking the caller on
+ * the disk. The fd returned is a placeholder (A dup of /dev/null) which the
+ * thread opens the file onto, before getting to anything queued for it
+ * later. If the file can't be opened, what's written to it is thrown away.
+ * Without the thread the file is just opened. Returns -1 on failure. */
+extern int writer_open_at (int dirfd, const char *path, int flags);
+
+/* Removes 'path' from 'dirfd' (Like 'unlinkat') once everything queued before
+ * it is done, so that a queued open or rewrite can't create it again */
+extern void writer_unlink_at (int dirfd, const char *path, int flags);
+
+/* Closes 'fd' once everything queued before it has been written. Any fd
+ * which was handed to the writer has to be closed this way, so that it isn't
+ * reused while writes for it are still queued. */
+extern void writer_close (int fd);
+
+/* Waits until everything queued has been written */
+extern void writer_sync (void);
+
+#endif
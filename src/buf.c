@@ -11,10 +11,16 @@
  * unused but already allocated blocks, to be used in the event more storage is
  * needed. Increasing this count increases the total ammount of memory the
  * buffer will be using even when it's not in use, but it decreases the overall
- * number of malloc() calls. The default is to have a block size of 200 bytes
- * and an to hold a max of 4 empty blocks. Thus, when it's not in use the
- * buffer will be using up around 1kB of memory (Assuming it gets to the point
- * where it needs that many free blocks)
+ * number of malloc() calls. The default is to have a block size of 512 bytes
+ * (One full IRC line) and to hold a max of 4 empty blocks.
+ *
+ * Data is read straight into the free space at the end of the tail block, and
+ * into a fresh block with readv(), so there's no intermediate copy. The size
+ * of the fresh block adapts to the input: Every time a read fills all the
+ * space it was given, the next read is given twice as much (Up to
+ * BUF_MAX_READ), and it drops back down to the block size once the reads get
+ * short again. This way a large burst (Ex. A netsplit, or a big NAMES reply)
+ * is read in a few large chunks instead of many small ones.
  *
  * Copyright (C) 2013 Matt Kilgore
  *
@@ -26,7 +32,9 @@
 #include "global.h"
 
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <sys/uio.h>
 
 #include "debug.h"
 #include "buf.h"
@@ -34,7 +42,8 @@
 void buf_init(struct buf_fd *buf)
 {
     memset(buf, 0, sizeof(struct buf_fd));
-    buf->block_size = 200;
+    buf->block_size = 512;
+    buf->read_size = buf->block_size;
     buf->max_empty = 4;
     buf->fd = -1;
 }
@@ -50,141 +59,274 @@ void buf_free(struct buf_fd *buf)
         tmp = current->next_blk;
         free(current);
     }
+
+    free(buf->scratch);
+
+    buf->head = buf->tail = buf->empty_head = NULL;
+    buf->scratch = NULL;
+    buf->scratch_size = 0;
+    buf->empty_count = 0;
+    buf->has_line = 0;
 }
 
-static struct buf_blk *new_buf_block(struct buf_fd *buf)
+/* Returns a block with room for at least 'size' bytes. Empty blocks are
+ * reused when they're large enough */
+static struct buf_blk *new_buf_block(struct buf_fd *buf, size_t size)
 {
     struct buf_blk *new;
-    if (buf->empty_head == NULL) {
-        new = malloc(sizeof(struct buf_blk) + buf->block_size);
-        memset(new, 0, sizeof(struct buf_blk) + buf->block_size);
-        new->allocsize = buf->block_size;
+
+    if (size < buf->block_size)
+        size = buf->block_size;
+
+    if (buf->empty_head == NULL || buf->empty_head->allocsize < size) {
+        new = malloc(sizeof(struct buf_blk) + size);
+        new->allocsize = size;
     } else {
         new = buf->empty_head;
         buf->empty_head = buf->empty_head->next_blk;
-        new->next_blk = NULL;
-        new->offset = 0;
-        new->size = 0;
         buf->empty_count--;
     }
+
+    new->next_blk = NULL;
+    new->offset = 0;
+    new->size = 0;
     return new;
 }
 
+static void release_buf_block(struct buf_fd *buf, struct buf_blk *blk)
+{
+    if (buf->empty_count < buf->max_empty) {
+        blk->next_blk = buf->empty_head;
+        buf->empty_head = blk;
+        buf->empty_count++;
+    } else {
+        free(blk);
+    }
+}
+
+static unsigned int count_lines(const char *str, size_t len)
+{
+    const char *end = str + len;
+    unsigned int count = 0;
+
+    while ((str = memchr(str, '\n', end - str)) != NULL) {
+        count++;
+        str++;
+    }
+
+    return count;
+}
+
+/* Releases any blocks at the front of the buffer that have been completely
+ * read. The tail block is kept, and started over from the beginning if it's
+ * empty */
+static void buf_trim(struct buf_fd *buf)
+{
+    struct buf_blk *head;
+
+    while ((head = buf->head) != NULL && head->offset == head->size) {
+        if (head == buf->tail) {
+            head->offset = head->size = 0;
+            break;
+        }
+
+        buf->head = head->next_blk;
+        release_buf_block(buf, head);
+    }
+}
+
 void buf_handle_input(struct buf_fd *buf)
 {
-    size_t size = 200, tmp, offset;
+    struct iovec iov[2];
+    struct buf_blk *tail, *extra;
+    size_t room, total, tmp;
     ssize_t read_size;
-    struct buf_blk *cur_block, *tmp_blk;
-    char tmpbuf[size];
+    ssize_t got;
+    int iovcnt;
 
-    int i;
+    /* Whatever there was has already been handed to us */
+    if (buf->loop_reads)
+        return ;
 
     buf->errno_ret = 0;
     buf->closed_gracefully = 0;
-    errno = 0;
 
-    while ((read_size = read(buf->fd, tmpbuf, size)) != -1) {
-        if (read_size == 0) {
-            buf->errno_ret = errno;
-            buf->closed_gracefully = 1;
-            break;
+    buf_trim(buf);
+
+    while (1) {
+        tail = buf->tail;
+        iovcnt = 0;
+        room = 0;
+
+        if (tail && BUF_BLK_UNUSED(tail) > 0) {
+            room = BUF_BLK_UNUSED(tail);
+            iov[iovcnt].iov_base = tail->buf + tail->size;
+            iov[iovcnt].iov_len = room;
+            iovcnt++;
         }
 
-        for (i = 0; i < read_size; i++)
-            if (tmpbuf[i] == '\n')
-                buf->has_line += 1;
-
-        cur_block = buf->tail;
-
-        offset = 0;
-
-        while (read_size - offset != 0) {
-            tmp = read_size - offset;
-            if (cur_block == NULL)
-                tmp = 0;
-            else if (tmp > BUF_BLK_UNUSED(cur_block))
-                tmp = BUF_BLK_UNUSED(cur_block);
-
-            if (tmp == 0) {
-                tmp_blk = new_buf_block(buf);
-                if (buf->tail == NULL) {
-                    buf->head = buf->tail = tmp_blk;
-                } else {
-                    buf->tail->next_blk = tmp_blk;
-                    buf->tail = tmp_blk;
-                }
-                cur_block = tmp_blk;
-                continue; /* Loop again so 'tmp' is recalculated */
+        extra = new_buf_block(buf, buf->read_size);
+        iov[iovcnt].iov_base = extra->buf;
+        iov[iovcnt].iov_len = extra->allocsize;
+        iovcnt++;
+
+        total = room + extra->allocsize;
+
+        read_size = readv(buf->fd, iov, iovcnt);
+        got = read_size;
+        if (read_size <= 0) {
+            release_buf_block(buf, extra);
+            if (read_size == 0) {
+                buf->closed_gracefully = 1;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                buf->errno_ret = errno;
             }
+            break;
+        }
 
-            memcpy(cur_block->buf + cur_block->size, tmpbuf + offset, tmp);
+        if (room > 0) {
+            tmp = ((size_t)read_size < room)? (size_t)read_size: room;
+            buf->has_line += count_lines(tail->buf + tail->size, tmp);
+            tail->size += tmp;
+            read_size -= tmp;
+        }
 
-            (cur_block)->size += tmp;
+        if (read_size > 0) {
+            buf->has_line += count_lines(extra->buf, read_size);
+            extra->size = read_size;
+            if (buf->tail == NULL) {
+                buf->head = buf->tail = extra;
+            } else {
+                buf->tail->next_blk = extra;
+                buf->tail = extra;
+            }
+        } else {
+            release_buf_block(buf, extra);
+        }
 
-            offset += tmp;
+        /* A short read means the fd has been drained, so there's no need to
+         * make another call just to get EAGAIN back. */
+        if (got < total) {
+            buf->read_size = buf->block_size;
+            break;
         }
+
+        if (buf->read_size < BUF_MAX_READ)
+            buf->read_size *= 2;
+    }
+}
+
+void buf_add_input(struct buf_fd *buf, const char *data, size_t len)
+{
+    struct buf_blk *tail, *extra;
+    size_t room;
+
+    buf_trim(buf);
+
+    tail = buf->tail;
+    if (tail && BUF_BLK_UNUSED(tail) > 0) {
+        room = BUF_BLK_UNUSED(tail);
+        if (room > len)
+            room = len;
+
+        memcpy(tail->buf + tail->size, data, room);
+        buf->has_line += count_lines(tail->buf + tail->size, room);
+        tail->size += room;
+        data += room;
+        len -= room;
+    }
+
+    if (len == 0)
+        return ;
+
+    extra = new_buf_block(buf, len);
+    memcpy(extra->buf, data, len);
+    buf->has_line += count_lines(extra->buf, len);
+    extra->size = len;
+
+    if (buf->tail == NULL) {
+        buf->head = buf->tail = extra;
+    } else {
+        buf->tail->next_blk = extra;
+        buf->tail = extra;
     }
 }
 
-char *buf_read_line(struct buf_fd *buf)
+char *buf_next_line(struct buf_fd *buf, size_t *len)
 {
-    size_t size = 0;
-    char *ret, *curstr;
-    unsigned int i, found_newline = 0;
     struct buf_blk *cur_block, *tmp;
+    char *line, *newline = NULL;
+    size_t size = 0, piece;
 
     if (buf->has_line == 0)
         return NULL;
 
-    for (cur_block = buf->head; cur_block != NULL && found_newline == 0; cur_block = cur_block->next_blk) {
-        for (i = cur_block->offset; i < cur_block->size; i++) {
-            if (cur_block->buf[i] == '\n') {
-                found_newline = 1;
+    buf_trim(buf);
+
+    cur_block = buf->head;
+    line = cur_block->buf + cur_block->offset;
+    newline = memchr(line, '\n', cur_block->size - cur_block->offset);
+
+    if (newline) {
+        /* Common case: The whole line is inside of one block, so we can just
+         * terminate it in place and hand back a pointer into the block. */
+        size = newline - line;
+        cur_block->offset += size + 1;
+    } else {
+        /* The line crosses into the next block(s), so it has to be put back
+         * together in the scratch area. */
+        for (tmp = cur_block; tmp != NULL; tmp = tmp->next_blk) {
+            newline = memchr(tmp->buf + tmp->offset, '\n', tmp->size - tmp->offset);
+            if (newline) {
+                size += newline - (tmp->buf + tmp->offset);
                 break;
             }
+            size += tmp->size - tmp->offset;
+        }
+
+        if (size + 1 > buf->scratch_size) {
+            buf->scratch_size = size + 1;
+            buf->scratch = realloc(buf->scratch, buf->scratch_size);
         }
-        size += i - cur_block->offset;
-    }
 
-    ret = malloc(size + 1);
+        line = buf->scratch;
+        size = 0;
 
-    curstr = ret;
+        while (1) {
+            cur_block = buf->head;
+            newline = memchr(cur_block->buf + cur_block->offset, '\n', cur_block->size - cur_block->offset);
+            if (newline)
+                piece = newline - (cur_block->buf + cur_block->offset);
+            else
+                piece = cur_block->size - cur_block->offset;
 
-    found_newline = 0;
+            memcpy(line + size, cur_block->buf + cur_block->offset, piece);
+            size += piece;
 
-    for (cur_block = buf->head; cur_block != NULL && found_newline == 0; cur_block = tmp) {
-        tmp = cur_block->next_blk;
-        for (i = cur_block->offset; i < cur_block->size; i++) {
-            if (cur_block->buf[i] == '\n') {
-                found_newline = 1;
+            if (newline) {
+                cur_block->offset += piece + 1;
                 break;
             }
-        }
-        memcpy(curstr, cur_block->buf + cur_block->offset, i - cur_block->offset);
-        curstr += i - cur_block->offset;
-        cur_block->offset = i + 1;
-        if (cur_block->size == (cur_block->offset - 1) && cur_block->size == cur_block->allocsize) {
-            buf->head = cur_block->next_blk;
-            if (buf->head == NULL)
-                buf->tail = NULL;
 
-            if (buf->empty_count < buf->max_empty) {
-                cur_block->next_blk = buf->empty_head;
-                buf->empty_head = cur_block;
-                buf->empty_count++;
-            } else {
-                free(cur_block);
-            }
+            /* Every block before the one holding the newline was full, so
+             * it's never the tail and can be released right away */
+            buf->head = cur_block->next_blk;
+            release_buf_block(buf, cur_block);
         }
-    }
 
-    ret[size] = '\0';
+        newline = line + size;
+    }
 
-    if (ret[size - 1] == '\r')
-        ret[size - 1] = '\0';
+    *newline = '\0';
+    if (size > 0 && line[size - 1] == '\r')
+        line[--size] = '\0';
 
     buf->has_line--;
 
-    return ret;
-}
+    if (len)
+        *len = size;
 
+    return line;
+}
@@ -0,0 +1,86 @@
+/*
+ * ./casemap.c -- Case-insensitive hashing and comparing of nicknames and
+ *                channel names, following the server's CASEMAPPING
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <string.h>
+
+#include "debug.h"
+#include "casemap.h"
+
+static unsigned char fold_tables[3][256];
+static int tables_built = 0;
+
+static void build_tables(void)
+{
+    int i, map;
+
+    for (map = 0; map < 3; map++) {
+        for (i = 0; i < 256; i++)
+            fold_tables[map][i] = (i >= 'A' && i <= 'Z')? i + ('a' - 'A'): i;
+    }
+
+    fold_tables[CASEMAP_RFC1459]['['] = '{';
+    fold_tables[CASEMAP_RFC1459][']'] = '}';
+    fold_tables[CASEMAP_RFC1459]['\\'] = '|';
+    fold_tables[CASEMAP_RFC1459]['~'] = '^';
+
+    fold_tables[CASEMAP_STRICT_RFC1459]['['] = '{';
+    fold_tables[CASEMAP_STRICT_RFC1459][']'] = '}';
+    fold_tables[CASEMAP_STRICT_RFC1459]['\\'] = '|';
+
+    tables_built = 1;
+}
+
+const unsigned char *irc_casemap_table(enum irc_casemapping map)
+{
+    if (!tables_built)
+        build_tables();
+
+    return fold_tables[map];
+}
+
+int irc_casemap_parse(const char *name)
+{
+    if (strcmp(name, "rfc1459") == 0)
+        return CASEMAP_RFC1459;
+    else if (strcmp(name, "strict-rfc1459") == 0)
+        return CASEMAP_STRICT_RFC1459;
+    else if (strcmp(name, "ascii") == 0)
+        return CASEMAP_ASCII;
+
+    return -1;
+}
+
+/* FNV-1a, over the folded characters */
+unsigned int irc_casehash(const unsigned char *fold, const char *str)
+{
+    const unsigned char *s = (const unsigned char *)str;
+    unsigned int hash = 2166136261u;
+
+    for (; *s; s++) {
+        hash ^= fold[*s];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int irc_casecmp(const unsigned char *fold, const char *s1, const char *s2)
+{
+    const unsigned char *c1 = (const unsigned char *)s1;
+    const unsigned char *c2 = (const unsigned char *)s2;
+
+    for (; *c1 && fold[*c1] == fold[*c2]; c1++, c2++)
+        ;
+
+    return fold[*c1] - fold[*c2];
+}
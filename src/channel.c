@@ -17,102 +17,225 @@
 #include <unistd.h>
 #include <sys/fcntl.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 
 #include "debug.h"
 #include "array.h"
 #include "buf.h"
+#include "clock.h"
+#include "event.h"
 #include "irc.h"
 #include "net_cons.h"
 #include "rbtree.h"
+#include "hash.h"
+#include "casemap.h"
+#include "network.h"
 #include "user.h"
 #include "fassert.h"
+#include "writer.h"
 #include "channel.h"
 
+static void channel_unmark_dirty (struct channel *);
+
+static enum rbcomp channel_user_comp (const struct rbnode *node1, const struct rbnode *node2)
+{
+    const struct channel_irc_user_node *user1 = container_of(node1, const struct channel_irc_user_node, node);
+    const struct channel_irc_user_node *user2 = container_of(node2, const struct channel_irc_user_node, node);
+    int cmp = strcmp(user1->user.nick, user2->user.nick);
+
+    if (cmp == 0)
+        return RB_EQ;
+    else if (cmp < 0)
+        return RB_LT;
+    else
+        return RB_GT;
+}
+
 void channel_init (struct channel *chan)
 {
     fassert(chan);
     memset(chan, 0, sizeof(struct channel));
 
+    chan->users.compare = channel_user_comp;
+    hash_init(&chan->user_hash);
+
     buf_init(&chan->in);
+    event_fd_init(&chan->in_ev);
+
+    outbuf_init(&chan->out);
+    outbuf_init(&chan->raw);
+    outbuf_init(&chan->msgs);
+    reclog_init(&chan->reclog);
+}
+
+/* Drops a user node which has already been taken out of the channel's
+ * indexes, along with its reference on the network's user entry */
+static void channel_free_user (struct channel *chan, struct channel_irc_user_node *user)
+{
+    *user->prev_member = user->next_member;
+    if (user->next_member)
+        user->next_member->prev_member = user->prev_member;
+
+    network_put_user(chan->net, user->net_user);
+
+    free(user->user.formatted);
+    free(user);
 }
 
 void channel_clear (struct channel *current)
 {
     fassert(current);
-    struct channel_irc_user_node *user, *tmp;
+    struct channel_irc_user_node *user;
 
+    channel_unmark_dirty(current);
+
+    event_del(&current->in_ev);
     CLOSE_FD(current->in.fd);
     buf_free(&current->in);
 
-    CLOSE_FD(current->outfd);
-    CLOSE_FD(current->onlinefd);
-    CLOSE_FD(current->topicfd);
-    CLOSE_FD(current->rawfd);
-    CLOSE_FD(current->msgsfd);
+    outbuf_close(&current->out);
+    outbuf_close(&current->raw);
+    outbuf_close(&current->msgs);
+    reclog_close(&current->reclog);
 
     free(current->name);
+    free(current->dir);
+    free(current->key);
     free(current->topic);
     free(current->topic_user);
 
-    for (user = current->first_user; user != NULL; user = tmp) {
-        tmp = user->next;
-        irc_user_clear(&user->user);
-        free(user);
+    while (current->users.root != NULL) {
+        user = container_of(current->users.root, struct channel_irc_user_node, node);
+        rb_remove(&current->users, &user->node);
+        channel_free_user(current, user);
     }
+    hash_clear(&current->user_hash);
 
     free(current);
 }
 
+static void channel_handle_input (struct event_fd *, unsigned int);
+
+/* Returns the path of the file 'name' in the channel's directory, relative
+ * to the network's directory. It has to be freed. */
+static char *channel_path (struct channel *chan, const char *name)
+{
+    char *path = NULL;
+
+    alloc_sprintf(&path, "%s/%s", chan->dir, name);
+    return path;
+}
+
+/* Opens the file 'name' from the channel's directory as a log */
+static void channel_open_log (struct channel *chan, struct outbuf *out, const char *name)
+{
+    char *path = channel_path(chan, name);
+
+    outbuf_open_at(out, chan->net->dirfd, path);
+    free(path);
+}
+
+/* Rewrites the file 'name' from the channel's directory */
+static void channel_replace_file (struct channel *chan, const char *name, const char *buf, size_t len)
+{
+    char *path;
+
+    if (!chan->dir)
+        return ;
+
+    path = channel_path(chan, name);
+    writer_replace_at(chan->net->dirfd, path, buf, len);
+    free(path);
+}
+
 void channel_create_files (struct channel *chan)
 {
+    char *cur;
+    int dirfd;
+
     fassert(chan);
-    mkdir(chan->name, 0775);
-    chdir(chan->name);
 
-    mkfifo("in", 0772);
-    chan->in.fd = open("in", BUF_FIFO_OPEN_FLAGS, 0);
+    free(chan->dir);
+    chan->dir = strdup(chan->name);
+    for (cur = chan->dir; (cur = strchr(cur, '/')) != NULL; cur++)
+        *cur = ',';
+
+    /* The directory and 'in' fifo are made here instead of on the writer
+     * thread, since the fifo has to be open and in the event loop before
+     * this returns. It only happens once per channel, the logs that are
+     * opened over and over go through 'writer_open_at'. */
+    mkdirat(chan->net->dirfd, chan->dir, 0775);
+    dirfd = openat(chan->net->dirfd, chan->dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        DEBUG_PRINT("Unable to open the directory for %s", chan->name);
+        return ;
+    }
+
+    mkfifoat(dirfd, "in", 0772);
+    chan->in.fd = openat(dirfd, "in", BUF_FIFO_OPEN_FLAGS, 0);
+    event_add_buf(&chan->in_ev, &chan->in, EVENT_IN, channel_handle_input);
+
+    close(dirfd);
+
+    channel_open_log(chan, &chan->out, "out");
+    channel_open_log(chan, &chan->raw, "raw");
+    channel_open_log(chan, &chan->msgs, "msgs");
 
-    chan->outfd    = open("out",    BUF_FILE_OPEN_FLAGS, 0750);
-    chan->onlinefd = open("online", BUF_FILE_OPEN_FLAGS, 0750);
-    chan->topicfd  = open("topic",  BUF_FILE_OPEN_FLAGS, 0750);
-    chan->rawfd    = open("raw",    BUF_FILE_OPEN_FLAGS, 0750);
-    chan->msgsfd   = open("msgs",   BUF_FILE_OPEN_FLAGS, 0750);
+    if (chan->net->conf.record_log)
+        reclog_open(&chan->reclog, chan->net->dirfd, chan->dir);
+}
+
+/* Removes 'name' from the channel's directory, after anything queued for it */
+static void channel_unlink_file (struct channel *chan, const char *name)
+{
+    char *path = channel_path(chan, name);
 
-    chdir("..");
+    writer_unlink_at(chan->net->dirfd, path, 0);
+    free(path);
 }
 
 void channel_remove_files (struct channel *chan)
 {
     fassert(chan);
-    chdir(chan->name);
-
-    unlink("in");
-    unlink("out");
-    unlink("online");
-    unlink("topic");
-    unlink("raw");
-    unlink("msgs");
 
-    chdir("..");
-    rmdir(chan->name);
+    if (!chan->dir)
+        return ;
+
+    outbuf_close(&chan->out);
+    outbuf_close(&chan->raw);
+    outbuf_close(&chan->msgs);
+    reclog_close(&chan->reclog);
+
+    /* Closing the logs can queue writes and opens, so the files are removed
+     * through the writer too, after those are done */
+    channel_unlink_file(chan, "in");
+    channel_unlink_file(chan, "out");
+    channel_unlink_file(chan, "online");
+    channel_unlink_file(chan, "topic");
+    channel_unlink_file(chan, "raw");
+    channel_unlink_file(chan, "msgs");
+    channel_unlink_file(chan, "log");
+    channel_unlink_file(chan, "log.idx");
+
+    writer_unlink_at(chan->net->dirfd, chan->dir, AT_REMOVEDIR);
 }
 
 static void channel_write_raw_timestamp(struct channel *chan)
 {
-    time_t cur_time;
-    struct tm *tmp;
-    char time_buf[100];
+    const char *stamp;
     size_t len;
 
     fassert(chan);
 
-    time(&cur_time);
-    tmp = localtime(&cur_time);
+    stamp = clock_timestamp(&len);
+    outbuf_write(&chan->raw, stamp, len);
+}
 
-    len = strftime(time_buf, sizeof(time_buf), "%F %H-%M-%S:", tmp);
-    write(chan->rawfd, time_buf, len);
+/* Adds an event to the record log, if the channel has one. It's stamped with
+ * the same time as the text logs. */
+static void channel_record(struct channel *chan, enum reclog_type type, const char *nick, const char *text)
+{
+    reclog_append(&chan->reclog, type, clock_message_now(), nick, text);
 }
 
 static void channel_write_msg(struct channel *chan, const char *user, const char *line)
@@ -124,70 +247,124 @@ static void channel_write_msg(struct channel *chan, const char *user, const char
     fassert(line);
 
     DEBUG_PRINT("Writing msg: %s: %s", user, line);
-    fdprintf(chan->msgsfd, format, user, line);
-    fdprintf(chan->outfd, format, user, line);
+    outbuf_printf(&chan->msgs, format, user, line);
+    outbuf_printf(&chan->out, format, user, line);
 
     channel_write_raw_timestamp(chan);
-    fdprintf(chan->rawfd, "MSG %s: %s\n", user, line);
+    outbuf_printf(&chan->raw, "MSG %s: %s\n", user, line);
+
+    channel_record(chan, RECLOG_MSG, user, line);
 }
 
 static void channel_write_topic(struct channel *chan)
 {
-    fassert(chan);
+    char *buf = NULL;
+    int len;
 
-    ftruncate(chan->topicfd, 0);
-    lseek(chan->topicfd, 0, SEEK_SET);
+    fassert(chan);
 
     if (chan->topic_user)
-        fdprintf(chan->topicfd, "%s: \"%s\"\n", chan->topic_user, chan->topic);
+        len = alloc_sprintf(&buf, "%s: \"%s\"\n", chan->topic_user, chan->topic);
     else
-        fdprintf(chan->topicfd, "\"%s\"\n", chan->topic);
+        len = alloc_sprintf(&buf, "\"%s\"\n", chan->topic);
+
+    if (len != -1)
+        channel_replace_file(chan, "topic", buf, len);
+
+    free(buf);
 }
 
 static void channel_write_users(struct channel *chan)
 {
     struct irc_user *user;
+    size_t len = 0, nlen;
+    char *buf, *cur;
 
     fassert(chan);
 
-    ftruncate(chan->onlinefd, 0);
-    lseek(chan->onlinefd, 0, SEEK_SET);
+    /* The whole list is built up first, so it can go out in one write */
+    channel_foreach_user(chan, user)
+        len += strlen(user->formatted) + 1;
+
+    buf = cur = malloc(len + 1);
+    if (!buf)
+        return ;
 
     channel_foreach_user(chan, user) {
-        write(chan->onlinefd, user->formatted, strlen(user->formatted));
-        write(chan->onlinefd, "\n", 1);
+        nlen = strlen(user->formatted);
+        memcpy(cur, user->formatted, nlen);
+        cur[nlen] = '\n';
+        cur += nlen + 1;
     }
+
+    channel_replace_file(chan, "online", buf, len);
+    free(buf);
 }
 
-void channel_reg_select (struct channel *chan, fd_set *infd, fd_set *outfd, int *maxfd)
+/* Puts the channel on its network's list of channels to flush */
+static void channel_mark_dirty (struct channel *chan)
 {
-    fassert(chan);
-    fassert(infd);
-    fassert(outfd);
-    fassert(maxfd);
-
-    if (chan->in.fd != -1) {
-        FD_SET(chan->in.fd, infd);
-        if (chan->in.fd > *maxfd)
-            *maxfd = chan->in.fd;
-    }
+    struct network *net = chan->net;
+
+    if (chan->prev_dirty)
+        return ;
+
+    chan->next_dirty = net->first_dirty;
+    chan->prev_dirty = &net->first_dirty;
+    if (net->first_dirty)
+        net->first_dirty->prev_dirty = &chan->next_dirty;
+    net->first_dirty = chan;
+}
+
+static void channel_unmark_dirty (struct channel *chan)
+{
+    if (!chan->prev_dirty)
+        return ;
+
+    *chan->prev_dirty = chan->next_dirty;
+    if (chan->next_dirty)
+        chan->next_dirty->prev_dirty = chan->prev_dirty;
+
+    chan->next_dirty = NULL;
+    chan->prev_dirty = NULL;
+}
+
+static void channel_mark_users (struct channel *chan)
+{
+    chan->users_dirty = 1;
+    channel_mark_dirty(chan);
+}
+
+static void channel_mark_topic (struct channel *chan)
+{
+    chan->topic_dirty = 1;
+    channel_mark_dirty(chan);
 }
 
-void channel_handle_input (struct channel *chan, fd_set *infd, fd_set *outfd)
+void channel_flush (struct channel *chan)
 {
     fassert(chan);
-    fassert(infd);
-    fassert(outfd);
-
-    if (FD_ISSET(chan->in.fd, infd)) {
-        buf_handle_input(&(chan->in));
-        while (chan->in.has_line > 0) {
-            char *line = buf_read_line(&(chan->in));
-            if (line[0] != '/') {
-                irc_privmsg(chan->net, chan->name, line);
-                channel_write_msg(chan, chan->net->nickname, line);
-            }
-            free(line);
+
+    if (chan->users_dirty)
+        channel_write_users(chan);
+    if (chan->topic_dirty && chan->topic)
+        channel_write_topic(chan);
+
+    chan->users_dirty = 0;
+    chan->topic_dirty = 0;
+    channel_unmark_dirty(chan);
+}
+
+static void channel_handle_input (struct event_fd *ev, unsigned int events)
+{
+    struct channel *chan = container_of(ev, struct channel, in_ev);
+    char *line;
+
+    buf_handle_input(&(chan->in));
+    while ((line = buf_next_line(&(chan->in), NULL)) != NULL) {
+        if (line[0] != '/') {
+            irc_privmsg(chan->net, chan->name, line);
+            channel_write_msg(chan, chan->net->nickname, line);
         }
     }
 }
@@ -195,7 +372,6 @@ void channel_handle_input (struct channel *chan, fd_set *infd, fd_set *outfd)
 void channel_new_topic (struct channel *chan, const char *user, const char *topic)
 {
     fassert(chan);
-    fassert(user);
     fassert(topic);
 
     if (chan->topic)
@@ -203,23 +379,23 @@ void channel_new_topic (struct channel *chan, const char *user, const char *topi
     if (chan->topic_user)
         free(chan->topic_user);
 
-    if (topic)
-        chan->topic = strdup(topic);
-    if (user)
-        chan->topic_user = strdup(user);
+    chan->topic = strdup(topic);
+    chan->topic_user = (user)? strdup(user): NULL;
 
-    channel_write_topic(chan);
+    channel_mark_topic(chan);
 
     channel_write_raw_timestamp(chan);
     if (user)
-        fdprintf(chan->rawfd, "TOPIC %s:%s\n", user, topic);
+        outbuf_printf(&chan->raw, "TOPIC %s:%s\n", user, topic);
     else
-        fdprintf(chan->rawfd, "TOPIC :%s\n", topic);
+        outbuf_printf(&chan->raw, "TOPIC :%s\n", topic);
 
     if (user)
-        fdprintf(chan->outfd, "%s set the topic to %s\n", user, topic);
+        outbuf_printf(&chan->out, "%s set the topic to %s\n", user, topic);
     else
-        fdprintf(chan->outfd, "Topic is %s\n", topic);
+        outbuf_printf(&chan->out, "Topic is %s\n", topic);
+
+    channel_record(chan, RECLOG_TOPIC, user, topic);
 }
 
 void channel_new_message (struct channel *chan, const char *user, const char *line)
@@ -231,35 +407,133 @@ void channel_new_message (struct channel *chan, const char *user, const char *li
     channel_write_msg(chan, user, line);
 }
 
+static struct channel_irc_user_node *channel_find_user (struct channel *chan, const char *nick)
+{
+    struct hash_node *node;
+    struct channel_irc_user_node *user;
+    const unsigned char *casemap = chan->net->casemap;
+
+    hash_foreach_match(&chan->user_hash, irc_casehash(casemap, nick), node) {
+        user = container_of(node, struct channel_irc_user_node, hnode);
+        if (irc_casecmp(casemap, user->user.nick, nick) == 0)
+            return user;
+    }
+
+    return NULL;
+}
+
+static void channel_add_user (struct channel *chan, struct channel_irc_user_node *user)
+{
+    hash_add(&chan->user_hash, &user->hnode, irc_casehash(chan->net->casemap, user->user.nick));
+    rb_insert(&chan->users, &user->node);
+}
+
+static void channel_del_user (struct channel *chan, struct channel_irc_user_node *user)
+{
+    hash_remove(&chan->user_hash, &user->hnode);
+    rb_remove(&chan->users, &user->node);
+}
+
+void channel_rehash_users (struct channel *chan)
+{
+    struct rbnode *node;
+    struct channel_irc_user_node *user;
+
+    hash_clear(&chan->user_hash);
+    rb_foreach_inorder(&chan->users, node) {
+        user = container_of(node, struct channel_irc_user_node, node);
+        hash_add(&chan->user_hash, &user->hnode, irc_casehash(chan->net->casemap, user->user.nick));
+    }
+}
+
 void channel_user_online(struct channel *chan, const struct irc_user *user_cpy)
 {
-    struct channel_irc_user_node *user, **current;
+    struct channel_irc_user_node *user;
+    struct irc_net_user *net_user;
 
     fassert(chan);
     fassert(user_cpy);
 
+    user = channel_find_user(chan, user_cpy->nick);
+    if (user) {
+        user->stale = 0;
+        if (user->user.flags.is_op != user_cpy->flags.is_op
+            || user->user.flags.is_voice != user_cpy->flags.is_voice) {
+            user->user.flags = user_cpy->flags;
+            channel_mark_users(chan);
+        }
+        return ;
+    }
+
+    net_user = network_get_user(chan->net, user_cpy->nick);
+
     user = malloc(sizeof(*user));
-    user->next = NULL;
+    memset(user, 0, sizeof(*user));
     irc_user_init(&user->user);
-    irc_user_cpy(&user->user, user_cpy);
+    user->user.nick = net_user->nick;
+    user->user.flags = user_cpy->flags;
+    user->chan = chan;
+
+    user->net_user = net_user;
+    user->next_member = net_user->first_member;
+    user->prev_member = &net_user->first_member;
+    if (net_user->first_member)
+        net_user->first_member->prev_member = &user->next_member;
+    net_user->first_member = user;
 
     irc_user_format_nick(&user->user);
 
-    for (current = &chan->first_user; *current != NULL; current = &((*current)->next)) {
-        int cmp = strcmp((*current)->user.nick, user->user.nick);
-        if (cmp < 0) {
-            break;
-        } else if (cmp == 0) {
-            irc_user_clear(&user->user);
-            free(user);
-            return ;
-        }
+    channel_add_user(chan, user);
+
+    channel_mark_users(chan);
+}
+
+void channel_names_start (struct channel *chan)
+{
+    struct hash_node *node, *tmp;
+    unsigned int i;
+
+    if (chan->names_pending)
+        return ;
+
+    chan->names_pending = 1;
+    hash_foreach_safe(&chan->user_hash, i, node, tmp)
+        container_of(node, struct channel_irc_user_node, hnode)->stale = 1;
+}
+
+void channel_names_end (struct channel *chan)
+{
+    struct channel_irc_user_node *user;
+    struct hash_node *node, *tmp;
+    unsigned int i;
+
+    if (!chan->names_pending)
+        return ;
+
+    chan->names_pending = 0;
+    hash_foreach_safe(&chan->user_hash, i, node, tmp) {
+        user = container_of(node, struct channel_irc_user_node, hnode);
+        if (!user->stale)
+            continue;
+
+        channel_del_user(chan, user);
+        channel_free_user(chan, user);
+        channel_mark_users(chan);
     }
+}
+
+void channel_left (struct channel *chan)
+{
+    struct hash_node *node, *tmp;
+    unsigned int i;
+
+    fassert(chan);
 
-    user->next = *current;
-    *current = user;
+    chan->joined = 0;
+    chan->names_pending = 0;
 
-    channel_write_users(chan);
+    hash_foreach_safe(&chan->user_hash, i, node, tmp)
+        channel_user_drop(container_of(node, struct channel_irc_user_node, hnode));
 }
 
 void channel_user_join(struct channel *chan, const struct irc_user *user_cpy)
@@ -269,36 +543,27 @@ void channel_user_join(struct channel *chan, const struct irc_user *user_cpy)
 
     channel_user_online(chan, user_cpy);
 
-    fdprintf(chan->outfd, "join > %s\n", user_cpy->nick);
+    outbuf_printf(&chan->out, "join > %s\n", user_cpy->nick);
 
     channel_write_raw_timestamp(chan);
-    fdprintf(chan->rawfd, "JOIN %s\n", user_cpy->nick);
+    outbuf_printf(&chan->raw, "JOIN %s\n", user_cpy->nick);
+
+    channel_record(chan, RECLOG_JOIN, user_cpy->nick, NULL);
 }
 
 static int try_remove_user (struct channel *chan, const char *nick)
 {
-    struct channel_irc_user_node **user, *found;
+    struct channel_irc_user_node *found;
 
     fassert(chan);
     fassert(nick);
 
-    for (user = &chan->first_user; *user != NULL; user = &((*user)->next)) {
-        int cmp = strcmp((*user)->user.nick, nick);
-        if (cmp == 0)
-            break;
-        else if (cmp < 0)
-            return 0;
-    }
-
-    found = *user;
-
+    found = channel_find_user(chan, nick);
     if (!found)
         return 0;
 
-    *user = (*user)->next;
-
-    irc_user_clear(&found->user);
-    free(found);
+    channel_del_user(chan, found);
+    channel_free_user(chan, found);
     return 1;
 }
 
@@ -310,12 +575,14 @@ void channel_user_part (struct channel *chan, const char *nick)
     if (!try_remove_user(chan, nick))
         return;
 
-    channel_write_users(chan);
+    channel_mark_users(chan);
 
-    fdprintf(chan->outfd, "part > %s\n", nick);
+    outbuf_printf(&chan->out, "part > %s\n", nick);
 
     channel_write_raw_timestamp(chan);
-    fdprintf(chan->rawfd, "PART %s\n", nick);
+    outbuf_printf(&chan->raw, "PART %s\n", nick);
+
+    channel_record(chan, RECLOG_PART, nick, NULL);
 
     return ;
 }
@@ -328,46 +595,62 @@ void channel_user_quit (struct channel *chan, const char *nick)
     if (!try_remove_user(chan, nick))
         return;
 
-    channel_write_users(chan);
+    channel_mark_users(chan);
 
-    fdprintf(chan->outfd, "quit < %s\n", nick);
+    outbuf_printf(&chan->out, "quit < %s\n", nick);
 
     channel_write_raw_timestamp(chan);
-    fdprintf(chan->rawfd, "QUIT %s\n", nick);
+    outbuf_printf(&chan->raw, "QUIT %s\n", nick);
+
+    channel_record(chan, RECLOG_QUIT, nick, NULL);
 
     return ;
 }
 
-void channel_change_user(struct channel *chan, const char *old, const char *new)
+void channel_user_drop (struct channel_irc_user_node *user)
 {
-    struct channel_irc_user_node **user, *found;
+    struct channel *chan;
 
-    fassert(chan);
+    fassert(user);
+
+    chan = user->chan;
+
+    channel_del_user(chan, user);
+    channel_free_user(chan, user);
+    channel_mark_users(chan);
+}
+
+void channel_user_change(struct channel_irc_user_node *user, const char *old)
+{
+    struct channel *chan;
+    struct channel_irc_user_node *dup;
+
+    fassert(user);
     fassert(old);
-    fassert(new);
-
-    for (user = &chan->first_user; *user != NULL; user = &((*user)->next)) {
-        int cmp = strcmp((*user)->user.nick, old);
-        if (cmp == 0)
-            break;
-        else if (cmp < 0)
-            return;
+
+    chan = user->chan;
+
+    channel_del_user(chan, user);
+
+    /* Shouldn't happen, but if the new nick is somehow already here the
+     * stale entry is dropped in favor of the renamed user */
+    dup = channel_find_user(chan, user->net_user->nick);
+    if (dup) {
+        channel_del_user(chan, dup);
+        channel_free_user(chan, dup);
     }
 
-    found = *user;
-    *user = (*user)->next;
+    user->user.nick = user->net_user->nick;
+    irc_user_format_nick(&user->user);
 
-    free(found->user.nick);
-    found->user.nick = strdup(new);
+    channel_add_user(chan, user);
 
-    for (user = &chan->first_user; *user != NULL; user = &((*user)->next))
-        if (strcmp((*user)->user.nick, new) <= 0)
-            break;
+    channel_mark_users(chan);
 
-    found->next = (*user)->next;
-    *user = found;
+    outbuf_printf(&chan->out, "nick > %s is now %s\n", old, user->user.nick);
 
-    irc_user_format_nick(&found->user);
-    channel_write_users(chan);
-}
+    channel_write_raw_timestamp(chan);
+    outbuf_printf(&chan->raw, "NICK %s %s\n", old, user->user.nick);
 
+    channel_record(chan, RECLOG_NICK, old, user->user.nick);
+}
@@ -0,0 +1,134 @@
+/*
+ * ./clock.c -- Cached wall-clock time and log timestamps
+ *
+ * Formatting a timestamp means a time(), a localtime() (Which may go and look
+ * at the timezone database) and a strftime(). Every line written to a 'raw'
+ * file needs one, so the time is instead sampled once per loop iteration, and
+ * the formatted string is kept until the second changes.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "clock.h"
+
+#define CLOCK_STAMP_FORMAT "%F %H-%M-%S:"
+
+struct clock_stamp {
+    time_t time;
+    size_t len;
+    char buf[64];
+};
+
+static time_t now = 0;
+
+/* 'current' is the stamp for 'now', and 'message' is the stamp for the
+ * server-time of the message being handled, when 'use_message' is set */
+static struct clock_stamp current = { .time = -1 };
+static struct clock_stamp message = { .time = -1 };
+static int use_message = 0;
+
+size_t clock_format (time_t t, char *buf, size_t size)
+{
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    return strftime(buf, size, CLOCK_STAMP_FORMAT, &tm);
+}
+
+static void clock_stamp_set (struct clock_stamp *stamp, time_t t)
+{
+    if (stamp->time == t)
+        return ;
+
+    stamp->len = clock_format(t, stamp->buf, sizeof(stamp->buf));
+    stamp->time = t;
+}
+
+void clock_update (void)
+{
+    now = time(NULL);
+    clock_stamp_set(&current, now);
+}
+
+time_t clock_now (void)
+{
+    if (now == 0)
+        clock_update();
+
+    return now;
+}
+
+/* Days since the epoch for a date in the proleptic Gregorian calendar. timegm()
+ * would do, but it isn't available with the feature macros in use. */
+static long days_from_civil (int y, int m, int d)
+{
+    long era, yoe, doy, doe;
+
+    y -= m <= 2;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + doe - 719468;
+}
+
+int clock_parse_server_time (const char *server_time, time_t *t)
+{
+    int y, mon, d, h, min, s;
+
+    if (sscanf(server_time, "%4d-%2d-%2dT%2d:%2d:%2d", &y, &mon, &d, &h, &min, &s) != 6)
+        return -1;
+
+    if (mon < 1 || mon > 12 || d < 1 || d > 31 || h > 23 || min > 59 || s > 60)
+        return -1;
+
+    *t = days_from_civil(y, mon, d) * 86400 + h * 3600 + min * 60 + s;
+    return 0;
+}
+
+int clock_set_message_time (const char *server_time)
+{
+    time_t t;
+
+    if (clock_parse_server_time(server_time, &t))
+        return -1;
+
+    clock_stamp_set(&message, t);
+    use_message = 1;
+    return 0;
+}
+
+void clock_clear_message_time (void)
+{
+    use_message = 0;
+}
+
+time_t clock_message_now (void)
+{
+    return (use_message)? message.time: clock_now();
+}
+
+const char *clock_timestamp (size_t *len)
+{
+    struct clock_stamp *stamp = use_message? &message: &current;
+
+    if (!use_message && current.time == -1)
+        clock_update();
+
+    if (len)
+        *len = stamp->len;
+
+    return stamp->buf;
+}
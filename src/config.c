@@ -36,6 +36,11 @@ static cfg_opt_t network_opts[] = {
     CFG_STR      ("password",              NULL,       CFGF_NONE),
     CFG_INT_CB   ("login-type",            LOGIN_NONE, CFGF_NONE, login_type_callback),
     CFG_STR_LIST ("channels",              NULL,       CFGF_NONE),
+    CFG_INT      ("flood-burst",           DEFAULT_FLOOD_BURST, CFGF_NONE),
+    CFG_FLOAT    ("flood-rate",            1000.0 / DEFAULT_FLOOD_INTERVAL, CFGF_NONE),
+    CFG_INT      ("ping-interval",         DEFAULT_PING_INTERVAL / 1000, CFGF_NONE),
+    CFG_INT      ("ping-timeout",          DEFAULT_PING_TIMEOUT / 1000, CFGF_NONE),
+    CFG_BOOL     ("record-log",            cfg_false,  CFGF_NONE),
     CFG_END()
 };
 
@@ -45,6 +50,7 @@ static cfg_opt_t main_opts[] = {
     CFG_BOOL     ("remove-files-on-close", cfg_false,    CFGF_NONE),
     CFG_STR_LIST ("auto-login",            NULL,         CFGF_NONE),
     CFG_STR      ("root-directory",        "/tmp/irc",   CFGF_NONE),
+    CFG_INT      ("max-open-logs",         OUTBUF_DEFAULT_MAX_OPEN, CFGF_NONE),
     CFG_END()
 };
 
@@ -88,11 +94,20 @@ void config_init(void)
     memset(&prog_config, 0, sizeof(struct config));
 
     prog_config.root_directory = strdup("/tmp/irc");
+    prog_config.max_open_logs = OUTBUF_DEFAULT_MAX_OPEN;
+
+    prog_config.net_global_conf.flood_burst = DEFAULT_FLOOD_BURST;
+    prog_config.net_global_conf.flood_interval = DEFAULT_FLOOD_INTERVAL;
+    prog_config.net_global_conf.ping_interval = DEFAULT_PING_INTERVAL;
+    prog_config.net_global_conf.ping_timeout = DEFAULT_PING_TIMEOUT;
 }
 
 static void add_network(cfg_t *network)
 {
     unsigned int i;
+    double rate;
+    char *chan_name, *key;
+    struct channel *chan;
     cfg_opt_t *opt;
     struct network *net = malloc(sizeof(struct network));
 
@@ -107,13 +122,40 @@ static void add_network(cfg_t *network)
     else
         net->conf.remove_files_on_close = prog_config.net_global_conf.remove_files_on_close;
 
+    /* 'flood-rate' is in lines per second, zero turns the limit off */
+    rate = cfg_getfloat(network, "flood-rate");
+    net->conf.flood_burst = cfg_getint(network, "flood-burst");
+    net->conf.flood_interval = (rate > 0)? 1000.0 / rate: 0;
+    if (net->conf.flood_burst < 1)
+        net->conf.flood_burst = 1;
+
+    /* Both are in seconds */
+    net->conf.ping_interval = (cfg_getint(network, "ping-interval") > 0)? cfg_getint(network, "ping-interval") * 1000: 0;
+    net->conf.ping_timeout = (cfg_getint(network, "ping-timeout") > 0)? cfg_getint(network, "ping-timeout") * 1000: DEFAULT_PING_TIMEOUT;
+
+    net->conf.record_log = cfg_getbool(network, "record-log");
+
     net->nickname = sstrdup(cfg_getstr(network, "nickname"));
     net->realname = sstrdup(cfg_getstr(network, "realname"));
     net->password = sstrdup(cfg_getstr(network, "password"));
     net->login_type = cfg_getint(network, "login-type");
 
-    for (i = 0; i < cfg_size(network, "channels"); i++)
-        network_add_channel(net, cfg_getnstr(network, "channels", i));
+    /* Each entry is a channel name, optionally followed by its key */
+    for (i = 0; i < cfg_size(network, "channels"); i++) {
+        chan_name = strdup(cfg_getnstr(network, "channels", i));
+        key = strchr(chan_name, ' ');
+        if (key) {
+            *key++ = '\0';
+            while (*key == ' ')
+                key++;
+        }
+
+        chan = network_add_channel(net, chan_name);
+        if (key && *key)
+            chan->key = strdup(key);
+
+        free(chan_name);
+    }
 
     net->next = prog_config.first;
     prog_config.first = net;
@@ -158,6 +200,9 @@ int config_read(void)
             free(prog_config.root_directory);
         prog_config.root_directory = strdup(cfg_getstr(cfg, "root-directory"));
 
+        if (cfg_getint(cfg, "max-open-logs") > 0)
+            prog_config.max_open_logs = cfg_getint(cfg, "max-open-logs");
+
         size = cfg_size(cfg, "network");
         for (i = 0; i < size; i++)
             add_network(cfg_getnsec(cfg, "network", i));
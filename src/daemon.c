@@ -16,7 +16,6 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <fcntl.h>
 #include <signal.h>
 
@@ -24,6 +23,9 @@
 #include "network.h"
 #include "channel.h"
 #include "net_cons.h"
+#include "event.h"
+#include "resolver.h"
+#include "writer.h"
 #include "daemon.h"
 
 static int still_in_parent = 0;
@@ -74,6 +76,9 @@ void daemon_kill(struct network_cons *con)
     DEBUG_PRINT("Closing networks...");
     network_cons_clear(con);
     config_clear();
+    writer_clear();
+    resolver_clear();
+    event_clear();
 
     DEBUG_PRINT("Done.");
     DEBUG_CLOSE();
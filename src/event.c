@@ -0,0 +1,169 @@
+/*
+ * ./event.c -- Implements the main event loop on top of a pluggable backend
+ *
+ * File-descriptors are registered once when they're opened and removed when
+ * they're closed, instead of rebuilding the whole set every time around the
+ * loop. When an fd becomes ready, its handler is called directly, so the cost
+ * of a wake-up only depends on the number of fd's that are actually ready.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <string.h>
+#include <errno.h>
+
+#include "debug.h"
+#include "fassert.h"
+#include "clock.h"
+#include "buf.h"
+#include "event.h"
+
+#define EVENT_MAX_READY 64
+
+static const struct event_backend *backend = NULL;
+
+/* The ready list for the current call to event_wait. It's kept here so that
+ * event_del can clear out entries for fd's that get removed by an earlier
+ * handler in the same batch. */
+static struct event_ready ready[EVENT_MAX_READY];
+static int ready_count = 0, ready_cur = 0;
+
+int event_init(void)
+{
+#if defined(__linux__) && defined(FIRCD_IO_URING)
+    backend = &event_uring_backend;
+    if (backend->init() == 0) {
+        DEBUG_PRINT("Event backend: %s", backend->name);
+        return 0;
+    }
+#endif
+
+#if defined(__linux__) && !defined(FIRCD_SELECT)
+    backend = &event_epoll_backend;
+    if (backend->init() == 0) {
+        DEBUG_PRINT("Event backend: %s", backend->name);
+        return 0;
+    }
+#endif
+
+    backend = &event_select_backend;
+    DEBUG_PRINT("Event backend: %s", backend->name);
+    return backend->init();
+}
+
+void event_clear(void)
+{
+    if (backend)
+        backend->clear();
+    backend = NULL;
+}
+
+void event_fd_init(struct event_fd *ev)
+{
+    memset(ev, 0, sizeof(struct event_fd));
+    ev->fd = -1;
+}
+
+static int event_add_in(struct event_fd *ev, int fd, unsigned int events, event_handler handler, struct buf_fd *in)
+{
+    fassert(ev);
+    fassert(handler);
+
+    if (!backend || fd == -1)
+        return -1;
+
+    ev->fd = fd;
+    ev->events = events;
+    ev->handler = handler;
+    ev->in = in;
+
+    if (backend->add(ev) == -1) {
+        DEBUG_PRINT("Unable to add fd %d to the event loop", fd);
+        ev->fd = -1;
+        ev->in = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_add(struct event_fd *ev, int fd, unsigned int events, event_handler handler)
+{
+    return event_add_in(ev, fd, events, handler, NULL);
+}
+
+int event_add_buf(struct event_fd *ev, struct buf_fd *buf, unsigned int events, event_handler handler)
+{
+    fassert(buf);
+
+    return event_add_in(ev, buf->fd, events, handler, buf);
+}
+
+int event_mod(struct event_fd *ev, unsigned int events)
+{
+    fassert(ev);
+
+    if (!backend || ev->fd == -1)
+        return -1;
+
+    if (ev->events == events)
+        return 0;
+
+    ev->events = events;
+    return backend->mod(ev);
+}
+
+void event_del(struct event_fd *ev)
+{
+    int i;
+
+    fassert(ev);
+
+    if (!backend || ev->fd == -1)
+        return ;
+
+    backend->del(ev);
+
+    for (i = ready_cur + 1; i < ready_count; i++)
+        if (ready[i].ev == ev)
+            ready[i].ev = NULL;
+
+    ev->fd = -1;
+    ev->events = 0;
+    ev->in = NULL;
+}
+
+int event_wait(int timeout)
+{
+    int count;
+    struct event_fd *ev;
+
+    fassert(backend);
+
+    count = backend->wait(ready, EVENT_MAX_READY, timeout);
+    if (count == -1) {
+        if (errno != EINTR)
+            DEBUG_PRINT("Event wait failed: %d", errno);
+        return 0;
+    }
+
+    clock_update();
+
+    ready_count = count;
+    for (ready_cur = 0; ready_cur < ready_count; ready_cur++) {
+        ev = ready[ready_cur].ev;
+        if (ev)
+            (ev->handler) (ev, ready[ready_cur].events);
+    }
+
+    ready_count = 0;
+    ready_cur = 0;
+
+    return count;
+}
@@ -0,0 +1,125 @@
+/*
+ * ./event_epoll.c -- epoll() backend for the event loop (Linux only)
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#ifdef __linux__
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "debug.h"
+#include "event.h"
+
+#define EPOLL_MAX_EVENTS 64
+
+static int epfd = -1;
+
+static unsigned int to_epoll(unsigned int events)
+{
+    unsigned int ret = 0;
+
+    if (events & EVENT_IN)
+        ret |= EPOLLIN;
+    if (events & EVENT_OUT)
+        ret |= EPOLLOUT;
+
+    return ret;
+}
+
+static unsigned int from_epoll(unsigned int events)
+{
+    unsigned int ret = 0;
+
+    if (events & (EPOLLIN | EPOLLHUP))
+        ret |= EVENT_IN;
+    if (events & EPOLLOUT)
+        ret |= EVENT_OUT;
+    if (events & EPOLLERR)
+        ret |= EVENT_ERR;
+
+    return ret;
+}
+
+static int epoll_backend_init(void)
+{
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    return (epfd == -1)? -1: 0;
+}
+
+static void epoll_backend_clear(void)
+{
+    if (epfd != -1)
+        close(epfd);
+    epfd = -1;
+}
+
+static int epoll_backend_ctl(int op, struct event_fd *ev)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = to_epoll(ev->events);
+    event.data.ptr = ev;
+
+    return epoll_ctl(epfd, op, ev->fd, &event);
+}
+
+static int epoll_backend_add(struct event_fd *ev)
+{
+    return epoll_backend_ctl(EPOLL_CTL_ADD, ev);
+}
+
+static int epoll_backend_mod(struct event_fd *ev)
+{
+    return epoll_backend_ctl(EPOLL_CTL_MOD, ev);
+}
+
+static void epoll_backend_del(struct event_fd *ev)
+{
+    struct epoll_event event;
+
+    /* The event argument is ignored, but kernels before 2.6.9 require a
+     * non-NULL pointer */
+    epoll_ctl(epfd, EPOLL_CTL_DEL, ev->fd, &event);
+}
+
+static int epoll_backend_wait(struct event_ready *ready, int max, int timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int count, i;
+
+    if (max > EPOLL_MAX_EVENTS)
+        max = EPOLL_MAX_EVENTS;
+
+    count = epoll_wait(epfd, events, max, timeout);
+    if (count == -1)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        ready[i].ev = events[i].data.ptr;
+        ready[i].events = from_epoll(events[i].events);
+    }
+
+    return count;
+}
+
+const struct event_backend event_epoll_backend = {
+    .name  = "epoll",
+    .init  = epoll_backend_init,
+    .clear = epoll_backend_clear,
+    .add   = epoll_backend_add,
+    .mod   = epoll_backend_mod,
+    .del   = epoll_backend_del,
+    .wait  = epoll_backend_wait,
+};
+
+#endif
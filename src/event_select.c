@@ -0,0 +1,131 @@
+/*
+ * ./event_select.c -- select() backend for the event loop
+ *
+ * This is the portable fallback. The fd_set's are kept up to date as fd's are
+ * added and removed, so they only need to be copied before each select()
+ * call. select() can't handle fd's past FD_SETSIZE, so those are refused.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/select.h>
+
+#include "debug.h"
+#include "event.h"
+
+static fd_set infd, outfd;
+static int maxfd = -1;
+static struct event_fd *fds[FD_SETSIZE];
+
+static void select_backend_set(struct event_fd *ev)
+{
+    if (ev->events & EVENT_IN)
+        FD_SET(ev->fd, &infd);
+    else
+        FD_CLR(ev->fd, &infd);
+
+    if (ev->events & EVENT_OUT)
+        FD_SET(ev->fd, &outfd);
+    else
+        FD_CLR(ev->fd, &outfd);
+}
+
+static int select_backend_init(void)
+{
+    FD_ZERO(&infd);
+    FD_ZERO(&outfd);
+    memset(fds, 0, sizeof(fds));
+    maxfd = -1;
+    return 0;
+}
+
+static void select_backend_clear(void)
+{
+    select_backend_init();
+}
+
+static int select_backend_add(struct event_fd *ev)
+{
+    if (ev->fd < 0 || ev->fd >= FD_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fds[ev->fd] = ev;
+    select_backend_set(ev);
+
+    if (ev->fd > maxfd)
+        maxfd = ev->fd;
+
+    return 0;
+}
+
+static int select_backend_mod(struct event_fd *ev)
+{
+    select_backend_set(ev);
+    return 0;
+}
+
+static void select_backend_del(struct event_fd *ev)
+{
+    FD_CLR(ev->fd, &infd);
+    FD_CLR(ev->fd, &outfd);
+    fds[ev->fd] = NULL;
+
+    while (maxfd >= 0 && fds[maxfd] == NULL)
+        maxfd--;
+}
+
+static int select_backend_wait(struct event_ready *ready, int max, int timeout)
+{
+    fd_set in = infd, out = outfd;
+    struct timeval tv, *tvp = NULL;
+    int count, fd, found = 0;
+    unsigned int events;
+
+    if (timeout >= 0) {
+        tv.tv_sec = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    count = select(maxfd + 1, &in, &out, NULL, tvp);
+    if (count <= 0)
+        return count;
+
+    for (fd = 0; fd <= maxfd && found < max; fd++) {
+        events = 0;
+        if (FD_ISSET(fd, &in))
+            events |= EVENT_IN;
+        if (FD_ISSET(fd, &out))
+            events |= EVENT_OUT;
+
+        if (events && fds[fd]) {
+            ready[found].ev = fds[fd];
+            ready[found].events = events;
+            found++;
+        }
+    }
+
+    return found;
+}
+
+const struct event_backend event_select_backend = {
+    .name  = "select",
+    .init  = select_backend_init,
+    .clear = select_backend_clear,
+    .add   = select_backend_add,
+    .mod   = select_backend_mod,
+    .del   = select_backend_del,
+    .wait  = select_backend_wait,
+};
@@ -0,0 +1,707 @@
+/*
+ * ./event_uring.c -- io_uring backend for the event loop (Linux only)
+ *
+ * Every fd gets a request on the ring, and all of the changes made since
+ * the last wait (New fd's, removed ones, and re-arming the requests that
+ * finished) are submitted in the same io_uring_enter() that waits for the
+ * next completions. So a pass through the loop costs one system call for the
+ * event loop, no matter how many fd's were added, changed or ready.
+ *
+ * fd's added with 'event_add_buf' are read on the ring: A recv (Multishot,
+ * where the kernel has it) for sockets, or a read for FIFOs, picks a buffer
+ * from a ring of provided buffers, and the data is copied into the fd's
+ * 'buf_fd' before its handler is called. So the handler's
+ * 'buf_handle_input' doesn't make a system call either. Without provided
+ * buffer rings (Linux 5.19), they're polled like everything else.
+ *
+ * Other events are single-shot polls, re-armed after they fire, which keeps
+ * the level-triggered behavior of the epoll and select() backends. A new
+ * poll checks whether the fd is already ready, so the handlers don't have to
+ * drain their fd's. A request that can't be armed because the SQ is full
+ * stays on the re-arm list and is tried again on the next wait.
+ *
+ * Each request's user_data is the fd, whether it's the read, and a
+ * generation count. Removing or changing an fd bumps its generation, so
+ * completions from a request that was already on its way out are recognized
+ * and ignored, even if the fd (Or the 'event_fd') has been reused since. Any
+ * buffer they picked is still given back.
+ *
+ * Log appends aren't done here, they're already off of the loop on the
+ * writer thread (See 'writer.c').
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+/* For syscall(), there's no libc wrapper for io_uring */
+#define _DEFAULT_SOURCE
+
+#include "global.h"
+
+#if defined(__linux__) && defined(FIRCD_IO_URING)
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "debug.h"
+#include "buf.h"
+#include "event.h"
+
+#define URING_ENTRIES 256
+
+/* The provided buffers that reads pick from. The count has to be a power of
+ * two. */
+#define URING_BUF_COUNT 64
+#define URING_BUF_SIZE 4096
+#define URING_BUF_GROUP 0
+
+/* user_data of the POLL_REMOVE and ASYNC_CANCEL requests, whose completions
+ * are ignored */
+#define URING_REMOVE_DATA (~(__u64)0)
+
+#define URING_READ_BIT 0x80000000u
+#define URING_GEN_MASK 0x7fffffffu
+
+/* What's known about each registered fd, indexed by the fd. 'gen' covers
+ * the poll, and 'read_gen' the read, so changing the events polled for
+ * doesn't lose data a read already has. */
+struct uring_slot {
+    struct event_fd *ev;
+    unsigned int gen, read_gen;
+    unsigned int armed :1;
+    unsigned int reading :1;
+    unsigned int ring_read :1;
+    unsigned int sock :1;
+    unsigned int rearm :1;
+
+    /* Where this fd is in the ready list, if 'ready_pass' is this wait's */
+    unsigned int ready_pass;
+    int ready_idx;
+};
+
+static int ring_fd = -1;
+
+/* With IORING_FEAT_SINGLE_MMAP, both rings are in one mapping */
+static void *ring_ptr;
+static size_t ring_size;
+static struct io_uring_sqe *sqes;
+static size_t sqes_size;
+
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned int to_submit;
+
+static struct uring_slot *slots;
+static int slot_count;
+
+/* fd's whose poll or read finished (Or couldn't be armed), and which get a
+ * new one on the next wait */
+static int *rearm_list;
+static int rearm_count;
+
+static unsigned int wait_pass;
+
+/* The provided buffer ring. Without it, reads are done by the handlers. */
+static struct io_uring_buf_ring *buf_ring;
+static size_t buf_ring_size;
+static char *buf_data;
+static unsigned short buf_tail;
+static int have_bufs;
+
+/* Cleared the first time the kernel turns down a multishot recv */
+static int recv_multishot = 1;
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(unsigned int submit, unsigned int min_complete, unsigned int flags, void *arg, size_t argsz)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, submit, min_complete, flags, arg, argsz);
+}
+
+static int uring_register(unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static unsigned int to_poll(unsigned int events)
+{
+    unsigned int ret = 0;
+
+    if (events & EVENT_IN)
+        ret |= POLLIN;
+    if (events & EVENT_OUT)
+        ret |= POLLOUT;
+
+    return ret;
+}
+
+static unsigned int from_poll(unsigned int events)
+{
+    unsigned int ret = 0;
+
+    if (events & (POLLIN | POLLHUP))
+        ret |= EVENT_IN;
+    if (events & POLLOUT)
+        ret |= EVENT_OUT;
+    if (events & (POLLERR | POLLNVAL))
+        ret |= EVENT_ERR;
+
+    return ret;
+}
+
+static __u64 slot_data(int fd)
+{
+    return ((__u64)fd << 32) | (slots[fd].gen & URING_GEN_MASK);
+}
+
+static __u64 slot_read_data(int fd)
+{
+    return ((__u64)fd << 32) | URING_READ_BIT | (slots[fd].read_gen & URING_GEN_MASK);
+}
+
+/* The events that are polled for, instead of read on the ring */
+static unsigned int slot_poll_events(int fd)
+{
+    unsigned int events = slots[fd].ev->events;
+
+    if (slots[fd].ring_read)
+        events &= ~EVENT_IN;
+
+    return events;
+}
+
+/* Puts a buffer back on the ring, once its data has been copied out */
+static void uring_give_buf(unsigned int bid)
+{
+    struct io_uring_buf *b = buf_ring->bufs + (buf_tail & (URING_BUF_COUNT - 1));
+
+    b->addr = (unsigned long)(buf_data + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+
+    buf_tail++;
+    __atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_queue_rearm(int fd)
+{
+    if (slots[fd].rearm)
+        return ;
+
+    slots[fd].rearm = 1;
+    rearm_list[rearm_count++] = fd;
+}
+
+/* Submits what's queued without waiting, for when the SQ fills up before
+ * the next wait */
+static void uring_flush(void)
+{
+    int ret;
+
+    while (to_submit > 0) {
+        ret = uring_enter(to_submit, 0, 0, NULL, 0);
+        if (ret == -1) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+
+            /* EBUSY means the CQ is full, which only the next wait can
+             * drain, so the rest waits for that */
+            if (errno != EBUSY)
+                DEBUG_PRINT("io_uring submit failed: %d", errno);
+            return ;
+        }
+        to_submit -= ret;
+    }
+}
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned int tail = *sq_tail, index;
+    struct io_uring_sqe *sqe;
+
+    if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask) {
+        uring_flush();
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) > *sq_mask)
+            return NULL;
+    }
+
+    index = tail & *sq_mask;
+    sqe = sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    to_submit++;
+
+    return sqe;
+}
+
+static int uring_arm_poll(int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = to_poll(slot_poll_events(fd));
+    sqe->user_data = slot_data(fd);
+
+    slots[fd].armed = 1;
+    return 0;
+}
+
+static int uring_arm_read(int fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (!sqe)
+        return -1;
+
+    if (slots[fd].sock) {
+        sqe->opcode = IORING_OP_RECV;
+        if (recv_multishot)
+            sqe->ioprio = IORING_RECV_MULTISHOT;
+        else
+            sqe->len = URING_BUF_SIZE;
+    } else {
+        /* FIFO's can't seek, so this reads from the current position */
+        sqe->opcode = IORING_OP_READ;
+        sqe->off = (__u64)-1;
+        sqe->len = URING_BUF_SIZE;
+    }
+
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = slot_read_data(fd);
+
+    slots[fd].reading = 1;
+    return 0;
+}
+
+/* Arms whatever 'fd' should have on the ring and doesn't. Returns -1 if
+ * there was no room for it. */
+static int uring_arm(int fd)
+{
+    struct uring_slot *slot = slots + fd;
+
+    if (!slot->ev)
+        return 0;
+
+    if (!slot->armed && slot_poll_events(fd) && uring_arm_poll(fd) == -1)
+        return -1;
+
+    if (slot->ring_read && !slot->reading && (slot->ev->events & EVENT_IN) && uring_arm_read(fd) == -1)
+        return -1;
+
+    return 0;
+}
+
+/* Cancels the request with 'data', if there's room to. Its completion is
+ * ignored either way, once the generation is bumped. */
+static void uring_cancel(__u8 opcode, __u64 data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe();
+
+    if (!sqe)
+        return ;
+
+    sqe->opcode = opcode;
+    sqe->addr = data;
+    sqe->user_data = URING_REMOVE_DATA;
+}
+
+/* Cancels the armed poll for 'fd', and bumps its generation */
+static void uring_disarm(int fd)
+{
+    if (slots[fd].armed)
+        uring_cancel(IORING_OP_POLL_REMOVE, slot_data(fd));
+
+    slots[fd].armed = 0;
+    slots[fd].gen++;
+}
+
+/* Cancels the read for 'fd', and bumps its generation */
+static void uring_disarm_read(int fd)
+{
+    if (slots[fd].reading)
+        uring_cancel(IORING_OP_ASYNC_CANCEL, slot_read_data(fd));
+
+    slots[fd].reading = 0;
+    slots[fd].read_gen++;
+}
+
+/* Sets up the provided buffer ring. It's fine if this fails, since the
+ * handlers can do their own reads. */
+static int uring_init_bufs(void)
+{
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    buf_ring = mmap(NULL, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf_ring == MAP_FAILED) {
+        buf_ring = NULL;
+        return -1;
+    }
+
+    buf_data = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if (!buf_data)
+        goto fail;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if (uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+        goto fail;
+
+    buf_tail = 0;
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        uring_give_buf(i);
+
+    have_bufs = 1;
+    return 0;
+
+  fail:
+    free(buf_data);
+    munmap(buf_ring, buf_ring_size);
+    buf_data = NULL;
+    buf_ring = NULL;
+    return -1;
+}
+
+static int uring_backend_init(void)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = uring_setup(URING_ENTRIES, &p);
+    if (ring_fd == -1)
+        return -1;
+
+    /* Waiting with a timeout needs IORING_ENTER_EXT_ARG */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+
+    ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    if (p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe) > ring_size)
+        ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQ_RING);
+    sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, IORING_OFF_SQES);
+    if (ring_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring_ptr != MAP_FAILED)
+            munmap(ring_ptr, ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        close(ring_fd);
+        ring_fd = -1;
+        return -1;
+    }
+
+    sq_head  = (unsigned int *)((char *)ring_ptr + p.sq_off.head);
+    sq_tail  = (unsigned int *)((char *)ring_ptr + p.sq_off.tail);
+    sq_mask  = (unsigned int *)((char *)ring_ptr + p.sq_off.ring_mask);
+    sq_array = (unsigned int *)((char *)ring_ptr + p.sq_off.array);
+
+    cq_head = (unsigned int *)((char *)ring_ptr + p.cq_off.head);
+    cq_tail = (unsigned int *)((char *)ring_ptr + p.cq_off.tail);
+    cq_mask = (unsigned int *)((char *)ring_ptr + p.cq_off.ring_mask);
+    cqes    = (struct io_uring_cqe *)((char *)ring_ptr + p.cq_off.cqes);
+
+    to_submit = 0;
+
+    have_bufs = 0;
+    recv_multishot = 1;
+    if (uring_init_bufs() == -1)
+        DEBUG_PRINT("No io_uring provided buffers, reads are done by the handlers");
+
+    return 0;
+}
+
+static void uring_backend_clear(void)
+{
+    if (ring_fd == -1)
+        return ;
+
+    munmap(sqes, sqes_size);
+    munmap(ring_ptr, ring_size);
+    close(ring_fd);
+    ring_fd = -1;
+
+    /* Closing the ring is what unregisters the buffers */
+    if (have_bufs) {
+        free(buf_data);
+        munmap(buf_ring, buf_ring_size);
+        buf_data = NULL;
+        buf_ring = NULL;
+        have_bufs = 0;
+    }
+
+    free(slots);
+    free(rearm_list);
+    slots = NULL;
+    rearm_list = NULL;
+    slot_count = 0;
+    rearm_count = 0;
+}
+
+static int uring_backend_add(struct event_fd *ev)
+{
+    struct uring_slot *new_slots;
+    struct stat st;
+    int *new_rearm, count;
+
+    if (ev->fd >= slot_count) {
+        count = (slot_count)? slot_count: 64;
+        while (count <= ev->fd)
+            count *= 2;
+
+        new_slots = realloc(slots, count * sizeof(*slots));
+        if (!new_slots)
+            return -1;
+        memset(new_slots + slot_count, 0, (count - slot_count) * sizeof(*slots));
+        slots = new_slots;
+
+        new_rearm = realloc(rearm_list, count * sizeof(*rearm_list));
+        if (!new_rearm)
+            return -1;
+        rearm_list = new_rearm;
+
+        slot_count = count;
+    }
+
+    if (slots[ev->fd].ev) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    slots[ev->fd].ev = ev;
+    slots[ev->fd].armed = 0;
+    slots[ev->fd].reading = 0;
+    slots[ev->fd].ring_read = 0;
+    slots[ev->fd].sock = 0;
+
+    if (ev->in && have_bufs) {
+        slots[ev->fd].ring_read = 1;
+        slots[ev->fd].sock = (fstat(ev->fd, &st) == 0 && S_ISSOCK(st.st_mode));
+        ev->in->loop_reads = 1;
+    }
+
+    if (uring_arm(ev->fd) == -1)
+        uring_queue_rearm(ev->fd);
+
+    return 0;
+}
+
+static int uring_backend_mod(struct event_fd *ev)
+{
+    int fd = ev->fd;
+
+    uring_disarm(fd);
+    if (slots[fd].reading && !(ev->events & EVENT_IN))
+        uring_disarm_read(fd);
+
+    if (uring_arm(fd) == -1)
+        uring_queue_rearm(fd);
+
+    return 0;
+}
+
+static void uring_backend_del(struct event_fd *ev)
+{
+    uring_disarm(ev->fd);
+    uring_disarm_read(ev->fd);
+
+    if (slots[ev->fd].ring_read)
+        ev->in->loop_reads = 0;
+
+    slots[ev->fd].ev = NULL;
+    slots[ev->fd].ring_read = 0;
+}
+
+/* Adds 'fd' to the ready list, or adds 'events' to its entry if it's already
+ * on it. Returns whether a new entry was used. */
+static int uring_ready(struct event_ready *ready, int count, int fd, unsigned int events)
+{
+    struct uring_slot *slot = slots + fd;
+
+    if (slot->ready_pass == wait_pass) {
+        ready[slot->ready_idx].events |= events;
+        return 0;
+    }
+
+    slot->ready_pass = wait_pass;
+    slot->ready_idx = count;
+    ready[count].ev = slot->ev;
+    ready[count].events = events;
+    return 1;
+}
+
+/* Handles the completion of a read. Returns the events to report, if any. */
+static unsigned int uring_read_done(int fd, struct io_uring_cqe *cqe, const char *data)
+{
+    struct uring_slot *slot = slots + fd;
+    struct buf_fd *in = slot->ev->in;
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        slot->reading = 0;
+        uring_queue_rearm(fd);
+    }
+
+    if (cqe->res > 0) {
+        buf_add_input(in, data, cqe->res);
+        return EVENT_IN;
+    }
+
+    if (cqe->res == 0) {
+        in->closed_gracefully = 1;
+        return EVENT_IN;
+    }
+
+    switch (-cqe->res) {
+    case EINVAL:
+        /* Older kernels don't know about multishot recv */
+        if (slot->sock && recv_multishot) {
+            DEBUG_PRINT("No multishot recv, using single-shot");
+            recv_multishot = 0;
+            return 0;
+        }
+        break;
+
+    /* The buffers ran out, or the read was cut short. It's re-armed. */
+    case ENOBUFS:
+    case EINTR:
+    case EAGAIN:
+        return 0;
+    }
+
+    in->errno_ret = -cqe->res;
+    return EVENT_IN;
+}
+
+static int uring_backend_wait(struct event_ready *ready, int max, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    struct io_uring_cqe *cqe;
+    struct uring_slot *slot;
+    unsigned int head, tail, events, bid;
+    const char *data;
+    int i, fd, count = 0, kept = 0, ret, err = 0;
+
+    /* Anything that can't be armed yet stays on the list */
+    for (i = 0; i < rearm_count; i++) {
+        fd = rearm_list[i];
+        if (uring_arm(fd) == -1) {
+            rearm_list[kept++] = fd;
+            continue;
+        }
+        slots[fd].rearm = 0;
+    }
+    rearm_count = kept;
+
+    memset(&arg, 0, sizeof(arg));
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+        arg.ts = (__u64)(unsigned long)&ts;
+    }
+
+    /* Submits all of the changes since the last wait, and waits, at once.
+     * Whatever happens, the CQ is still drained: EBUSY means it's full (Or
+     * the kernel has completions it couldn't fit), and the kernel only
+     * moves those over once there's room. */
+    ret = uring_enter(to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (ret >= 0)
+        to_submit -= ret;
+    else if (errno != ETIME && errno != EINTR && errno != EBUSY)
+        err = errno;
+
+    wait_pass++;
+
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+
+    /* Anything past 'max' is left for the next wait */
+    for (; head != tail && count < max; head++) {
+        cqe = cqes + (head & *cq_mask);
+
+        if (cqe->user_data == URING_REMOVE_DATA)
+            continue;
+
+        data = NULL;
+        bid = 0;
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            data = buf_data + (size_t)bid * URING_BUF_SIZE;
+        }
+
+        fd = cqe->user_data >> 32;
+        slot = (fd < slot_count)? slots + fd: NULL;
+
+        if (cqe->user_data & URING_READ_BIT) {
+            events = 0;
+            if (slot && slot->ev && (unsigned int)(cqe->user_data & URING_GEN_MASK) == (slot->read_gen & URING_GEN_MASK))
+                events = uring_read_done(fd, cqe, data);
+        } else {
+            if (!slot || !slot->ev || (unsigned int)(cqe->user_data & URING_GEN_MASK) != (slot->gen & URING_GEN_MASK))
+                continue;
+
+            slot->armed = 0;
+            uring_queue_rearm(fd);
+
+            events = (cqe->res < 0)? EVENT_ERR: from_poll(cqe->res);
+        }
+
+        /* The data was copied into the fd's buffer, if it was wanted */
+        if (data)
+            uring_give_buf(bid);
+
+        if (events)
+            count += uring_ready(ready, count, fd, events);
+    }
+
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    if (err && count == 0) {
+        errno = err;
+        return -1;
+    }
+
+    return count;
+}
+
+const struct event_backend event_uring_backend = {
+    .name  = "io_uring",
+    .init  = uring_backend_init,
+    .clear = uring_backend_clear,
+    .add   = uring_backend_add,
+    .mod   = uring_backend_mod,
+    .del   = uring_backend_del,
+    .wait  = uring_backend_wait,
+};
+
+#endif
@@ -9,22 +9,66 @@
 #include "global.h"
 
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
 #include <signal.h>
 
 #include "debug.h"
 #include "daemon.h"
 #include "arg.h"
+#include "event.h"
 #include "net_cons.h"
+#include "outbuf.h"
+#include "replies.h"
+#include "resolver.h"
+#include "writer.h"
+#include "timer.h"
 
 static struct network_cons state;
 
+/* Shutting down takes locks and writes to the writer's queue, which isn't
+ * safe from inside of a signal handler (The signal could arrive part way
+ * through either). So the handler only records the signal and wakes the
+ * event loop through 'signal_pipe', and the main loop does the rest. */
+static volatile sig_atomic_t caught_signal = 0;
+static int signal_pipe[2] = { -1, -1 };
+static struct event_fd signal_ev;
+
 static void sig_int_handler(int sig)
 {
-    DEBUG_PRINT("Recieved signal: %d", sig);
-    daemon_kill(&state);
+    int saved_errno = errno;
+
+    caught_signal = sig;
+    if (signal_pipe[1] != -1)
+        write(signal_pipe[1], "", 1);
+
+    errno = saved_errno;
+}
+
+static void signal_handle_wake(struct event_fd *ev, unsigned int events)
+{
+    char buf[16];
+
+    while (read(ev->fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+static void signal_init(void)
+{
+    if (pipe(signal_pipe) == -1)
+        return ;
+
+    fcntl(signal_pipe[0], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[0], F_GETFL));
+    fcntl(signal_pipe[1], F_SETFL, O_NONBLOCK | fcntl(signal_pipe[1], F_GETFL));
+
+    event_fd_init(&signal_ev);
+    event_add(&signal_ev, signal_pipe[0], EVENT_IN, signal_handle_wake);
 }
 
 static void sig_segv_handler(int seg)
@@ -32,24 +76,32 @@ static void sig_segv_handler(int seg)
     exit(0);
 }
 
-static void init_directory(void)
+/* Every channel keeps its 'in' fifo open, so allow as many fds as we can */
+static void raise_fd_limit(void)
 {
-    mkdir(prog_config.root_directory, 0755);
-    chdir(prog_config.root_directory);
+    struct rlimit lim;
 
-    network_cons_init_directory(&state);
+    if (getrlimit(RLIMIT_NOFILE, &lim) == -1)
+        return ;
+
+    if (lim.rlim_cur < lim.rlim_max) {
+        lim.rlim_cur = lim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &lim);
+    }
 }
 
-int main(int argc, char **argv)
+static void init_directory(void)
 {
-    int ret;
-    int maxfd = 0;
-    fd_set infd, outfd;
+    network_cons_init_directory(&state, prog_config.root_directory);
+}
 
+int main(int argc, char **argv)
+{
     DEBUG_INIT();
     DEBUG_PRINT("Starting up...");
 
     config_init();
+    replies_init();
 
     network_cons_init(&state);
 
@@ -65,32 +117,46 @@ int main(int argc, char **argv)
     if (!prog_config.stay_in_forground)
         daemon_init(&state);
 
+    if (event_init() == -1)
+        return 1;
+
+    /* These start threads, so they have to come after daemon_init's fork */
+    if (resolver_init() == -1)
+        DEBUG_PRINT("Unable to start the resolver thread, lookups will block");
+    if (writer_init() == -1)
+        DEBUG_PRINT("Unable to start the writer thread, file writes will block");
+
+    /* Only used for reconnect jitter, so it just has to differ between
+     * instances */
+    srand(time(NULL) ^ getpid());
+
+    raise_fd_limit();
+    outbuf_set_max_open(prog_config.max_open_logs);
+
     init_directory();
     network_cons_connect_networks(&state);
 
-    signal(SIGILL, sig_int_handler);
+    signal_init();
+
     signal(SIGINT, sig_int_handler);
     signal(SIGQUIT, sig_int_handler);
     signal(SIGTERM, sig_int_handler);
 
+    /* Returning from these would just run the faulting instruction again */
+    signal(SIGILL, sig_segv_handler);
     signal(SIGSEGV, sig_segv_handler);
 
-    while (1) {
-        FD_ZERO(&infd);
-        FD_ZERO(&outfd);
-        maxfd = 0;
-
-        network_cons_set_select_desc(&state, &infd, &outfd, &maxfd);
-
-        if ((ret = select(maxfd + 1,
-                          &infd,
-                          &outfd,
-                          NULL, NULL))) {
-            DEBUG_PRINT("Select Ret: %d", ret);
-            network_cons_handle_file_check(&state, &infd, &outfd);
-        }
+    while (!caught_signal) {
+        event_wait(timer_timeout());
+        timer_run();
+        network_cons_flush(&state);
+        outbuf_flush_all();
+        network_cons_check_networks(&state);
     }
 
+    DEBUG_PRINT("Recieved signal: %d", (int)caught_signal);
+    daemon_kill(&state);
+
     return 0;
 }
 
@@ -21,8 +21,14 @@
 
 int alloc_sprintfv (char **buf, const char *format, va_list lst)
 {
-    size_t size = vsnprintf(NULL, 0, format, lst) + 1;
-    
+    va_list cpy;
+    size_t size;
+
+    /* 'lst' is used twice, so the size is computed from a copy */
+    va_copy(cpy, lst);
+    size = vsnprintf(NULL, 0, format, cpy) + 1;
+    va_end(cpy);
+
     *buf = malloc(size);
 
     if (!*buf)
@@ -54,6 +60,7 @@ void fdprintfv (const int fd, const char *format, va_list lst)
         return ;
 
     write(fd, buf, size);
+    free(buf);
 }
 
 void fdprintf (const int fd, const char *format, ...)
@@ -64,4 +71,3 @@ void fdprintf (const int fd, const char *format, ...)
     fdprintfv(fd, format, lst);
     va_end(lst);
 }
-
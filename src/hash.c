@@ -0,0 +1,109 @@
+/*
+ * ./hash.c -- Implements a generic intrusive hash table
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "hash.h"
+
+#define HASH_INITIAL_BUCKETS 16
+
+void hash_init(struct hash_table *table)
+{
+    memset(table, 0, sizeof(struct hash_table));
+}
+
+void hash_clear(struct hash_table *table)
+{
+    free(table->buckets);
+    memset(table, 0, sizeof(struct hash_table));
+}
+
+static void hash_resize(struct hash_table *table, unsigned int bucket_count)
+{
+    struct hash_node **buckets, *node, *next;
+    unsigned int i;
+
+    buckets = calloc(bucket_count, sizeof(*buckets));
+
+    for (i = 0; i < table->bucket_count; i++) {
+        for (node = table->buckets[i]; node != NULL; node = next) {
+            next = node->next;
+            node->next = buckets[node->hash & (bucket_count - 1)];
+            buckets[node->hash & (bucket_count - 1)] = node;
+        }
+    }
+
+    free(table->buckets);
+    table->buckets = buckets;
+    table->bucket_count = bucket_count;
+}
+
+void hash_add(struct hash_table *table, struct hash_node *node, unsigned int hash)
+{
+    struct hash_node **bucket;
+
+    if (table->bucket_count == 0)
+        hash_resize(table, HASH_INITIAL_BUCKETS);
+    else if (table->count >= table->bucket_count)
+        hash_resize(table, table->bucket_count * 2);
+
+    node->hash = hash;
+
+    bucket = table->buckets + (hash & (table->bucket_count - 1));
+    node->next = *bucket;
+    *bucket = node;
+
+    table->count++;
+}
+
+void hash_remove(struct hash_table *table, struct hash_node *node)
+{
+    struct hash_node **cur;
+
+    if (table->bucket_count == 0)
+        return ;
+
+    cur = table->buckets + (node->hash & (table->bucket_count - 1));
+    for (; *cur != NULL; cur = &((*cur)->next)) {
+        if (*cur == node) {
+            *cur = node->next;
+            node->next = NULL;
+            table->count--;
+            return ;
+        }
+    }
+}
+
+struct hash_node *hash_first(const struct hash_table *table, unsigned int hash)
+{
+    struct hash_node *node;
+
+    if (table->bucket_count == 0)
+        return NULL;
+
+    node = table->buckets[hash & (table->bucket_count - 1)];
+    if (node && node->hash != hash)
+        node = hash_next(node, hash);
+
+    return node;
+}
+
+struct hash_node *hash_next(const struct hash_node *node, unsigned int hash)
+{
+    for (node = node->next; node != NULL; node = node->next)
+        if (node->hash == hash)
+            return (struct hash_node *)node;
+
+    return NULL;
+}
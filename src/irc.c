@@ -10,172 +10,275 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/fcntl.h>
-#include <netinet/in.h>
-#include <netdb.h>
 #include <stdarg.h>
 
 #include "debug.h"
 #include "irc.h"
 
-void irc_reply_free (struct irc_reply *rpl)
+static void irc_parse_prefix (struct irc_prefix *prefix, char *raw)
 {
-    int index = 0;
+    char *tmp;
 
-    free(rpl->raw);
-    free(rpl->prefix.raw);
-    free(rpl->prefix.user);
-    free(rpl->prefix.host);
+    prefix->nick = raw;
 
-    DEBUG_PRINT("Array size: %d", ARRAY_SIZE(rpl->lines));
+    tmp = strchr(raw, '@');
+    if (tmp) {
+        *tmp = '\0';
+        prefix->host = tmp + 1;
+    }
 
-    ARRAY_FOREACH(rpl->lines, index)
-        free(rpl->lines.arr[index]);
-    ARRAY_FREE(rpl->lines);
-    free(rpl->colon);
-    free(rpl->cmd);
-    free(rpl);
+    tmp = strchr(raw, '!');
+    if (tmp) {
+        *tmp = '\0';
+        prefix->user = tmp + 1;
+    }
 }
 
-static void irc_parse_prefix (struct irc_prefix *prefix)
+static void irc_parse_tags (struct irc_reply *rpl, char *raw)
 {
-    char *tmp;
-    int len;
-
-    tmp = prefix->raw;
-    for (; *tmp && *tmp != '!'; tmp++);
-    if (*tmp == '!') {
-        len = tmp - prefix->raw;
-        prefix->user = malloc(len + 1);
-        memcpy(prefix->user, prefix->raw, len);
-        prefix->user[len] = '\0';
-        tmp += 2;
+    char *tag, *tmp;
+
+    while (*raw && rpl->tag_count < IRC_MAX_TAGS) {
+        tag = raw;
+
+        tmp = strchr(raw, ';');
+        if (tmp) {
+            *tmp = '\0';
+            raw = tmp + 1;
+        } else {
+            raw = tag + strlen(tag);
+        }
+
+        if (*tag == '\0')
+            continue;
+
+        rpl->tags[rpl->tag_count].key = tag;
+        tmp = strchr(tag, '=');
+        if (tmp) {
+            *tmp = '\0';
+            rpl->tags[rpl->tag_count].value = tmp + 1;
+        } else {
+            rpl->tags[rpl->tag_count].value = tag + strlen(tag);
+        }
+        rpl->tag_count++;
+    }
+}
+
+/* Returns the next space-separated token starting at 'cur', and terminates
+ * it. 'cur' is moved past the token and any following spaces. */
+static char *irc_next_token (char **cur)
+{
+    char *start = *cur, *tmp;
+
+    tmp = strchr(start, ' ');
+    if (tmp) {
+        *tmp = '\0';
+        for (tmp++; *tmp == ' '; tmp++)
+            ;
+        *cur = tmp;
     } else {
-        tmp = prefix->raw;
+        *cur = start + strlen(start);
+    }
+
+    return start;
+}
+
+enum irc_reply_code irc_cmd_lookup (const char *cmd)
+{
+    switch (cmd[0]) {
+    case 'A':
+        if (strcmp(cmd, "AWAY") == 0)
+            return CMD_AWAY;
+        if (strcmp(cmd, "AUTHENTICATE") == 0)
+            return CMD_AUTHENTICATE;
+        break;
+    case 'C':
+        if (strcmp(cmd, "CAP") == 0)
+            return CMD_CAP;
+        break;
+    case 'E':
+        if (strcmp(cmd, "ERROR") == 0)
+            return CMD_ERROR;
+        break;
+    case 'I':
+        if (strcmp(cmd, "INVITE") == 0)
+            return CMD_INVITE;
+        break;
+    case 'J':
+        if (strcmp(cmd, "JOIN") == 0)
+            return CMD_JOIN;
+        break;
+    case 'K':
+        if (strcmp(cmd, "KICK") == 0)
+            return CMD_KICK;
+        if (strcmp(cmd, "KILL") == 0)
+            return CMD_KILL;
+        break;
+    case 'M':
+        if (strcmp(cmd, "MODE") == 0)
+            return CMD_MODE;
+        break;
+    case 'N':
+        if (strcmp(cmd, "NICK") == 0)
+            return CMD_NICK;
+        if (strcmp(cmd, "NOTICE") == 0)
+            return CMD_NOTICE;
+        break;
+    case 'P':
+        if (strcmp(cmd, "PRIVMSG") == 0)
+            return CMD_PRIVMSG;
+        if (strcmp(cmd, "PING") == 0)
+            return CMD_PING;
+        if (strcmp(cmd, "PONG") == 0)
+            return CMD_PONG;
+        if (strcmp(cmd, "PART") == 0)
+            return CMD_PART;
+        break;
+    case 'Q':
+        if (strcmp(cmd, "QUIT") == 0)
+            return CMD_QUIT;
+        break;
+    case 'T':
+        if (strcmp(cmd, "TOPIC") == 0)
+            return CMD_TOPIC;
+        break;
+    case 'W':
+        if (strcmp(cmd, "WALLOPS") == 0)
+            return CMD_WALLOPS;
+        break;
     }
 
-    len = strlen(tmp);
-    prefix->host = malloc(len + 1);
-    strcpy(prefix->host, tmp);
+    return CMD_UNKNOWN;
 }
 
-struct irc_reply *irc_parse_line (const char *line)
+int irc_parse_line (char *line, struct irc_reply *rpl)
 {
-    const char *tmp;
-    const char *cur;
-    int code, len, exit_flag = 0, size;
-    struct irc_reply *rpl;
+    char *cur = line;
+
     if (!line)
-        return NULL;
+        return -1;
 
-    rpl = malloc(sizeof(struct irc_reply));
     memset(rpl, 0, sizeof(struct irc_reply));
 
-    rpl->raw = strdup(line);
-
-    cur = line;
+    if (cur[0] == '@') {
+        cur++;
+        irc_parse_tags(rpl, irc_next_token(&cur));
+    }
 
     if (cur[0] == ':') {
         cur++;
-        tmp = cur;
-        for (; *tmp && *tmp != ' '; tmp++);
-        if (*tmp == ' ') {
-            rpl->prefix.raw = malloc(tmp - cur + 1);
-            memcpy(rpl->prefix.raw, cur, tmp - cur);
-            rpl->prefix.raw[tmp - cur] = '\0';
-            cur = tmp + 1;
-            irc_parse_prefix(&rpl->prefix);
-        }
+        irc_parse_prefix(&rpl->prefix, irc_next_token(&cur));
     }
 
-    code = atoi(cur);
+    if (*cur == '\0')
+        return -1;
 
-    if (code != 0) {
-        rpl->code = code;
-        cur += 4;
-    } else {
-        tmp = cur;
-        for (; *tmp && *tmp != ' '; tmp++);
-        if (*tmp == ' ') {
-            rpl->cmd = malloc(tmp - cur + 1);
-            memcpy(rpl->cmd, cur, tmp - cur);
-            rpl->cmd[tmp - cur] = '\0';
-            cur = tmp + 1;
-        }
-    }
+    rpl->cmd = irc_next_token(&cur);
 
-    tmp = cur;
+    if (isdigit(rpl->cmd[0]) && isdigit(rpl->cmd[1])
+        && isdigit(rpl->cmd[2]) && rpl->cmd[3] == '\0')
+        rpl->code = (rpl->cmd[0] - '0') * 100 + (rpl->cmd[1] - '0') * 10 + (rpl->cmd[2] - '0');
+    else
+        rpl->code = irc_cmd_lookup(rpl->cmd);
 
-    for (; *tmp && !exit_flag; tmp++) {
-        switch(*tmp) {
-        case ':':
-            len = strlen(tmp);
-            rpl->colon = malloc(len + 1);
-            strcpy(rpl->colon, tmp + 1);
-            exit_flag = 1;
-            break;
-        case ' ':
-            size = ARRAY_SIZE(rpl->lines);
-            ARRAY_RESIZE(rpl->lines, size + 1);
-            rpl->lines.arr[size] = malloc(tmp - cur + 1);
-            memcpy(rpl->lines.arr[size], cur, tmp - cur);
-            rpl->lines.arr[size][tmp - cur] = '\0';
-            cur = tmp + 1;
-            break;
-        default:
+    while (*cur) {
+        if (*cur == ':' || rpl->param_count == IRC_MAX_PARAMS - 1) {
+            if (*cur == ':')
+                cur++;
+            rpl->trailing = cur;
             break;
         }
-    }
 
-    if (!exit_flag) {
-        len = strlen(cur);
-        size = ARRAY_SIZE(rpl->lines);
-        ARRAY_RESIZE(rpl->lines, size + 1);
-        rpl->lines.arr[size] = malloc(len + 1);
-        strcpy(rpl->lines.arr[size], cur);
+        rpl->params[rpl->param_count++] = irc_next_token(&cur);
     }
 
-    return rpl;
+    return 0;
 }
 
-void irc_connect (struct network *net)
+const char *irc_reply_param (const struct irc_reply *rpl, int index)
 {
-    struct sockaddr_in sin;
-    struct hostent *hp = gethostbyname(net->url);
+    if (index < rpl->param_count)
+        return rpl->params[index];
+    else if (index == rpl->param_count)
+        return rpl->trailing;
+    else
+        return NULL;
+}
 
-    memset(&sin, 0, sizeof(struct sockaddr_in));
-    if(!hp) {
-        net->close_network = 1;
-    }
-    sin.sin_family = AF_INET;
-    memcpy(&sin.sin_addr, hp->h_addr_list[0], hp->h_length);
-    sin.sin_port = htons(net->portno);
-    if((net->sock.fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        net->close_network = 1;
-        return ;
-    }
+const char *irc_reply_tag (const struct irc_reply *rpl, const char *key)
+{
+    int i;
 
-    if(connect(net->sock.fd, (const struct sockaddr *) &sin, sizeof(sin)) < 0) {
-        net->close_network = 1;
-        return ;
+    for (i = 0; i < rpl->tag_count; i++)
+        if (strcmp(rpl->tags[i].key, key) == 0)
+            return rpl->tags[i].value;
+
+    return NULL;
+}
+
+int irc_connect (const struct sockaddr *addr, socklen_t len)
+{
+    int fd;
+
+    if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    /* The socket is made non-blocking before connecting, so that a slow or
+     * unreachable server doesn't hold up the rest of the networks */
+    fcntl(fd, F_SETFL, O_NONBLOCK | fcntl(fd, F_GETFL));
+
+    if (connect(fd, addr, len) == 0 || errno == EINPROGRESS)
+        return fd;
+
+    close(fd);
+    return -1;
+}
+
+int irc_connect_finish (int fd)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1)
+        return -1;
+
+    if (err) {
+        errno = err;
+        return -1;
     }
 
-    fcntl(net->sock.fd, F_SETFL, O_NONBLOCK | fcntl(net->sock.fd, F_GETFL));
+    return 0;
 }
 
-void irc_send_raw (struct network *net, const char *text, ...)
+void irc_sendv (struct network *net, enum sendq_class class, const char *target, const char *text, va_list list)
 {
-    va_list list;
     DEBUG_PRINT("%s: %s", net->name, text);
+    sendq_printfv(&net->sendq, class, target, text, list);
+}
+
+void irc_send (struct network *net, enum sendq_class class, const char *target, const char *text, ...)
+{
+    va_list list;
 
     va_start(list, text);
-    fdprintfv(net->sock.fd, text, list);
+    irc_sendv(net, class, target, text, list);
     va_end(list);
+}
+
+void irc_send_raw (struct network *net, const char *text, ...)
+{
+    va_list list;
 
-    write(net->sock.fd, CRLF, 2);
+    va_start(list, text);
+    irc_sendv(net, SENDQ_INTERACTIVE, NULL, text, list);
+    va_end(list);
 }
 
 void irc_nick (struct network *net)
@@ -196,13 +299,94 @@ void irc_pass (struct network *net)
     irc_send_raw(net, "PASS %s", net->password);
 }
 
+void irc_cap_req (struct network *net, const char *caps)
+{
+    irc_send_raw(net, "CAP REQ :%s", caps);
+}
+
+void irc_cap_end (struct network *net)
+{
+    irc_send_raw(net, "CAP END");
+}
+
 void irc_join (struct network *net, const char *chan)
 {
-    irc_send_raw(net, "JOIN %s", chan);
+    irc_send(net, SENDQ_BULK, chan, "JOIN %s", chan);
+}
+
+void irc_join_batch_init (struct irc_join_batch *batch, struct network *net, unsigned int max_targets)
+{
+    memset(batch, 0, sizeof(struct irc_join_batch));
+    batch->net = net;
+    batch->max_targets = max_targets;
+}
+
+void irc_join_batch_flush (struct irc_join_batch *batch)
+{
+    if (!batch->count)
+        return ;
+
+    if (batch->key_count)
+        irc_send(batch->net, SENDQ_BULK, SENDQ_TARGET_LIST, "JOIN %s %s", batch->chans, batch->keys);
+    else
+        irc_send(batch->net, SENDQ_BULK, SENDQ_TARGET_LIST, "JOIN %s", batch->chans);
+
+    batch->count = batch->key_count = 0;
+    batch->chans_len = batch->keys_len = 0;
+}
+
+static void irc_join_batch_append (char *buf, size_t *len, const char *str, size_t str_len)
+{
+    if (*len)
+        buf[(*len)++] = ',';
+
+    memcpy(buf + *len, str, str_len);
+    *len += str_len;
+    buf[*len] = '\0';
+}
+
+void irc_join_batch_add (struct irc_join_batch *batch, const char *chan, const char *key)
+{
+    size_t chan_len = strlen(chan), key_len = (key)? strlen(key): 0;
+    size_t chans_len, keys_len, line_len;
+
+    /* A key after a channel without one would end up matched with the wrong
+     * channel */
+    if (key && batch->key_count != batch->count)
+        irc_join_batch_flush(batch);
+
+    chans_len = batch->chans_len + ((batch->count)? 1: 0) + chan_len;
+    keys_len = (key)? batch->keys_len + ((batch->key_count)? 1: 0) + key_len: batch->keys_len;
+    line_len = strlen("JOIN ") + chans_len + ((keys_len)? 1 + keys_len: 0);
+
+    if (batch->count && (line_len > IRC_MAX_LINE
+                         || (batch->max_targets && batch->count == batch->max_targets))) {
+        irc_join_batch_flush(batch);
+        line_len = strlen("JOIN ") + chan_len + ((key)? 1 + key_len: 0);
+    }
+
+    /* Even on its own this one doesn't fit, so the server can sort it out */
+    if (line_len > IRC_MAX_LINE) {
+        if (key)
+            irc_send(batch->net, SENDQ_BULK, chan, "JOIN %s %s", chan, key);
+        else
+            irc_join(batch->net, chan);
+        return ;
+    }
+
+    irc_join_batch_append(batch->chans, &batch->chans_len, chan, chan_len);
+    batch->count++;
+
+    if (key) {
+        irc_join_batch_append(batch->keys, &batch->keys_len, key, key_len);
+        batch->key_count++;
+    }
 }
 
 void irc_part (struct network *net, const char *chan, const char *msg)
 {
+    network_drop_queued(net, chan);
+
     if (msg)
         irc_send_raw(net, "PART %s :%s", chan, msg);
     else
@@ -212,13 +396,13 @@ void irc_part (struct network *net, const char *chan, const char *msg)
 void irc_quit (struct network *net, const char *msg)
 {
     if (msg)
-        irc_send_raw(net, "QUIT :%s", msg);
+        irc_send(net, SENDQ_URGENT, NULL, "QUIT :%s", msg);
     else
-        irc_send_raw(net, "QUIT");
+        irc_send(net, SENDQ_URGENT, NULL, "QUIT");
 }
 
 void irc_privmsg (struct network *net, const char *chan, const char *text)
 {
-    irc_send_raw(net, "PRIVMSG %s :%s", chan, text);
+    irc_send(net, SENDQ_INTERACTIVE, chan, "PRIVMSG %s :%s", chan, text);
 }
 
@@ -0,0 +1,212 @@
+/*
+ * ./isupport.c -- Parsing of the server's RPL_ISUPPORT (005) tokens
+ *
+ * Servers differ on what starts a channel name, which symbols mark a
+ * member's status, how names are case-folded, and how much one command can
+ * carry. RPL_ISUPPORT tells us, and the tokens we care about are kept as
+ * lookup tables, so checking a character is a single load that's right for
+ * whichever server we're on.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "debug.h"
+#include "isupport.h"
+
+/* Every setter is passed NULL to go back to the default */
+
+static void isupport_clear_class (struct isupport *is, unsigned char bits)
+{
+    int i;
+
+    for (i = 0; i < 256; i++)
+        is->class[i] &= ~bits;
+}
+
+static void isupport_set_chantypes (struct isupport *is, const char *value)
+{
+    const unsigned char *cur;
+
+    if (!value)
+        value = ISUPPORT_DEFAULT_CHANTYPES;
+
+    /* An empty value means the server has no channels at all */
+    isupport_clear_class(is, ISUPPORT_CHANTYPE);
+    for (cur = (const unsigned char *)value; *cur; cur++)
+        is->class[*cur] |= ISUPPORT_CHANTYPE;
+}
+
+static void isupport_set_prefix (struct isupport *is, const char *value)
+{
+    const char *modes, *symbols, *op;
+    unsigned char sym;
+    int i, count;
+
+    if (!value)
+        value = ISUPPORT_DEFAULT_PREFIX;
+
+    isupport_clear_class(is, ISUPPORT_PREFIX | ISUPPORT_OP | ISUPPORT_VOICE);
+    memset(is->prefix_mode, 0, sizeof(is->prefix_mode));
+
+    /* Ex. "(qaohv)~&@%+" -- The modes are matched up with the symbols by
+     * position, and are listed from the highest status to the lowest */
+    if (value[0] != '(')
+        return ;
+
+    modes = value + 1;
+    symbols = strchr(modes, ')');
+    if (!symbols)
+        return ;
+
+    count = symbols - modes;
+    symbols++;
+
+    op = memchr(modes, 'o', count);
+
+    for (i = 0; i < count && symbols[i]; i++) {
+        sym = symbols[i];
+        is->class[sym] |= ISUPPORT_PREFIX;
+        is->prefix_mode[sym] = modes[i];
+
+        if (op && modes + i <= op)
+            is->class[sym] |= ISUPPORT_OP;
+        if (modes[i] == 'v')
+            is->class[sym] |= ISUPPORT_VOICE;
+    }
+}
+
+static void isupport_set_casemapping (struct isupport *is, const char *value)
+{
+    int map;
+
+    if (!value) {
+        is->casemapping = CASEMAP_RFC1459;
+        return ;
+    }
+
+    /* A mapping we don't know is ignored, RFC 1459 is the closest guess */
+    map = irc_casemap_parse(value);
+    if (map != -1)
+        is->casemapping = map;
+}
+
+static void isupport_set_nicklen (struct isupport *is, const char *value)
+{
+    is->nicklen = (value)? strtoul(value, NULL, 10): 0;
+
+    if (!is->nicklen)
+        is->nicklen = ISUPPORT_DEFAULT_NICKLEN;
+}
+
+static void isupport_set_modes (struct isupport *is, const char *value)
+{
+    /* "MODES" with no value means there's no limit */
+    is->modes = (value)? strtoul(value, NULL, 10): ISUPPORT_DEFAULT_MODES;
+}
+
+static void isupport_set_targmax (struct isupport *is, const char *value)
+{
+    const char *cur;
+
+    /* Ex. "PRIVMSG:4,JOIN:,PART:" -- An empty limit means there isn't one */
+    is->join_targmax = 0;
+    for (cur = value; cur && *cur; cur = strchr(cur, ',')) {
+        if (*cur == ',')
+            cur++;
+
+        if (strncasecmp(cur, "JOIN:", 5) == 0) {
+            is->join_targmax = strtoul(cur + 5, NULL, 10);
+            return ;
+        }
+    }
+}
+
+static void isupport_set_chanlimit (struct isupport *is, const char *value)
+{
+    const char *cur = value, *colon;
+    int groups = 0;
+
+    /* Ex. "#&:100,+:10" -- All of the prefixes before a colon share the
+     * limit after it, and an empty limit means there isn't one */
+    memset(is->chanlimit_group, 0, sizeof(is->chanlimit_group));
+
+    while (cur && *cur && groups < ISUPPORT_CHANLIMIT_MAX) {
+        colon = strchr(cur, ':');
+        if (!colon)
+            break;
+
+        if (isdigit(colon[1])) {
+            is->chanlimit[groups] = strtoul(colon + 1, NULL, 10);
+            groups++;
+            for (; cur < colon; cur++)
+                is->chanlimit_group[(unsigned char)*cur] = groups;
+        }
+
+        cur = strchr(colon, ',');
+        if (cur)
+            cur++;
+    }
+}
+
+static const struct isupport_token {
+    const char *name;
+    void (*set) (struct isupport *, const char *value);
+} isupport_tokens[] = {
+    { "CHANTYPES",   isupport_set_chantypes },
+    { "PREFIX",      isupport_set_prefix },
+    { "CASEMAPPING", isupport_set_casemapping },
+    { "NICKLEN",     isupport_set_nicklen },
+    { "MODES",       isupport_set_modes },
+    { "TARGMAX",     isupport_set_targmax },
+    { "CHANLIMIT",   isupport_set_chanlimit },
+    { NULL }
+};
+
+void isupport_init (struct isupport *is)
+{
+    const struct isupport_token *tok;
+
+    memset(is, 0, sizeof(struct isupport));
+
+    for (tok = isupport_tokens; tok->name; tok++)
+        (tok->set) (is, NULL);
+}
+
+void isupport_parse (struct isupport *is, const char *token)
+{
+    const struct isupport_token *tok;
+    const char *value;
+    size_t len;
+    int negated = 0;
+
+    if (token[0] == '-') {
+        negated = 1;
+        token++;
+    }
+
+    value = strchr(token, '=');
+    if (value)
+        len = value++ - token;
+    else
+        len = strlen(token);
+
+    for (tok = isupport_tokens; tok->name; tok++) {
+        if (strncmp(tok->name, token, len) != 0 || tok->name[len] != '\0')
+            continue;
+
+        DEBUG_PRINT("ISUPPORT: %s", token);
+        (tok->set) (is, (negated)? NULL: (value)? value: "");
+        return ;
+    }
+}
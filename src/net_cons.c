@@ -19,29 +19,54 @@
 #include "config.h"
 #include "network.h"
 #include "net_cons.h"
+#include "writer.h"
 
 void network_cons_init(struct network_cons *con)
 {
     memset(con, 0, sizeof(struct network_cons));
 
+    con->dirfd = -1;
     buf_init(&con->cmdfd);
+    event_fd_init(&con->cmd_ev);
 }
 
 void network_cons_clear(struct network_cons *con)
 {
     network_clear_all(con->head);
 
+    event_del(&con->cmd_ev);
+    CLOSE_FD(con->cmdfd.fd);
     buf_free(&con->cmdfd);
 
-    unlink("cmd");
+    unlinkat(con->dirfd, "cmd", 0);
+    writer_close(con->dirfd);
+    con->dirfd = -1;
 }
 
-void network_cons_init_directory(struct network_cons *con)
+static void network_cons_handle_cmd(struct event_fd *ev, unsigned int events)
+{
+    struct network_cons *con = container_of(ev, struct network_cons, cmd_ev);
+    char *line;
+
+    buf_handle_input(&(con->cmdfd));
+    while ((line = buf_next_line(&(con->cmdfd), NULL)) != NULL)
+        DEBUG_PRINT("Cmd: %s", line);
+}
+
+void network_cons_init_directory(struct network_cons *con, const char *root)
 {
     struct network *tmp;
 
-    mkfifo("cmd", 0755);
-    con->cmdfd.fd = open("cmd", O_RDWR | O_NONBLOCK, 0);
+    mkdir(root, 0755);
+    con->dirfd = open(root, O_RDONLY | O_DIRECTORY);
+    if (con->dirfd == -1) {
+        DEBUG_PRINT("Unable to open %s", root);
+        return ;
+    }
+
+    mkfifoat(con->dirfd, "cmd", 0755);
+    con->cmdfd.fd = openat(con->dirfd, "cmd", O_RDWR | O_NONBLOCK, 0);
+    event_add_buf(&con->cmd_ev, &con->cmdfd, EVENT_IN, network_cons_handle_cmd);
 
     for (tmp = con->head; tmp != NULL; tmp = tmp->next)
         network_setup_files(tmp);
@@ -55,44 +80,27 @@ void network_cons_connect_networks (struct network_cons *con)
         network_connect(tmp);
 }
 
-void network_cons_set_select_desc (struct network_cons *con, fd_set *infd, fd_set *outfd, int *maxfd)
+void network_cons_flush (struct network_cons *con)
 {
     struct network *tmp;
-    if (con->cmdfd.fd != -1) {
-        FD_SET(con->cmdfd.fd, infd);
-        if (con->cmdfd.fd > *maxfd)
-            *maxfd = con->cmdfd.fd;
-    }
-    for (tmp = con->head; tmp != NULL; tmp = tmp->next)
-        network_init_select_desc(tmp, infd, outfd, maxfd);
-}
 
-static void handle_networks(struct network_cons *con)
-{
-    struct network *net, *tmp;
-    for (net = con->head; net != NULL; net = tmp) {
-        tmp = net->next;
-        if (net->close_network)
-            network_clear(net);
-    }
+    for (tmp = con->head; tmp != NULL; tmp = tmp->next)
+        network_flush(tmp);
 }
 
-void network_cons_handle_file_check(struct network_cons *con, fd_set *infd, fd_set *outfd)
+void network_cons_check_networks(struct network_cons *con)
 {
-    struct network *tmp;
-    if (FD_ISSET(con->cmdfd.fd, infd)) {
-        buf_handle_input(&(con->cmdfd));
-        while (con->cmdfd.has_line > 0) {
-            char *line = buf_read_line(&(con->cmdfd));
-            DEBUG_PRINT("Cmd: %s", line);
-            free(line);
+    struct network **net, *tmp;
+    for (net = &con->head; *net != NULL;) {
+        if ((*net)->close_network) {
+            tmp = *net;
+            *net = tmp->next;
+            network_clear(tmp);
+            free(tmp);
+        } else {
+            net = &((*net)->next);
         }
     }
-
-    for (tmp = con->head; tmp != NULL; tmp = tmp->next)
-        network_handle_input(tmp, infd, outfd);
-
-    handle_networks(con);
 }
 
 void network_cons_load_config(struct network_cons *con)
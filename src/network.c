@@ -14,34 +14,61 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
-#include <sys/select.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 
 #include "debug.h"
 #include "buf.h"
+#include "clock.h"
 #include "channel.h"
+#include "event.h"
 #include "irc.h"
 #include "replies.h"
 #include "config.h"
+#include "writer.h"
 #include "network.h"
 
 void network_init(struct network *net)
 {
+    int i;
+
     memset(net, 0, sizeof(struct network));
     net->portno = DEFAULT_PORT;
 
     net->conf = prog_config.net_global_conf;
 
+    hash_init(&net->channel_hash);
+    hash_init(&net->user_hash);
+    isupport_init(&net->isupport);
+    net->casemap = irc_casemap_table(net->isupport.casemapping);
+
     buf_init(&net->sock);
     buf_init(&net->cmdfd);
+    event_fd_init(&net->sock_ev);
+    sendq_init(&net->sendq);
+    timer_init(&net->send_timer);
+    resolver_req_init(&net->resolve);
+    timer_init(&net->connect_timer);
+    timer_init(&net->reconnect_timer);
+    timer_init(&net->ping_timer);
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++) {
+        net->attempts[i].fd = -1;
+        event_fd_init(&net->attempts[i].ev);
+    }
+    event_fd_init(&net->cmd_ev);
+    outbuf_init(&net->raw);
+    outbuf_init(&net->motd);
+    net->dirfd = -1;
     net->joinedfd = -1;
-    net->motdfd = -1;
-    net->rawfd = -1;
     net->realnamefd = -1;
     net->nicknamefd = -1;
+    net->lagfd = -1;
 }
 
+static void network_handle_cmd   (struct event_fd *, unsigned int);
+static void network_handle_input (struct event_fd *, unsigned int);
+static void network_update_casemap (struct network *);
+
 void network_setup_files (struct network *net)
 {
     struct channel *tmp;
@@ -49,169 +76,463 @@ void network_setup_files (struct network *net)
     if (!net->name)
         return ;
 
-    mkdir(net->name, 0775);
-    chdir(net->name);
+    mkdirat(net->con->dirfd, net->name, 0775);
+    net->dirfd = openat(net->con->dirfd, net->name, O_RDONLY | O_DIRECTORY);
+    if (net->dirfd == -1) {
+        DEBUG_PRINT("Unable to open the directory for %s", net->name);
+        return ;
+    }
 
-    mkfifo("cmd", 0772);
-    net->cmdfd.fd = open("cmd", BUF_FIFO_OPEN_FLAGS, 0);
+    mkfifoat(net->dirfd, "cmd", 0772);
+    net->cmdfd.fd = openat(net->dirfd, "cmd", BUF_FIFO_OPEN_FLAGS, 0);
+    event_add_buf(&net->cmd_ev, &net->cmdfd, EVENT_IN, network_handle_cmd);
 
-    net->rawfd      = open("raw",      BUF_FILE_OPEN_FLAGS, 0750);
-    net->joinedfd   = open("joined",   BUF_FILE_OPEN_FLAGS, 0750);
-    net->motdfd     = open("motd",     BUF_FILE_OPEN_FLAGS, 0750);
-    net->realnamefd = open("realname", BUF_FILE_OPEN_FLAGS, 0750);
-    net->nicknamefd = open("nickname", BUF_FILE_OPEN_FLAGS, 0750);
+    net->raw.fd     = openat(net->dirfd, "raw",      BUF_FILE_OPEN_FLAGS, 0750);
+    net->joinedfd   = openat(net->dirfd, "joined",   BUF_FILE_OPEN_FLAGS, 0750);
+    net->motd.fd    = openat(net->dirfd, "motd",     BUF_FILE_OPEN_FLAGS, 0750);
+    net->realnamefd = openat(net->dirfd, "realname", BUF_FILE_OPEN_FLAGS, 0750);
+    net->nicknamefd = openat(net->dirfd, "nickname", BUF_FILE_OPEN_FLAGS, 0750);
+    net->lagfd      = openat(net->dirfd, "lag",      BUF_FILE_OPEN_FLAGS, 0750);
 
     network_foreach_channel(net, tmp)
         channel_create_files(tmp);
-
-    chdir("..");
 }
 
 void network_delete_files (struct network *net)
 {
     struct channel *tmp;
     DEBUG_PRINT("Removing files...");
-    chdir(net->name);
 
-    unlink("cmd");
-    unlink("raw");
-    unlink("joined");
-    unlink("motd");
-    unlink("realname");
-    unlink("nickname");
+    if (net->dirfd == -1)
+        return ;
+
+    /* Removed through the writer, so queued rewrites can't create the files
+     * again after they're gone */
+    writer_unlink_at(net->dirfd, "cmd", 0);
+    writer_unlink_at(net->dirfd, "raw", 0);
+    writer_unlink_at(net->dirfd, "joined", 0);
+    writer_unlink_at(net->dirfd, "motd", 0);
+    writer_unlink_at(net->dirfd, "realname", 0);
+    writer_unlink_at(net->dirfd, "nickname", 0);
+    writer_unlink_at(net->dirfd, "lag", 0);
 
     network_foreach_channel(net, tmp)
         channel_remove_files(tmp);
 
-    chdir("..");
-    rmdir(net->name);
+    writer_unlink_at(net->con->dirfd, net->name, AT_REMOVEDIR);
 }
 
-void network_init_select_desc(struct network *net, fd_set *infd, fd_set *outfd, int *maxfd)
+static void handle_cmd_line (struct network *net, char *line)
 {
-    struct channel *tmp;
 
-    if (net->sock.fd != -1) {
-        FD_SET(net->sock.fd, infd);
-        if (net->sock.fd > *maxfd)
-            *maxfd = net->sock.fd;
-    }
+}
+
+static void handle_irc_line (struct network *net, char *line)
+{
+    struct irc_reply rpl;
+    const char *server_time;
+    int index;
+    network_write_raw(net, line);
 
-    if (net->cmdfd.fd != -1) {
-        FD_SET(net->cmdfd.fd, infd);
-        if (net->cmdfd.fd > *maxfd)
-            *maxfd = net->cmdfd.fd;
+    if (irc_parse_line(line, &rpl) == -1) {
+        DEBUG_PRINT("!!!!ERROR!!!!");
+        return ;
     }
 
-    network_foreach_channel(net, tmp)
-        channel_reg_select(tmp, infd, outfd, maxfd);
+    DEBUG_PRINT("Reply:");
+    DEBUG_PRINT("Prefix Nick: %s", rpl.prefix.nick);
+    DEBUG_PRINT("Prefix User: %s", rpl.prefix.user);
+    DEBUG_PRINT("Prefix Host: %s", rpl.prefix.host);
+    DEBUG_PRINT("Code: %d", rpl.code);
+    DEBUG_PRINT("Cmd: %s", rpl.cmd);
+
+    for (index = 0; index < rpl.param_count; index++)
+        DEBUG_PRINT("Param %d: %s", index, rpl.params[index]);
+
+    DEBUG_PRINT("Trailing: %s", rpl.trailing);
+
+    server_time = irc_reply_tag(&rpl, "time");
+    if (server_time)
+        clock_set_message_time(server_time);
+
+    reply_dispatch(net, &rpl);
+
+    clock_clear_message_time();
 }
 
-static void handle_cmd_line (struct network *net, char *line)
+static void network_handle_cmd (struct event_fd *ev, unsigned int events)
 {
+    struct network *net = container_of(ev, struct network, cmd_ev);
+    char *line;
 
+    buf_handle_input(&(net->cmdfd));
+    while ((line = buf_next_line(&(net->cmdfd), NULL)) != NULL)
+        handle_cmd_line(net, line);
 }
 
-static void handle_irc_line (struct network *net, char *line)
+/* Sends our registration once the socket is connected. PASS has to come
+ * before NICK and USER. */
+static void network_register (struct network *net)
 {
-    struct reply_handler *hand;
-    struct irc_reply *rpl;
-    int index;
-    network_write_raw(net, line);
+    net->state = NETWORK_REGISTERING;
+    net->channels_joined = 0;
 
-    rpl = irc_parse_line(line);
+    /* The server we reach might not be the one we were on before */
+    isupport_init(&net->isupport);
+    network_update_casemap(net);
 
-    if(rpl == NULL)
-        DEBUG_PRINT("!!!!ERROR!!!!");
+    /* Anything queued while we were disconnected would be refused before
+     * registration anyway */
+    sendq_clear(&net->sendq);
+    sendq_set_rate(&net->sendq, net->conf.flood_burst, net->conf.flood_interval);
 
-    DEBUG_PRINT("Reply:");
-    DEBUG_PRINT("Prefix: %s", rpl->prefix.raw);
-    DEBUG_PRINT("Prefix User: %s", rpl->prefix.user);
-    DEBUG_PRINT("Prefix Host: %s", rpl->prefix.host);
-    DEBUG_PRINT("Code: %d", rpl->code);
-    DEBUG_PRINT("Cmd: %s", rpl->cmd);
-
-    ARRAY_FOREACH(rpl->lines, index)
-        DEBUG_PRINT("Line %d: %s", index, rpl->lines.arr[index]);
-
-    DEBUG_PRINT("Colon: %s", rpl->colon);
-
-    for (hand = reply_handler_list; hand->handler != NULL; hand++) {
-        if (hand->cmd && rpl->cmd) {
-            if (strcmp(hand->cmd, rpl->cmd) == 0) {
-                DEBUG_PRINT("Handler: %p", hand->handler);
-                (hand->handler) (net, rpl);
-                goto cleanup;
-            }
-        } else if (hand->code > 0) {
-            if (hand->code == rpl->code) {
-                DEBUG_PRINT("Handler: %p", hand->handler);
-                (hand->handler) (net, rpl);
-                goto cleanup;
-            }
-        }
+    /* Registration waits for the CAP END sent once the server answers this.
+     * Servers without CAP support just ignore it. */
+    irc_cap_req(net, "server-time");
+
+    if (net->password)
+        irc_pass(net);
+
+    irc_nick(net);
+    network_write_nick(net);
+    irc_user(net);
+    network_write_realname(net);
+}
+
+static void network_reconnect_timeout (struct timer *timer)
+{
+    network_connect(container_of(timer, struct network, reconnect_timer));
+}
+
+/* Waits before the next connect. The delay doubles with every failed try,
+ * up to NETWORK_RECONNECT_MAX, and a random half of it is jitter so that
+ * networks which dropped together don't all come back at the same moment. */
+static void network_schedule_reconnect (struct network *net)
+{
+    unsigned int delay = NETWORK_RECONNECT_MAX;
+
+    net->state = NETWORK_DISCONNECTED;
+
+    if (net->reconnect_tries < 16 && (NETWORK_RECONNECT_MIN << net->reconnect_tries) < NETWORK_RECONNECT_MAX)
+        delay = NETWORK_RECONNECT_MIN << net->reconnect_tries;
+
+    delay = delay / 2 + rand() % (delay / 2 + 1);
+    net->reconnect_tries++;
+
+    DEBUG_PRINT("Reconnecting to %s in %ums", net->name, delay);
+    timer_add(&net->reconnect_timer, delay, network_reconnect_timeout);
+}
+
+/* Only the connection is thrown away. The channels and their files are
+ * kept, and their members come back after rejoining. Until then the channels
+ * are listed as neither joined nor having anyone in them. */
+static void network_closed (struct network *net)
+{
+    struct channel *chan;
+
+    DEBUG_PRINT("Connection to %s was closed", net->name);
+
+    network_foreach_channel(net, chan)
+        channel_left(chan);
+    net->joined_dirty = 1;
+
+    event_del(&net->sock_ev);
+    CLOSE_FD(net->sock.fd);
+    buf_free(&net->sock);
+
+    timer_del(&net->send_timer);
+    sendq_clear(&net->sendq);
+
+    timer_del(&net->ping_timer);
+    net->ping_pending = 0;
+
+    network_schedule_reconnect(net);
+}
+
+static void network_send_timeout (struct timer *);
+
+static void network_send (struct network *net)
+{
+    long long now;
+    int wait;
+
+    if (net->sock.fd == -1 || net->state < NETWORK_REGISTERING)
+        return ;
+
+    now = timer_now();
+    if (sendq_write(&net->sendq, net->sock.fd, now) == -1) {
+        network_closed(net);
+        return ;
     }
 
-    if (hand->handler == NULL)
-        (reply_handler_list[0].handler) (net, rpl);
+    /* Only lines that were released can be stuck on the socket, the rest
+     * are waiting on the timer */
+    if (net->sendq.out.head)
+        event_mod(&net->sock_ev, EVENT_IN | EVENT_OUT);
+    else
+        event_mod(&net->sock_ev, EVENT_IN);
 
-cleanup:
-    irc_reply_free(rpl);
+    wait = sendq_next_release(&net->sendq, now);
+    if (wait >= 0 && !net->send_timer.pending)
+        timer_add(&net->send_timer, wait, network_send_timeout);
 }
 
-void network_handle_input (struct network *net, fd_set *infd, fd_set *outfd)
+static void network_send_timeout (struct timer *timer)
 {
-    struct channel *tmp;
-    if (FD_ISSET(net->cmdfd.fd, infd)) {
-        buf_handle_input(&(net->cmdfd));
-        while (net->cmdfd.has_line > 0) {
-            char *line = buf_read_line(&(net->cmdfd));
-            handle_cmd_line(net, line);
-            free(line);
-        }
+    network_send(container_of(timer, struct network, send_timer));
+}
+
+static void network_handle_input (struct event_fd *ev, unsigned int events)
+{
+    struct network *net = container_of(ev, struct network, sock_ev);
+    char *line;
+
+    if (events & EVENT_OUT) {
+        network_send(net);
+        if (!(events & ~EVENT_OUT) || net->state == NETWORK_DISCONNECTED)
+            return ;
     }
 
-    if (FD_ISSET(net->sock.fd, infd)) {
-        buf_handle_input(&(net->sock));
-        if (net->sock.closed_gracefully) {
-            DEBUG_PRINT("Connection to %s was closed", net->name);
-            net->close_network = 1;
-        }
-        while (net->sock.has_line > 0) {
-            char *line = buf_read_line(&(net->sock));
-            line[strlen(line)] = '\0';
-            handle_irc_line(net, line);
-            free(line);
-        }
+    buf_handle_input(&(net->sock));
+
+    /* Whatever the server sent before closing is still handled */
+    while ((line = buf_next_line(&(net->sock), NULL)) != NULL)
+        handle_irc_line(net, line);
+
+    if (net->sock.closed_gracefully || net->sock.errno_ret)
+        network_closed(net);
+}
+
+static void network_close_attempts (struct network *net)
+{
+    int i;
+
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++) {
+        event_del(&net->attempts[i].ev);
+        CLOSE_FD(net->attempts[i].fd);
     }
+}
 
-    network_foreach_channel(net, tmp)
-        channel_handle_input(tmp, infd, outfd);
+static void network_connect_failed (struct network *net)
+{
+    DEBUG_PRINT("Unable to connect to %s", net->name);
+    timer_del(&net->connect_timer);
+    network_close_attempts(net);
+    network_schedule_reconnect(net);
+}
+
+static void network_handle_attempt (struct event_fd *, unsigned int);
+static void network_attempt_timeout (struct timer *);
+
+/* Starts a connect to the next address that can be tried. If none are left,
+ * and nothing's still in progress, then the connect has failed. */
+static void network_try_next (struct network *net)
+{
+    struct network_attempt *attempt;
+    int i, fd;
+
+    while (net->addr_next < net->addr_count) {
+        i = net->addr_next++;
+
+        fd = irc_connect((struct sockaddr *)&net->addrs[i].addr, net->addrs[i].len);
+        if (fd == -1)
+            continue;
+
+        attempt = net->attempts + i;
+        attempt->net = net;
+        attempt->fd = fd;
+        event_add(&attempt->ev, fd, EVENT_OUT, network_handle_attempt);
+
+        if (net->addr_next < net->addr_count)
+            timer_add(&net->connect_timer, NETWORK_ATTEMPT_DELAY, network_attempt_timeout);
+        return ;
+    }
+
+    for (i = 0; i < RESOLVER_MAX_ADDRS; i++)
+        if (net->attempts[i].fd != -1)
+            return ;
+
+    network_connect_failed(net);
+}
+
+static void network_attempt_timeout (struct timer *timer)
+{
+    struct network *net = container_of(timer, struct network, connect_timer);
+
+    network_try_next(net);
+}
+
+static void network_handle_attempt (struct event_fd *ev, unsigned int events)
+{
+    struct network_attempt *attempt = container_of(ev, struct network_attempt, ev);
+    struct network *net = attempt->net;
+
+    event_del(&attempt->ev);
+
+    if (irc_connect_finish(attempt->fd) == -1) {
+        DEBUG_PRINT("Connect to %s failed: %s", net->name, strerror(errno));
+        CLOSE_FD(attempt->fd);
+
+        /* Don't wait out the delay if we already know this one failed */
+        timer_del(&net->connect_timer);
+        network_try_next(net);
+        return ;
+    }
+
+    DEBUG_PRINT("Connected to %s", net->name);
+
+    net->sock.fd = attempt->fd;
+    attempt->fd = -1;
+
+    timer_del(&net->connect_timer);
+    network_close_attempts(net);
+
+    event_add_buf(&net->sock_ev, &net->sock, EVENT_IN, network_handle_input);
+    network_register(net);
 }
 
+static void network_resolved (struct resolver_req *req, const struct resolver_addr *addrs, int count)
+{
+    struct network *net = container_of(req, struct network, resolve);
+
+    memcpy(net->addrs, addrs, count * sizeof(*addrs));
+    net->addr_count = count;
+    net->addr_next = 0;
+
+    net->state = NETWORK_CONNECTING;
+    network_try_next(net);
+}
+
+/* Neither resolving nor connecting block: The resolver calls back into
+ * 'network_resolved' once it has the server's addresses, and the connects
+ * are finished by 'network_handle_attempt' once the sockets are writable.
+ * This way every network connects in parallel. */
 void network_connect(struct network *net)
 {
-    struct channel *tmp;
-    irc_connect(net);
-    if (net->close_network)
+    if (!net->url) {
+        net->close_network = 1;
         return ;
+    }
 
-    irc_nick(net);
-    network_write_nick(net);
-    irc_user(net);
-    network_write_realname(net);
-    if (net->password)
-        irc_pass(net);
+    net->state = NETWORK_RESOLVING;
+    resolver_lookup(&net->resolve, net->url, net->portno, network_resolved);
+}
 
-    network_foreach_channel(net, tmp)
-        irc_join(net, tmp->name);
+static void network_ping_timeout (struct timer *timer)
+{
+    struct network *net = container_of(timer, struct network, ping_timer);
+
+    if (net->ping_pending) {
+        DEBUG_PRINT("No PONG from %s in %ums, reconnecting", net->name, net->conf.ping_timeout);
+        network_closed(net);
+        return ;
+    }
+
+    /* Sent as urgent, so flood control doesn't hold it behind anything else
+     * and the RTT is the server's and not ours */
+    net->ping_token++;
+    irc_send(net, SENDQ_URGENT, NULL, "PING :fircd-%u", net->ping_token);
+    net->ping_sent = timer_now();
+    net->ping_pending = 1;
+
+    timer_add(&net->ping_timer, net->conf.ping_timeout, network_ping_timeout);
+}
+
+void network_pong (struct network *net, const char *token)
+{
+    struct network_lag *lag = &net->lag;
+    long long rtt;
+    char expected[32];
+
+    if (!net->ping_pending || !token)
+        return ;
+
+    /* A PONG for a PING that's already timed out, or one that was sent by
+     * someone else, doesn't count */
+    snprintf(expected, sizeof(expected), "fircd-%u", net->ping_token);
+    if (strcmp(token, expected) != 0)
+        return ;
+
+    rtt = timer_now() - net->ping_sent;
+    net->ping_pending = 0;
+
+    lag->last = rtt;
+    if (!lag->samples || rtt < lag->min)
+        lag->min = rtt;
+    if (!lag->samples || rtt > lag->max)
+        lag->max = rtt;
+
+    if (!lag->samples)
+        lag->ewma = rtt;
+    else
+        lag->ewma += (rtt - lag->ewma) / 8;
+
+    lag->total += rtt;
+    lag->samples++;
+
+    net->lag_dirty = 1;
+
+    timer_add(&net->ping_timer, net->conf.ping_interval, network_ping_timeout);
+}
+
+void network_registered (struct network *net)
+{
+    if (net->state == NETWORK_CONNECTED)
+        return ;
+
+    net->state = NETWORK_CONNECTED;
+    net->reconnect_tries = 0;
+
+    if (net->conf.ping_interval)
+        timer_add(&net->ping_timer, net->conf.ping_interval, network_ping_timeout);
+
+    net->joined_dirty = 1;
+}
+
+void network_join_channels (struct network *net)
+{
+    struct irc_join_batch batch;
+    struct channel *chan;
+    unsigned int joining[ISUPPORT_CHANLIMIT_MAX] = { 0 };
+    int keyed, group;
+
+    if (net->channels_joined)
+        return ;
+
+    net->channels_joined = 1;
 
-    network_write_joined(net);
+    irc_join_batch_init(&batch, net, net->isupport.join_targmax);
+
+    /* Channels with keys go first, since the keys are matched up with the
+     * channels by position */
+    for (keyed = 1; keyed >= 0; keyed--) {
+        network_foreach_channel(net, chan) {
+            /* Private messages are kept as channels too */
+            if (!isupport_is_channel(&net->isupport, chan->name))
+                continue;
+
+            if ((chan->key != NULL) != keyed)
+                continue;
+
+            group = net->isupport.chanlimit_group[(unsigned char)chan->name[0]];
+            if (group) {
+                if (joining[group - 1] >= net->isupport.chanlimit[group - 1]) {
+                    DEBUG_PRINT("Not joining %s, over the server's CHANLIMIT", chan->name);
+                    continue;
+                }
+                joining[group - 1]++;
+            }
+
+            irc_join_batch_add(&batch, chan->name, chan->key);
+        }
+    }
+
+    irc_join_batch_flush(&batch);
 }
 
 struct network *network_copy (struct network *net)
 {
-    struct channel *tmp;
+    struct channel *tmp, *chan;
     struct network *newnet = malloc(sizeof(struct network));
 
     network_init(newnet);
@@ -233,8 +554,11 @@ struct network *network_copy (struct network *net)
     newnet->conf = net->conf;
     newnet->close_network = net->close_network;
 
-    network_foreach_channel(net, tmp)
-        network_add_channel(newnet, tmp->name);
+    network_foreach_channel(net, tmp) {
+        chan = network_add_channel(newnet, tmp->name);
+        if (tmp->key)
+            chan->key = strdup(tmp->key);
+    }
 
     return newnet;
 }
@@ -250,67 +574,269 @@ struct channel *network_add_channel (struct network *net, const char *channel)
     tmp_chan->next = net->first_channel;
     net->first_channel = tmp_chan;
 
+    hash_add(&net->channel_hash, &tmp_chan->hnode, irc_casehash(net->casemap, channel));
+
     return &tmp_chan->chan;
 }
 
 struct channel *network_find_channel (struct network *net, const char *channel)
 {
-    struct channel *chan;
+    struct hash_node *node;
+    struct network_channel_node *chan_node;
 
-    network_foreach_channel(net, chan)
-        if (strcmp(chan->name, channel) == 0)
-            return chan;
+    hash_foreach_match(&net->channel_hash, irc_casehash(net->casemap, channel), node) {
+        chan_node = container_of(node, struct network_channel_node, hnode);
+        if (irc_casecmp(net->casemap, chan_node->chan.name, channel) == 0)
+            return &chan_node->chan;
+    }
+
+    return NULL;
+}
+
+struct irc_net_user *network_find_user (struct network *net, const char *nick)
+{
+    struct hash_node *node;
+    struct irc_net_user *user;
+
+    hash_foreach_match(&net->user_hash, irc_casehash(net->casemap, nick), node) {
+        user = container_of(node, struct irc_net_user, hnode);
+        if (irc_casecmp(net->casemap, user->nick, nick) == 0)
+            return user;
+    }
 
     return NULL;
 }
 
+struct irc_net_user *network_get_user (struct network *net, const char *nick)
+{
+    struct irc_net_user *user = network_find_user(net, nick);
+
+    if (!user) {
+        user = malloc(sizeof(*user));
+        memset(user, 0, sizeof(*user));
+        user->nick = strdup(nick);
+        hash_add(&net->user_hash, &user->hnode, irc_casehash(net->casemap, nick));
+    }
+
+    user->refs++;
+    return user;
+}
+
+void network_put_user (struct network *net, struct irc_net_user *user)
+{
+    if (--user->refs > 0)
+        return ;
+
+    hash_remove(&net->user_hash, &user->hnode);
+    free(user->nick);
+    free(user);
+}
+
+void network_user_quit (struct network *net, const char *nick)
+{
+    struct irc_net_user *user;
+    struct channel_irc_user_node *member, *next;
+
+    user = network_find_user(net, nick);
+    if (!user)
+        return ;
+
+    /* The last 'channel_user_quit' frees 'user', so it's not touched
+     * again once the walk has started */
+    for (member = user->first_member; member != NULL; member = next) {
+        next = member->next_member;
+        channel_user_quit(member->chan, nick);
+    }
+}
+
+void network_user_change (struct network *net, const char *old, const char *new)
+{
+    struct irc_net_user *user, *dup;
+    struct channel_irc_user_node *member, *next;
+    char *old_nick;
+
+    user = network_find_user(net, old);
+    if (!user)
+        return ;
+
+    /* The server only lets a nick change to a free nick, so an entry
+     * already registered under the new one is stale (Ex. a QUIT we never
+     * saw). It's dropped from its channels, which frees it, so that the
+     * renamed user is the only entry for the nick. A change of case finds
+     * 'user' itself. */
+    dup = network_find_user(net, new);
+    if (dup && dup != user) {
+        for (member = dup->first_member; member != NULL; member = next) {
+            next = member->next_member;
+            channel_user_drop(member);
+        }
+    }
+
+    /* Every member shares 'user->nick', so the old string is kept around
+     * until each of them has been moved over to the new one */
+    hash_remove(&net->user_hash, &user->hnode);
+    old_nick = user->nick;
+    user->nick = strdup(new);
+    hash_add(&net->user_hash, &user->hnode, irc_casehash(net->casemap, new));
+
+    for (member = user->first_member; member != NULL; member = next) {
+        next = member->next_member;
+        channel_user_change(member, old_nick);
+    }
+
+    free(old_nick);
+}
+
+/* Switches to the fold table for 'isupport.casemapping', and rebuilds the
+ * indexes that depend on it */
+static void network_update_casemap (struct network *net)
+{
+    struct network_channel_node *node;
+    struct hash_table old_users;
+    struct hash_node *hnode, *tmp;
+    struct irc_net_user *user;
+    const unsigned char *casemap = irc_casemap_table(net->isupport.casemapping);
+    unsigned int i;
+
+    if (casemap == net->casemap)
+        return ;
+
+    net->casemap = casemap;
+
+    hash_clear(&net->channel_hash);
+    for (node = net->first_channel; node != NULL; node = node->next) {
+        hash_add(&net->channel_hash, &node->hnode, irc_casehash(net->casemap, node->chan.name));
+        channel_rehash_users(&node->chan);
+    }
+
+    old_users = net->user_hash;
+    hash_init(&net->user_hash);
+    hash_foreach_safe(&old_users, i, hnode, tmp) {
+        user = container_of(hnode, struct irc_net_user, hnode);
+        hash_add(&net->user_hash, hnode, irc_casehash(net->casemap, user->nick));
+    }
+    hash_clear(&old_users);
+}
+
+void network_isupport (struct network *net, const char *token)
+{
+    isupport_parse(&net->isupport, token);
+    network_update_casemap(net);
+}
+
 void network_write_raw (struct network *net, const char *text)
 {
     if (text) {
-        write(net->rawfd, text, strlen(text));
-        write(net->rawfd, "\n", 1);
+        outbuf_puts(&net->raw, text);
+        outbuf_write(&net->raw, "\n", 1);
     }
 }
 
 void network_write_nick (struct network *net)
 {
-    ftruncate(net->nicknamefd, 0);
-    lseek(net->nicknamefd, 0, SEEK_SET);
-    if (net->nickname)
-        write(net->nicknamefd, net->nickname, strlen(net->nickname));
+    const char *nick = (net->nickname)? net->nickname: "";
+
+    writer_replace(net->nicknamefd, nick, strlen(nick));
 }
 
 void network_write_realname (struct network *net)
 {
-    ftruncate(net->realnamefd, 0);
-    lseek(net->realnamefd, 0, SEEK_SET);
-    if (net->realname)
-        write(net->realnamefd, net->realname, strlen(net->realname));
-    else
-        write(net->realnamefd, net->nickname, strlen(net->nickname));
+    const char *name = (net->realname)? net->realname: (net->nickname)? net->nickname: "";
+
+    writer_replace(net->realnamefd, name, strlen(name));
 }
 
 void network_write_motd_start (struct network *net)
 {
-    const char motd_start[] = "New MOTD:\n";
-    write(net->motdfd, motd_start, sizeof(motd_start));
+    outbuf_puts(&net->motd, "New MOTD:\n");
 }
 
 void network_write_motd_line (struct network *net, const char *motd)
 {
-    write(net->motdfd, motd, strlen(motd));
-    write(net->motdfd, "\n", 1);
+    outbuf_puts(&net->motd, motd);
+    outbuf_write(&net->motd, "\n", 1);
 }
 
 void network_write_joined (struct network *net)
 {
     struct channel *chan;
-    ftruncate(net->joinedfd, 0);
-    lseek(net->joinedfd, 0, SEEK_SET);
+    size_t len = 0, nlen;
+    char *buf, *cur;
+
+    network_foreach_channel(net, chan)
+        if (chan->joined)
+            len += strlen(chan->name) + 1;
+
+    buf = cur = malloc(len + 1);
+    if (!buf)
+        return ;
+
     network_foreach_channel(net, chan) {
-        write(net->joinedfd, chan->name, strlen(chan->name));
-        write(net->joinedfd, "\n", 1);
+        if (!chan->joined)
+            continue;
+
+        nlen = strlen(chan->name);
+        memcpy(cur, chan->name, nlen);
+        cur[nlen] = '\n';
+        cur += nlen + 1;
     }
+
+    writer_replace(net->joinedfd, buf, len);
+    free(buf);
+}
+
+void network_write_lag (struct network *net)
+{
+    struct network_lag *lag = &net->lag;
+    char buf[256];
+    int len;
+
+    if (!lag->samples)
+        return ;
+
+    len = snprintf(buf, sizeof(buf),
+                   "last %lld\nmin %lld\navg %lld\nmax %lld\newma %lld\n",
+                   lag->last, lag->min, lag->total / lag->samples, lag->max, lag->ewma);
+
+    writer_replace(net->lagfd, buf, len);
+}
+
+struct network_drop {
+    const unsigned char *casemap;
+    const char *target;
+};
+
+static int network_drop_match (const char *target, void *data)
+{
+    struct network_drop *drop = data;
+
+    return irc_casecmp(drop->casemap, target, drop->target) == 0;
+}
+
+void network_drop_queued (struct network *net, const char *target)
+{
+    struct network_drop drop = { net->casemap, target };
+
+    sendq_drop(&net->sendq, network_drop_match, &drop);
+}
+
+void network_flush (struct network *net)
+{
+    if (!sendq_empty(&net->sendq))
+        network_send(net);
+
+    if (net->joined_dirty)
+        network_write_joined(net);
+
+    if (net->lag_dirty)
+        network_write_lag(net);
+
+    /* Flushing a channel takes it off the list */
+    while (net->first_dirty)
+        channel_flush(net->first_dirty);
+
+    net->joined_dirty = 0;
+    net->lag_dirty = 0;
 }
 
 void network_clear (struct network *current)
@@ -318,17 +844,29 @@ void network_clear (struct network *current)
     int i;
     struct network_channel_node *node, *tmp;
 
+    resolver_cancel(&current->resolve);
+    timer_del(&current->connect_timer);
+    timer_del(&current->reconnect_timer);
+    timer_del(&current->ping_timer);
+    network_close_attempts(current);
+
+    event_del(&current->sock_ev);
     CLOSE_FD(current->sock.fd);
     buf_free(&current->sock);
+    timer_del(&current->send_timer);
+    sendq_clear(&current->sendq);
 
+    event_del(&current->cmd_ev);
     CLOSE_FD(current->cmdfd.fd);
     buf_free(&current->cmdfd);
 
-    CLOSE_FD(current->joinedfd);
-    CLOSE_FD(current->motdfd);
-    CLOSE_FD(current->rawfd);
-    CLOSE_FD(current->realnamefd);
-    CLOSE_FD(current->nicknamefd);
+    writer_close(current->joinedfd);
+    outbuf_close(&current->motd);
+    outbuf_close(&current->raw);
+    writer_close(current->realnamefd);
+    writer_close(current->nicknamefd);
+    writer_close(current->lagfd);
+    current->joinedfd = current->realnamefd = current->nicknamefd = current->lagfd = -1;
 
     if (current->conf.remove_files_on_close)
         network_delete_files(current);
@@ -347,6 +885,15 @@ void network_clear (struct network *current)
         tmp = node->next;
         channel_clear(&node->chan);
     }
+    current->first_channel = NULL;
+
+    hash_clear(&current->channel_hash);
+    hash_clear(&current->user_hash);
+
+    /* The channels' logs are opened relative to this, and are flushed as
+     * they're cleared */
+    writer_close(current->dirfd);
+    current->dirfd = -1;
 }
 
 void network_clear_all(struct network *net)
@@ -0,0 +1,357 @@
+/*
+ * ./outbuf.c -- Buffered output for the log and state files
+ *
+ * Every message used to cost a malloc and a write() per file it went into.
+ * Instead, output is formatted straight into a buffer kept for each file, and
+ * the buffers are written out once at the end of every pass through the
+ * event loop. A buffer that grows past OUTBUF_FLUSH_SIZE is written out
+ * right away, so a burst can't build up an unbounded amount of memory.
+ *
+ * Log files can be opened lazily, and only a bounded number of them are kept
+ * open at once, so the number of channels isn't limited by the number of
+ * fds we're allowed.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "debug.h"
+#include "buf.h"
+#include "writer.h"
+#include "outbuf.h"
+
+#define OUTBUF_MIN_SIZE 256
+
+/* Buffers with data waiting to be written */
+static struct outbuf *pending_head = NULL;
+
+/* Lazily opened buffers with an open fd, the most recently written first */
+static struct outbuf *lru_head = NULL, *lru_tail = NULL;
+static unsigned int open_count = 0;
+static unsigned int max_open = OUTBUF_DEFAULT_MAX_OPEN;
+
+void outbuf_init (struct outbuf *out)
+{
+    memset(out, 0, sizeof(struct outbuf));
+    out->fd = -1;
+    out->dirfd = -1;
+}
+
+void outbuf_open_at (struct outbuf *out, int dirfd, const char *path)
+{
+    out->dirfd = dirfd;
+    free(out->path);
+    out->path = strdup(path);
+}
+
+void outbuf_set_sink (struct outbuf *out, writer_fn sink, void *arg)
+{
+    out->sink = sink;
+    out->sink_arg = arg;
+}
+
+void outbuf_set_max_open (unsigned int max)
+{
+    max_open = (max > 0)? max: 1;
+}
+
+static void outbuf_lru_del (struct outbuf *out)
+{
+    if (out->lru_prev)
+        out->lru_prev->lru_next = out->lru_next;
+    else
+        lru_head = out->lru_next;
+
+    if (out->lru_next)
+        out->lru_next->lru_prev = out->lru_prev;
+    else
+        lru_tail = out->lru_prev;
+
+    out->lru_next = NULL;
+    out->lru_prev = NULL;
+}
+
+static void outbuf_lru_add (struct outbuf *out)
+{
+    out->lru_prev = NULL;
+    out->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = out;
+    else
+        lru_tail = out;
+    lru_head = out;
+}
+
+static void outbuf_add_pending (struct outbuf *out)
+{
+    if (out->prev_pending)
+        return ;
+
+    out->next_pending = pending_head;
+    out->prev_pending = &pending_head;
+    if (pending_head)
+        pending_head->prev_pending = &out->next_pending;
+    pending_head = out;
+}
+
+static void outbuf_del_pending (struct outbuf *out)
+{
+    if (!out->prev_pending)
+        return ;
+
+    *out->prev_pending = out->next_pending;
+    if (out->next_pending)
+        out->next_pending->prev_pending = out->prev_pending;
+
+    out->next_pending = NULL;
+    out->prev_pending = NULL;
+}
+
+static int outbuf_reserve (struct outbuf *out, size_t len)
+{
+    size_t size = out->size;
+    char *buf;
+
+    if (out->size - out->len >= len)
+        return 0;
+
+    if (size < OUTBUF_MIN_SIZE)
+        size = OUTBUF_MIN_SIZE;
+    while (size - out->len < len)
+        size *= 2;
+
+    buf = realloc(out->buf, size);
+    if (!buf)
+        return -1;
+
+    out->buf = buf;
+    out->size = size;
+    return 0;
+}
+
+/* Called after new data is appended */
+static void outbuf_queued (struct outbuf *out)
+{
+    outbuf_add_pending(out);
+
+    if (out->len >= OUTBUF_FLUSH_SIZE)
+        outbuf_flush(out);
+}
+
+/* Whether there's anywhere for output to go */
+static int outbuf_has_file (struct outbuf *out)
+{
+    return out->fd != -1 || out->path != NULL || out->sink != NULL;
+}
+
+void outbuf_write (struct outbuf *out, const char *data, size_t len)
+{
+    if (!outbuf_has_file(out) || len == 0)
+        return ;
+
+    if (outbuf_reserve(out, len))
+        return ;
+
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+
+    outbuf_queued(out);
+}
+
+void outbuf_puts (struct outbuf *out, const char *str)
+{
+    outbuf_write(out, str, strlen(str));
+}
+
+void outbuf_printfv (struct outbuf *out, const char *format, va_list lst)
+{
+    va_list cpy;
+    int len;
+
+    if (!outbuf_has_file(out))
+        return ;
+
+    if (outbuf_reserve(out, OUTBUF_MIN_SIZE))
+        return ;
+
+    /* Most lines fit in the space that's already there, so try that first and
+     * only grow the buffer and format again if it doesn't */
+    va_copy(cpy, lst);
+    len = vsnprintf(out->buf + out->len, out->size - out->len, format, cpy);
+    va_end(cpy);
+
+    if (len < 0)
+        return ;
+
+    if ((size_t)len >= out->size - out->len) {
+        if (outbuf_reserve(out, len + 1))
+            return ;
+
+        vsnprintf(out->buf + out->len, out->size - out->len, format, lst);
+    }
+
+    out->len += len;
+
+    outbuf_queued(out);
+}
+
+void outbuf_printf (struct outbuf *out, const char *format, ...)
+{
+    va_list lst;
+
+    va_start(lst, format);
+    outbuf_printfv(out, format, lst);
+    va_end(lst);
+}
+
+/* Writes out as much of the pending data as 'fd' takes. With the writer
+ * thread running (Or a sink set), the buffer itself is handed to it instead,
+ * unless it already has too much waiting. With 'wait' it's never refused,
+ * for a buffer being closed. */
+static void outbuf_drain (struct outbuf *out, int wait)
+{
+    size_t written = 0;
+    ssize_t ret;
+
+    if (out->sink) {
+        if (out->len && wait) {
+            writer_call_wait(out->sink, out->sink_arg, out->buf, out->len);
+            out->buf = NULL;
+            out->len = out->size = 0;
+        } else if (out->len && writer_call(out->sink, out->sink_arg, out->buf, out->len) == 0) {
+            out->buf = NULL;
+            out->len = out->size = 0;
+        }
+    } else if (writer_running()) {
+        if (out->fd != -1 && out->len && wait) {
+            writer_write_wait(out->fd, out->buf, out->len);
+            out->buf = NULL;
+            out->len = out->size = 0;
+        } else if (out->fd != -1 && out->len && writer_write(out->fd, out->buf, out->len) == 0) {
+            out->buf = NULL;
+            out->len = out->size = 0;
+        }
+    } else {
+        while (written < out->len) {
+            ret = write(out->fd, out->buf + written, out->len - written);
+            if (ret == -1) {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            written += ret;
+        }
+
+        if (written > 0 && written < out->len)
+            memmove(out->buf, out->buf + written, out->len - written);
+        out->len -= written;
+    }
+
+    if (out->len > OUTBUF_MAX_SIZE) {
+        DEBUG_PRINT("Dropping %zu bytes of output to fd %d", out->len, out->fd);
+        out->len = 0;
+    }
+
+    if (out->len == 0) {
+        outbuf_del_pending(out);
+
+        /* Don't hang on to the memory from a one-off burst */
+        if (out->size > OUTBUF_FLUSH_SIZE * 2) {
+            free(out->buf);
+            out->buf = NULL;
+            out->size = 0;
+        }
+    }
+}
+
+/* Closes a lazily opened buffer's fd, after writing what's pending */
+static void outbuf_evict (struct outbuf *out)
+{
+    if (out->len)
+        outbuf_drain(out, 0);
+
+    outbuf_lru_del(out);
+    open_count--;
+    writer_close(out->fd);
+    out->fd = -1;
+}
+
+/* Makes sure a lazily opened buffer's fd is open, and marks it as the most
+ * recently used */
+static void outbuf_use (struct outbuf *out)
+{
+    if (!out->path)
+        return ;
+
+    if (out->fd != -1) {
+        outbuf_lru_del(out);
+        outbuf_lru_add(out);
+        return ;
+    }
+
+    while (open_count >= max_open && lru_tail)
+        outbuf_evict(lru_tail);
+
+    out->fd = writer_open_at(out->dirfd, out->path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK);
+    if (out->fd == -1) {
+        DEBUG_PRINT("Unable to open %s", out->path);
+        return ;
+    }
+
+    outbuf_lru_add(out);
+    open_count++;
+}
+
+void outbuf_flush (struct outbuf *out)
+{
+    outbuf_use(out);
+    outbuf_drain(out, 0);
+}
+
+void outbuf_flush_all (void)
+{
+    struct outbuf *out, *next;
+
+    for (out = pending_head; out != NULL; out = next) {
+        next = out->next_pending;
+        outbuf_flush(out);
+    }
+}
+
+void outbuf_close (struct outbuf *out)
+{
+    /* There's no later flush to try again in, so this waits for the writer
+     * rather then drop the last of the output */
+    if (out->len && outbuf_has_file(out)) {
+        outbuf_use(out);
+        outbuf_drain(out, 1);
+    }
+
+    outbuf_del_pending(out);
+    free(out->buf);
+    out->buf = NULL;
+    out->len = out->size = 0;
+
+    if (out->path) {
+        if (out->fd != -1)
+            outbuf_evict(out);
+        free(out->path);
+        out->path = NULL;
+    }
+
+    writer_close(out->fd);
+    out->fd = -1;
+    out->sink = NULL;
+    out->sink_arg = NULL;
+}
@@ -0,0 +1,563 @@
+/*
+ * ./reclog.c -- Binary record logs of a channel, indexed for scrollback
+ *
+ * The text logs can only be read from the start, so finding what was said at
+ * some time (Or after some message) means reading through the whole file.
+ * The record log has the same events in a binary layout, numbered in order,
+ * with a sparse index of sequence numbers and times to file offsets next to
+ * it. A reader binary searches the index, and only scans the handful of
+ * records after the entry it lands on.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "buf.h"
+#include "clock.h"
+#include "writer.h"
+#include "outbuf.h"
+#include "reclog.h"
+
+#define RECLOG_LOG "log"
+#define RECLOG_IDX "log.idx"
+
+/* The state of an open log that's kept on the writer thread. It's only ever
+ * touched from calls queued through 'writer_call', so it needs no locking. */
+struct reclog_file {
+    int dirfd;
+    char *dir, *log_path, *idx_path;
+
+    unsigned int recovered :1;
+
+    uint64_t seq, offset;
+    int64_t max_time;
+    unsigned int since_index;
+};
+
+/* Index entries collected while going over records */
+struct reclog_entries {
+    struct reclog_index *ents;
+    size_t count, size;
+};
+
+void reclog_init (struct reclog *rl)
+{
+    memset(rl, 0, sizeof(*rl));
+    outbuf_init(&rl->out);
+}
+
+static void reclog_add_index (struct reclog_entries *e, uint64_t seq, int64_t time, uint64_t offset)
+{
+    struct reclog_index *ents;
+    size_t size;
+
+    if (e->count == e->size) {
+        size = (e->size)? e->size * 2: 16;
+        ents = realloc(e->ents, size * sizeof(*ents));
+        if (!ents)
+            return ;
+        e->ents = ents;
+        e->size = size;
+    }
+
+    memset(e->ents + e->count, 0, sizeof(*e->ents));
+    e->ents[e->count].seq = seq;
+    e->ents[e->count].time = time;
+    e->ents[e->count].offset = offset;
+    e->count++;
+}
+
+static void reclog_truncate (int dirfd, const char *path, off_t len)
+{
+    int fd = openat(dirfd, path, O_WRONLY | O_CREAT, 0750);
+
+    if (fd == -1)
+        return ;
+
+    ftruncate(fd, len);
+    close(fd);
+}
+
+/* The files are opened for each append instead of being held open, so an
+ * open log doesn't count against the outbuf fd budget */
+static void reclog_append_file (int dirfd, const char *path, const char *buf, size_t len)
+{
+    ssize_t ret;
+    int fd;
+
+    if (len == 0)
+        return ;
+
+    fd = openat(dirfd, path, O_WRONLY | O_CREAT | O_APPEND, 0750);
+    if (fd == -1) {
+        DEBUG_PRINT("Unable to open %s", path);
+        return ;
+    }
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        buf += ret;
+        len -= ret;
+    }
+
+    close(fd);
+}
+
+static void reader_seek_entry (struct reclog_reader *, size_t count);
+
+/* Picks up the sequence number, time and offset where the existing log left
+ * off. Index entries past the last good one are added back, and if the index
+ * is missing or can't be trusted it's rebuilt from a scan of the whole log.
+ * Runs on the writer thread, before the first records are appended. */
+static void reclog_recover (struct reclog_file *f)
+{
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+    struct reclog_entries e = { NULL, 0, 0 };
+    size_t keep = 0, count = 0;
+    uint64_t offset;
+    int rebuild = 1;
+
+    f->recovered = 1;
+    f->offset = 0;
+
+    if (reclog_reader_open(&rd, f->dirfd, f->dir) == 0) {
+        reader_seek_entry(&rd, rd.index_count);
+
+        rebuild = rd.index_bad || rd.index_count == 0;
+        if (rebuild) {
+            DEBUG_PRINT("Rebuilding the record log index for %s", f->dir);
+        } else {
+            keep = rd.index_count;
+            f->max_time = rd.index[keep - 1].time;
+        }
+
+        /* Without a rebuild, this starts on the last entry's record, which is
+         * already in the index */
+        while (offset = rd.offset, reclog_next(&rd, &rec) == 0) {
+            if (rec.time > f->max_time)
+                f->max_time = rec.time;
+
+            if (count++ % RECLOG_INDEX_INTERVAL == 0 && (rebuild || count > 1))
+                reclog_add_index(&e, rec.seq, f->max_time, offset);
+
+            f->seq = rec.seq + 1;
+        }
+
+        f->offset = rd.offset;
+        reclog_reader_close(&rd);
+    }
+
+    if (f->offset == 0) {
+        reclog_truncate(f->dirfd, f->log_path, 0);
+        reclog_truncate(f->dirfd, f->idx_path, 0);
+
+        reclog_append_file(f->dirfd, f->log_path, RECLOG_MAGIC, RECLOG_MAGIC_LEN);
+        f->offset = RECLOG_MAGIC_LEN;
+        free(e.ents);
+        return ;
+    }
+
+    /* Drops a record cut off by a crash, and any index entries past it */
+    reclog_truncate(f->dirfd, f->log_path, f->offset);
+    reclog_truncate(f->dirfd, f->idx_path, keep * sizeof(struct reclog_index));
+    reclog_append_file(f->dirfd, f->idx_path, (const char *)e.ents, e.count * sizeof(struct reclog_index));
+
+    f->since_index = count % RECLOG_INDEX_INTERVAL;
+    free(e.ents);
+}
+
+/* The sink of 'rl->out', on the writer thread. 'buf' only ever holds whole
+ * records, since each is written to the outbuf in one piece. */
+static void reclog_sink (void *arg, char *buf, size_t len)
+{
+    struct reclog_file *f = arg;
+    struct reclog_entries e = { NULL, 0, 0 };
+    struct reclog_hdr hdr;
+    size_t off = 0;
+
+    if (!f->recovered)
+        reclog_recover(f);
+
+    /* Headers aren't aligned in the buffer, so they're copied in and out */
+    while (off + sizeof(hdr) <= len) {
+        memcpy(&hdr, buf + off, sizeof(hdr));
+        if (hdr.size < sizeof(hdr) || off + hdr.size > len)
+            break;
+
+        hdr.seq = f->seq++;
+        memcpy(buf + off, &hdr, sizeof(hdr));
+
+        if (hdr.time > f->max_time)
+            f->max_time = hdr.time;
+
+        if (f->since_index == 0)
+            reclog_add_index(&e, hdr.seq, f->max_time, f->offset + off);
+        f->since_index = (f->since_index + 1) % RECLOG_INDEX_INTERVAL;
+
+        off += hdr.size;
+    }
+
+    reclog_append_file(f->dirfd, f->log_path, buf, off);
+    reclog_append_file(f->dirfd, f->idx_path, (const char *)e.ents, e.count * sizeof(struct reclog_index));
+
+    f->offset += off;
+    free(e.ents);
+}
+
+static void reclog_free_file (void *arg, char *buf, size_t len)
+{
+    struct reclog_file *f = arg;
+
+    free(f->dir);
+    free(f->log_path);
+    free(f->idx_path);
+    free(f);
+}
+
+int reclog_open (struct reclog *rl, int dirfd, const char *dir)
+{
+    struct reclog_file *f;
+
+    reclog_close(rl);
+
+    f = calloc(1, sizeof(*f));
+    if (!f)
+        return -1;
+
+    f->dirfd = dirfd;
+    f->dir = strdup(dir);
+    if (!f->dir
+        || alloc_sprintf(&f->log_path, "%s/%s", dir, RECLOG_LOG) == -1
+        || alloc_sprintf(&f->idx_path, "%s/%s", dir, RECLOG_IDX) == -1) {
+        reclog_free_file(f, NULL, 0);
+        return -1;
+    }
+
+    /* Recovery waits for the first records, on the writer thread. Anything
+     * still queued for these files from before (Ex. the channel was parted
+     * and joined again) is written by then. */
+    rl->file = f;
+    outbuf_set_sink(&rl->out, reclog_sink, f);
+    return 0;
+}
+
+void reclog_close (struct reclog *rl)
+{
+    if (!rl->file)
+        return ;
+
+    outbuf_close(&rl->out);
+    writer_call(reclog_free_file, rl->file, NULL, 0);
+    rl->file = NULL;
+}
+
+void reclog_append (struct reclog *rl, enum reclog_type type, time_t t, const char *nick, const char *text)
+{
+    static char *rec;
+    static size_t rec_size;
+    struct reclog_hdr hdr;
+    size_t nick_len, text_len;
+    char *buf;
+
+    if (!rl->file)
+        return ;
+
+    nick_len = (nick)? strlen(nick): 0;
+    text_len = (text)? strlen(text): 0;
+
+    if (nick_len > UINT16_MAX)
+        nick_len = UINT16_MAX;
+    if (sizeof(hdr) + nick_len + text_len > RECLOG_MAX_RECORD)
+        text_len = RECLOG_MAX_RECORD - sizeof(hdr) - nick_len;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.size = sizeof(hdr) + nick_len + text_len;
+    hdr.type = type;
+    hdr.nick_len = nick_len;
+    hdr.time = t;
+
+    /* The record goes into the outbuf in one write, so a flush never splits
+     * it between two calls of the sink */
+    if (rec_size < hdr.size) {
+        buf = realloc(rec, RECLOG_MAX_RECORD);
+        if (!buf)
+            return ;
+        rec = buf;
+        rec_size = RECLOG_MAX_RECORD;
+    }
+
+    memcpy(rec, &hdr, sizeof(hdr));
+    if (nick_len)
+        memcpy(rec + sizeof(hdr), nick, nick_len);
+    if (text_len)
+        memcpy(rec + sizeof(hdr) + nick_len, text, text_len);
+
+    outbuf_write(&rl->out, rec, hdr.size);
+}
+
+int reclog_reader_open (struct reclog_reader *rd, int dirfd, const char *dir)
+{
+    char *path = NULL;
+    char magic[RECLOG_MAGIC_LEN];
+    struct stat st;
+    int fd;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->fd = -1;
+
+    if (alloc_sprintf(&path, "%s/%s", dir, RECLOG_LOG) == -1)
+        return -1;
+    rd->fd = openat(dirfd, path, O_RDONLY);
+    free(path);
+
+    if (rd->fd == -1)
+        return -1;
+
+    if (fstat(rd->fd, &st) == -1
+        || pread(rd->fd, magic, sizeof(magic), 0) != sizeof(magic)
+        || memcmp(magic, RECLOG_MAGIC, RECLOG_MAGIC_LEN) != 0) {
+        CLOSE_FD(rd->fd);
+        return -1;
+    }
+
+    rd->end = st.st_size;
+    rd->offset = RECLOG_MAGIC_LEN;
+
+    /* A missing or unreadable index only makes seeks slower */
+    path = NULL;
+    if (alloc_sprintf(&path, "%s/%s", dir, RECLOG_IDX) == -1)
+        return 0;
+    fd = openat(dirfd, path, O_RDONLY);
+    free(path);
+
+    if (fd == -1)
+        return 0;
+
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct reclog_index)) {
+        rd->index_count = st.st_size / sizeof(struct reclog_index);
+        rd->index = malloc(rd->index_count * sizeof(struct reclog_index));
+        if (!rd->index
+            || pread(fd, rd->index, rd->index_count * sizeof(struct reclog_index), 0)
+               != (ssize_t)(rd->index_count * sizeof(struct reclog_index))) {
+            free(rd->index);
+            rd->index = NULL;
+            rd->index_count = 0;
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+void reclog_reader_close (struct reclog_reader *rd)
+{
+    CLOSE_FD(rd->fd);
+    free(rd->index);
+    free(rd->buf);
+    rd->index = NULL;
+    rd->buf = NULL;
+    rd->index_count = 0;
+    rd->size = 0;
+}
+
+static void reader_refresh_end (struct reclog_reader *rd)
+{
+    struct stat st;
+
+    if (fstat(rd->fd, &st) == 0)
+        rd->end = st.st_size;
+}
+
+/* Reads and checks the header of the record at 'offset' */
+static int reader_read_hdr (struct reclog_reader *rd, uint64_t offset, struct reclog_hdr *hdr)
+{
+    if (pread(rd->fd, hdr, sizeof(*hdr), offset) != sizeof(*hdr))
+        return -1;
+
+    if (hdr->size < sizeof(*hdr) || hdr->size > RECLOG_MAX_RECORD
+        || hdr->type == 0 || hdr->type >= RECLOG_TYPE_LAST
+        || hdr->nick_len > hdr->size - sizeof(*hdr))
+        return -1;
+
+    return 0;
+}
+
+/* Starts reading from the record of the index entry before 'count', or from
+ * the start if 'count' is zero or the entry turns out to be wrong */
+static void reader_seek_entry (struct reclog_reader *rd, size_t count)
+{
+    struct reclog_index *ent;
+    struct reclog_hdr hdr;
+
+    rd->offset = RECLOG_MAGIC_LEN;
+
+    if (count == 0 || rd->index_bad)
+        return ;
+
+    ent = rd->index + count - 1;
+    if (reader_read_hdr(rd, ent->offset, &hdr) || hdr.seq != ent->seq) {
+        DEBUG_PRINT("Record log index doesn't match, ignoring it");
+        rd->index_bad = 1;
+        return ;
+    }
+
+    rd->offset = ent->offset;
+}
+
+int reclog_next (struct reclog_reader *rd, struct reclog_rec *rec)
+{
+    struct reclog_hdr hdr;
+    size_t body;
+    char *buf;
+
+    if (rd->offset + sizeof(hdr) > rd->end)
+        reader_refresh_end(rd);
+
+    if (rd->offset + sizeof(hdr) > rd->end || reader_read_hdr(rd, rd->offset, &hdr))
+        return -1;
+
+    if (rd->offset + hdr.size > rd->end) {
+        reader_refresh_end(rd);
+        if (rd->offset + hdr.size > rd->end)
+            return -1;
+    }
+
+    /* The nick and text each get a nul after them */
+    body = hdr.size - sizeof(hdr);
+    if (rd->size < body + 2) {
+        buf = realloc(rd->buf, body + 2);
+        if (!buf)
+            return -1;
+        rd->buf = buf;
+        rd->size = body + 2;
+    }
+
+    if (pread(rd->fd, rd->buf, body, rd->offset + sizeof(hdr)) != (ssize_t)body)
+        return -1;
+
+    memmove(rd->buf + hdr.nick_len + 1, rd->buf + hdr.nick_len, body - hdr.nick_len);
+    rd->buf[hdr.nick_len] = '\0';
+    rd->buf[body + 1] = '\0';
+
+    rec->type = hdr.type;
+    rec->seq = hdr.seq;
+    rec->time = hdr.time;
+    rec->nick = rd->buf;
+    rec->text = rd->buf + hdr.nick_len + 1;
+
+    rd->offset += hdr.size;
+    return 0;
+}
+
+/* Scans forward to the first record which 'reached' is true for, leaving the
+ * reader on it */
+static void reader_scan (struct reclog_reader *rd, int (*reached) (const struct reclog_rec *, const void *), const void *arg)
+{
+    struct reclog_rec rec;
+    uint64_t offset;
+
+    while (offset = rd->offset, reclog_next(rd, &rec) == 0) {
+        if (reached(&rec, arg)) {
+            rd->offset = offset;
+            return ;
+        }
+    }
+}
+
+static int reached_seq (const struct reclog_rec *rec, const void *seq)
+{
+    return rec->seq >= *(const uint64_t *)seq;
+}
+
+static int reached_time (const struct reclog_rec *rec, const void *t)
+{
+    return rec->time >= *(const time_t *)t;
+}
+
+void reclog_seek_seq (struct reclog_reader *rd, uint64_t seq)
+{
+    size_t low = 0, high = rd->index_count, mid;
+
+    /* Finds how many entries have a sequence number of at most 'seq' */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (rd->index[mid].seq <= seq)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    reader_seek_entry(rd, low);
+    reader_scan(rd, reached_seq, &seq);
+}
+
+void reclog_seek_time (struct reclog_reader *rd, time_t t)
+{
+    size_t low = 0, high = rd->index_count, mid;
+
+    /* Finds how many entries are before 't'. Everything up to the last of
+     * them is before it too, since entries hold the latest time so far. */
+    while (low < high) {
+        mid = low + (high - low) / 2;
+        if (rd->index[mid].time < t)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    reader_seek_entry(rd, low);
+    reader_scan(rd, reached_time, &t);
+}
+
+int reclog_render (const struct reclog_rec *rec, char *buf, size_t size)
+{
+    char stamp[64];
+
+    clock_format(rec->time, stamp, sizeof(stamp));
+
+    switch (rec->type) {
+    case RECLOG_MSG:
+        return snprintf(buf, size, "%s <%s> : %s\n", stamp, rec->nick, rec->text);
+
+    case RECLOG_TOPIC:
+        if (rec->nick[0])
+            return snprintf(buf, size, "%s %s set the topic to %s\n", stamp, rec->nick, rec->text);
+        else
+            return snprintf(buf, size, "%s Topic is %s\n", stamp, rec->text);
+
+    case RECLOG_JOIN:
+        return snprintf(buf, size, "%s join > %s\n", stamp, rec->nick);
+
+    case RECLOG_PART:
+        return snprintf(buf, size, "%s part > %s\n", stamp, rec->nick);
+
+    case RECLOG_QUIT:
+        return snprintf(buf, size, "%s quit < %s\n", stamp, rec->nick);
+
+    case RECLOG_NICK:
+        return snprintf(buf, size, "%s nick > %s is now %s\n", stamp, rec->nick, rec->text);
+
+    default:
+        return snprintf(buf, size, "%s\n", stamp);
+    }
+}
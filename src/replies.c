@@ -8,11 +8,13 @@
 
 #include "global.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "debug.h"
 #include "network.h"
 #include "channel.h"
+#include "irc.h"
 #include "replies.h"
 
 static void r_default(struct network *net, struct irc_reply *rpl)
@@ -22,73 +24,108 @@ static void r_default(struct network *net, struct irc_reply *rpl)
 
 static void r_ping(struct network *net, struct irc_reply *rpl)
 {
-    irc_send_raw(net, "PONG :%s", rpl->colon);
+    const char *token = irc_reply_param(rpl, 0);
+
+    /* A bare PING still gets an answer, just with an empty token */
+    if (!token)
+        token = "";
+
+    irc_send(net, SENDQ_URGENT, NULL, "PONG :%s", token);
+}
+
+static void r_pong(struct network *net, struct irc_reply *rpl)
+{
+    /* The first parameter is the server, the second our token */
+    network_pong(net, irc_reply_param(rpl, 1));
 }
 
 static void r_privmsg(struct network *net, struct irc_reply *rpl)
 {
     struct channel *chan;
-    char *user;
+    const char *user, *target, *text;
 
-    user = rpl->prefix.user;
+    user = rpl->prefix.nick;
+    target = irc_reply_param(rpl, 0);
+    text = irc_reply_param(rpl, 1);
 
-    DEBUG_PRINT("PRIVMSG: %s %s", user, rpl->lines.arr[0]);
+    if (!user || !target || !text)
+        return ;
 
-    network_foreach_channel(net, chan) {
-        DEBUG_PRINT("Checking channel: %s", chan->name);
-        if (strcmp(rpl->lines.arr[0], chan->name) == 0) {
-            channel_new_message(chan, user, rpl->colon);
-            return;
-        }
-    }
+    DEBUG_PRINT("PRIVMSG: %s %s", user, target);
 
-    /* Add this new channel */
-    if (strcmp(rpl->lines.arr[0], net->nickname) == 0)
-        chan = network_add_channel(net, user);
-    else
-        chan = network_add_channel(net, rpl->lines.arr[0]);
+    /* Private messages go in a "channel" named after the sender */
+    if (!isupport_is_channel(&net->isupport, target))
+        target = user;
 
-    channel_create_files(chan);
+    chan = network_find_channel(net, target);
+    if (!chan) {
+        chan = network_add_channel(net, target);
+        channel_create_files(chan);
+    }
 
-    channel_new_message(chan, user, rpl->colon);
+    channel_new_message(chan, user, text);
 }
 
 static void r_motd(struct network *net, struct irc_reply *rpl)
 {
     if (rpl->code == RPL_MOTDSTART)
         network_write_motd_start(net);
-    else if (rpl->code == RPL_MOTD)
-        network_write_motd_line(net, rpl->colon);
+    else if (rpl->code == RPL_MOTD && rpl->trailing)
+        network_write_motd_line(net, rpl->trailing);
+}
+
+/* The end of the MOTD (Or the lack of one) is the end of registration, and
+ * by then the server has sent all of its RPL_ISUPPORT */
+static void r_endofmotd(struct network *net, struct irc_reply *rpl)
+{
+    network_join_channels(net);
 }
 
 static void r_topic(struct network *net, struct irc_reply *rpl)
 {
-    const char *chan_nam;
+    const char *chan_nam, *topic, *user;
     struct channel *chan;
 
-    if (rpl->code == 332)
-        chan_nam = rpl->lines.arr[1];
-    else
-        chan_nam = rpl->lines.arr[0];
+    if (rpl->code == RPL_TOPIC) {
+        chan_nam = irc_reply_param(rpl, 1);
+        topic = irc_reply_param(rpl, 2);
+        user = NULL;
+    } else {
+        chan_nam = irc_reply_param(rpl, 0);
+        topic = irc_reply_param(rpl, 1);
+        user = rpl->prefix.nick;
+    }
+
+    if (!chan_nam || !topic)
+        return ;
 
     DEBUG_PRINT("Got a TOPIC");
-    network_foreach_channel(net, chan) {
-        DEBUG_PRINT("Checking channel: %s", chan->name);
-        if (strcmp(chan_nam, chan->name) == 0)
-            channel_new_topic(chan, rpl->colon, rpl->prefix.user);
-    }
+    chan = network_find_channel(net, chan_nam);
+    if (chan)
+        channel_new_topic(chan, user, topic);
 }
 
 static void r_join(struct network *net, struct irc_reply *rpl)
 {
     struct channel *chan;
     struct irc_user user;
+    const char *chan_nam = irc_reply_param(rpl, 0);
+
+    if (!rpl->prefix.nick || !chan_nam)
+        return ;
 
-    chan = network_find_channel(net, rpl->lines.arr[0]);
+    chan = network_find_channel(net, chan_nam);
+    if (!chan)
+        return ;
+
+    if (net->nickname && irc_casecmp(net->casemap, rpl->prefix.nick, net->nickname) == 0) {
+        chan->joined = 1;
+        net->joined_dirty = 1;
+    }
 
     irc_user_init(&user);
 
-    user.nick = strdup(rpl->prefix.user);
+    user.nick = strdup(rpl->prefix.nick);
     user.flags = (struct irc_user_flags){ 0 };
 
     channel_user_join(chan, &user);
@@ -99,69 +136,177 @@ static void r_join(struct network *net, struct irc_reply *rpl)
 static void r_part(struct network *net, struct irc_reply *rpl)
 {
     struct channel *chan;
+    const char *chan_nam = irc_reply_param(rpl, 0);
+    int self;
 
     DEBUG_PRINT("In Part!");
 
-    chan = network_find_channel(net, rpl->lines.arr[0]);
-    channel_user_part(chan, rpl->prefix.user);
+    if (!rpl->prefix.nick || !chan_nam)
+        return ;
+
+    self = net->nickname && irc_casecmp(net->casemap, rpl->prefix.nick, net->nickname) == 0;
+
+    /* Anything still queued for a channel we've left would just get an
+     * error back */
+    if (self)
+        network_drop_queued(net, chan_nam);
+
+    chan = network_find_channel(net, chan_nam);
+    if (!chan)
+        return ;
+
+    channel_user_part(chan, rpl->prefix.nick);
+
+    if (self) {
+        channel_left(chan);
+        net->joined_dirty = 1;
+    }
 }
 
 static void r_quit(struct network *net, struct irc_reply *rpl)
 {
-    struct channel *chan;
+    if (rpl->prefix.nick)
+        network_user_quit(net, rpl->prefix.nick);
+}
 
-    network_foreach_channel(net, chan)
-        channel_user_quit(chan, rpl->prefix.user);
+static void r_nick(struct network *net, struct irc_reply *rpl)
+{
+    const char *new = irc_reply_param(rpl, 0);
+
+    if (!rpl->prefix.nick || !new)
+        return ;
+
+    if (net->nickname && irc_casecmp(net->casemap, rpl->prefix.nick, net->nickname) == 0) {
+        free(net->nickname);
+        net->nickname = strdup(new);
+        network_write_nick(net);
+    }
+
+    network_user_change(net, rpl->prefix.nick, new);
 }
 
 static void r_names(struct network *net, struct irc_reply *rpl)
 {
     struct channel *chan;
     struct irc_user user;
-    int name_count = 0, i, flag = 1;
-    char **names = NULL;
-    char *last, *cur = rpl->colon;
-
-    chan = network_find_channel(net, rpl->lines.arr[2]);
-
-    last = cur;
-    for (; flag; cur++) {
-        if (*cur == '\0' || *cur == ' ') {
-            if (*cur == ' ')
-                *cur = '\0';
-            else
-                flag = 0;
-
-            name_count++;
-            names = realloc(names, name_count * (sizeof(*names)));
-            names[name_count-1] = last;
-
-            last = cur + 1;
-        }
-    }
+    char *cur = rpl->trailing, *name;
+    const char *chan_nam = irc_reply_param(rpl, 2);
+
+    if (!chan_nam || !cur)
+        return ;
+
+    chan = network_find_channel(net, chan_nam);
+    if (!chan)
+        return ;
+
+    channel_names_start(chan);
 
     irc_user_init(&user);
-    for (i = 0; i < name_count; i++) {
-        irc_user_conv(&user, names[i]);
+    while (*cur) {
+        name = cur;
+        cur = strchr(cur, ' ');
+        if (cur)
+            *cur++ = '\0';
+        else
+            cur = name + strlen(name);
+
+        if (*name == '\0')
+            continue;
+
+        irc_user_conv(&user, &net->isupport, name);
         channel_user_online(chan, &user);
     }
     irc_user_clear(&user);
+}
+
+static void r_endofnames(struct network *net, struct irc_reply *rpl)
+{
+    struct channel *chan;
+    const char *chan_nam = irc_reply_param(rpl, 1);
+
+    if (!chan_nam)
+        return ;
+
+    /* The NAMES list is complete, so anyone who wasn't in it is gone, and the
+     * 'online' file can go out now */
+    chan = network_find_channel(net, chan_nam);
+    if (chan) {
+        channel_names_end(chan);
+        channel_flush(chan);
+    }
+}
+
+static void r_welcome(struct network *net, struct irc_reply *rpl)
+{
+    network_registered(net);
+}
+
+static void r_cap(struct network *net, struct irc_reply *rpl)
+{
+    const char *sub = irc_reply_param(rpl, 1);
+
+    if (!sub)
+        return ;
 
-    free(names);
+    /* We only ever request 'server-time', so whatever the answer is,
+     * negotiation is done */
+    if (strcmp(sub, "ACK") == 0 || strcmp(sub, "NAK") == 0)
+        irc_cap_end(net);
+}
+
+static void r_isupport(struct network *net, struct irc_reply *rpl)
+{
+    int i;
+
+    /* The first parameter is our nick, the rest are the tokens */
+    for (i = 1; i < rpl->param_count; i++)
+        network_isupport(net, rpl->params[i]);
 }
 
 struct reply_handler reply_handler_list[] = {
-    { NULL,      0,             r_default },
-    { "PING",    0,             r_ping },
-    { "PRIVMSG", 0,             r_privmsg },
-    { NULL,      RPL_MOTDSTART, r_motd },
-    { NULL,      RPL_MOTD,      r_motd },
-    { NULL,      RPL_TOPIC,     r_topic },
-    { NULL,      RPL_NAMREPLY,  r_names },
-    { "TOPIC",   0,             r_topic },
-    { "JOIN",    0,             r_join },
-    { "PART",    0,             r_part },
-    { "QUIT",    0,             r_quit },
+    { RPL_WELCOME,   r_welcome },
+    { CMD_PING,      r_ping },
+    { CMD_PONG,      r_pong },
+    { CMD_PRIVMSG,   r_privmsg },
+    { RPL_ISUPPORT,  r_isupport },
+    { RPL_MOTDSTART, r_motd },
+    { RPL_MOTD,      r_motd },
+    { RPL_ENDOFMOTD, r_endofmotd },
+    { ERR_NOMOTD,    r_endofmotd },
+    { RPL_TOPIC,     r_topic },
+    { RPL_NAMREPLY,  r_names },
+    { RPL_ENDOFNAMES, r_endofnames },
+    { CMD_TOPIC,     r_topic },
+    { CMD_JOIN,      r_join },
+    { CMD_PART,      r_part },
+    { CMD_QUIT,      r_quit },
+    { CMD_NICK,      r_nick },
+    { CMD_CAP,       r_cap },
     { 0 }
 };
 
+static reply_handler_fn reply_table[IRC_CODE_COUNT];
+
+void reply_register(enum irc_reply_code code, reply_handler_fn handler)
+{
+    if (code > 0 && code < IRC_CODE_COUNT)
+        reply_table[code] = handler;
+}
+
+void replies_init(void)
+{
+    struct reply_handler *hand;
+    int i;
+
+    for (i = 0; i < IRC_CODE_COUNT; i++)
+        reply_table[i] = r_default;
+
+    for (hand = reply_handler_list; hand->handler != NULL; hand++)
+        reply_register(hand->code, hand->handler);
+}
+
+void reply_dispatch(struct network *net, struct irc_reply *rpl)
+{
+    DEBUG_PRINT("Handler: %p", reply_table[rpl->code]);
+    (reply_table[rpl->code]) (net, rpl);
+}
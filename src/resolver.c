@@ -0,0 +1,323 @@
+/*
+ * ./resolver.c -- Asynchronous, caching host name resolution
+ *
+ * getaddrinfo() blocks, so it's run on a helper thread. Lookups are queued
+ * for the thread, and once one is done the thread writes the finished entry
+ * down a pipe, which is registered with the event loop. The callbacks are
+ * then run from the event loop, so nothing outside of this file ever has to
+ * care about the thread.
+ *
+ * Answers are cached per host and port for RESOLVER_CACHE_TTL seconds, and a
+ * lookup for a host that's already being resolved waits on the existing
+ * lookup. Thus a lot of networks reconnecting at once only cost one lookup
+ * per server.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "debug.h"
+#include "fassert.h"
+#include "buf.h"
+#include "clock.h"
+#include "event.h"
+#include "resolver.h"
+
+/* Everything in an entry belongs to the event loop, except while 'resolving'
+ * is set. Then the host, port and results belong to the thread until it
+ * hands the entry back through the pipe. */
+struct resolver_entry {
+    struct resolver_entry *next;
+    struct resolver_entry *next_job;
+
+    char *host;
+    int port;
+
+    time_t expires;
+    int count;
+    struct resolver_addr addrs[RESOLVER_MAX_ADDRS];
+
+    struct resolver_req *waiters;
+    unsigned int resolving :1;
+};
+
+static struct resolver_entry *cache_head = NULL;
+
+static pthread_t thread;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct resolver_entry *job_head = NULL, **job_tail = &job_head;
+static int thread_stop = 0, thread_running = 0;
+
+static int done_pipe[2] = { -1, -1 };
+static struct event_fd done_ev;
+
+/* Orders the results so that the address families alternate, starting with
+ * the family of the first result (RFC 8305, section 4) */
+static int resolver_sort (struct addrinfo *res, struct resolver_addr *addrs)
+{
+    struct addrinfo *first[RESOLVER_MAX_ADDRS], *second[RESOLVER_MAX_ADDRS], *ai;
+    int first_count = 0, second_count = 0, count = 0, i;
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(struct sockaddr_storage))
+            continue;
+
+        if (ai->ai_family == res->ai_family) {
+            if (first_count < RESOLVER_MAX_ADDRS)
+                first[first_count++] = ai;
+        } else if (second_count < RESOLVER_MAX_ADDRS) {
+            second[second_count++] = ai;
+        }
+    }
+
+    for (i = 0; count < RESOLVER_MAX_ADDRS && (i < first_count || i < second_count); i++) {
+        if (i < first_count) {
+            memcpy(&addrs[count].addr, first[i]->ai_addr, first[i]->ai_addrlen);
+            addrs[count++].len = first[i]->ai_addrlen;
+        }
+        if (i < second_count && count < RESOLVER_MAX_ADDRS) {
+            memcpy(&addrs[count].addr, second[i]->ai_addr, second[i]->ai_addrlen);
+            addrs[count++].len = second[i]->ai_addrlen;
+        }
+    }
+
+    return count;
+}
+
+static void resolver_resolve (struct resolver_entry *entry)
+{
+    struct addrinfo hints, *res;
+    char port[16];
+    int ret;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV;
+
+    snprintf(port, sizeof(port), "%d", entry->port);
+
+    entry->count = 0;
+    ret = getaddrinfo(entry->host, port, &hints, &res);
+    if (ret != 0) {
+        DEBUG_PRINT("Unable to resolve %s: %s", entry->host, gai_strerror(ret));
+        return ;
+    }
+
+    entry->count = resolver_sort(res, entry->addrs);
+    freeaddrinfo(res);
+}
+
+static void *resolver_thread (void *arg)
+{
+    struct resolver_entry *entry;
+
+    pthread_mutex_lock(&job_lock);
+    while (1) {
+        while (!job_head && !thread_stop)
+            pthread_cond_wait(&job_cond, &job_lock);
+
+        if (thread_stop)
+            break;
+
+        entry = job_head;
+        job_head = entry->next_job;
+        if (!job_head)
+            job_tail = &job_head;
+
+        pthread_mutex_unlock(&job_lock);
+
+        resolver_resolve(entry);
+        while (write(done_pipe[1], &entry, sizeof(entry)) == -1 && errno == EINTR)
+            ;
+
+        pthread_mutex_lock(&job_lock);
+    }
+    pthread_mutex_unlock(&job_lock);
+
+    return NULL;
+}
+
+static void resolver_finish (struct resolver_entry *entry)
+{
+    struct resolver_req *req;
+
+    entry->resolving = 0;
+    entry->expires = clock_now() + ((entry->count)? RESOLVER_CACHE_TTL: RESOLVER_NEGATIVE_TTL);
+
+    /* Callbacks are free to make new requests (Even for this entry), so each
+     * request is taken off the list before its callback is run */
+    while ((req = entry->waiters) != NULL) {
+        entry->waiters = req->next;
+        req->next = NULL;
+        req->entry = NULL;
+
+        (req->callback) (req, entry->addrs, entry->count);
+    }
+}
+
+static void resolver_handle_done (struct event_fd *ev, unsigned int events)
+{
+    struct resolver_entry *entry;
+
+    while (read(done_pipe[0], &entry, sizeof(entry)) == sizeof(entry))
+        resolver_finish(entry);
+}
+
+int resolver_init (void)
+{
+    sigset_t all, old;
+
+    if (pipe(done_pipe) == -1)
+        return -1;
+
+    fcntl(done_pipe[0], F_SETFL, O_NONBLOCK | fcntl(done_pipe[0], F_GETFL));
+
+    event_fd_init(&done_ev);
+    event_add(&done_ev, done_pipe[0], EVENT_IN, resolver_handle_done);
+
+    /* Signals should only ever be handled on the main thread, so the new
+     * thread starts out with all of them blocked */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    thread_stop = 0;
+    thread_running = (pthread_create(&thread, NULL, resolver_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!thread_running) {
+        event_del(&done_ev);
+        CLOSE_FD(done_pipe[0]);
+        CLOSE_FD(done_pipe[1]);
+        return -1;
+    }
+
+    return 0;
+}
+
+void resolver_clear (void)
+{
+    struct resolver_entry *entry, *next;
+
+    if (thread_running) {
+        pthread_mutex_lock(&job_lock);
+        thread_stop = 1;
+        pthread_cond_signal(&job_cond);
+        pthread_mutex_unlock(&job_lock);
+
+        pthread_join(thread, NULL);
+        thread_running = 0;
+    }
+
+    event_del(&done_ev);
+    CLOSE_FD(done_pipe[0]);
+    CLOSE_FD(done_pipe[1]);
+
+    for (entry = cache_head; entry != NULL; entry = next) {
+        next = entry->next;
+        free(entry->host);
+        free(entry);
+    }
+    cache_head = NULL;
+    job_head = NULL;
+    job_tail = &job_head;
+}
+
+void resolver_req_init (struct resolver_req *req)
+{
+    memset(req, 0, sizeof(struct resolver_req));
+}
+
+static struct resolver_entry *resolver_find (const char *host, int port)
+{
+    struct resolver_entry *entry;
+
+    for (entry = cache_head; entry != NULL; entry = entry->next)
+        if (entry->port == port && strcmp(entry->host, host) == 0)
+            return entry;
+
+    return NULL;
+}
+
+void resolver_lookup (struct resolver_req *req, const char *host, int port, resolver_callback callback)
+{
+    struct resolver_entry *entry;
+
+    fassert(req);
+    fassert(host);
+    fassert(callback);
+
+    resolver_cancel(req);
+    req->callback = callback;
+
+    entry = resolver_find(host, port);
+    if (entry && !entry->resolving && entry->expires > clock_now()) {
+        (req->callback) (req, entry->addrs, entry->count);
+        return ;
+    }
+
+    if (!entry) {
+        entry = malloc(sizeof(*entry));
+        memset(entry, 0, sizeof(*entry));
+        entry->host = strdup(host);
+        entry->port = port;
+        entry->next = cache_head;
+        cache_head = entry;
+    }
+
+    req->entry = entry;
+    req->next = entry->waiters;
+    entry->waiters = req;
+
+    if (entry->resolving)
+        return ;
+
+    entry->resolving = 1;
+
+    if (!thread_running) {
+        /* No thread (Ex. resolver_init failed), so just block */
+        resolver_resolve(entry);
+        resolver_finish(entry);
+        return ;
+    }
+
+    pthread_mutex_lock(&job_lock);
+    entry->next_job = NULL;
+    *job_tail = entry;
+    job_tail = &entry->next_job;
+    pthread_cond_signal(&job_cond);
+    pthread_mutex_unlock(&job_lock);
+}
+
+void resolver_cancel (struct resolver_req *req)
+{
+    struct resolver_req **cur;
+
+    if (!req->entry)
+        return ;
+
+    for (cur = &req->entry->waiters; *cur != NULL; cur = &((*cur)->next)) {
+        if (*cur == req) {
+            *cur = req->next;
+            break;
+        }
+    }
+
+    req->next = NULL;
+    req->entry = NULL;
+}
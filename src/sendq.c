@@ -0,0 +1,425 @@
+/*
+ * ./sendq.c -- Queue of outgoing lines for a server connection
+ *
+ * The socket is non-blocking, so a write can be short, or not happen at
+ * all. Lines are queued whole, and written out with sendmsg() (Which is
+ * writev() with flags), so any number of lines go out in one call and a
+ * partial write just leaves the rest for when the socket is writable again.
+ *
+ * Servers disconnect clients that send too much too fast, so lines first wait
+ * in one of a few lists, by class, and are only moved to the list that's
+ * actually written as a token bucket allows. PONGs thus go out ahead of a
+ * long run of JOINs, and lines for a channel can be dropped if we leave it
+ * before they were sent.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "debug.h"
+#include "fassert.h"
+#include "sendq.h"
+
+#define SENDQ_EOL "\r\n"
+
+const char sendq_target_list[] = "";
+
+static void sendq_list_init (struct sendq_list *list)
+{
+    list->head = NULL;
+    list->tail = &list->head;
+}
+
+static void sendq_list_free (struct sendq_list *list)
+{
+    struct sendq_line *line, *next;
+
+    for (line = list->head; line != NULL; line = next) {
+        next = line->next;
+        free(line);
+    }
+
+    sendq_list_init(list);
+}
+
+static void sendq_list_append (struct sendq_list *list, struct sendq_line *line)
+{
+    line->next = NULL;
+    *list->tail = line;
+    list->tail = &line->next;
+}
+
+void sendq_init (struct sendq *q)
+{
+    int i;
+
+    memset(q, 0, sizeof(struct sendq));
+
+    for (i = 0; i < SENDQ_CLASS_COUNT; i++)
+        sendq_list_init(q->waiting + i);
+
+    sendq_list_init(&q->out);
+}
+
+void sendq_clear (struct sendq *q)
+{
+    unsigned int burst = q->burst, interval = q->interval;
+    int i;
+
+    for (i = 0; i < SENDQ_CLASS_COUNT; i++)
+        sendq_list_free(q->waiting + i);
+
+    sendq_list_free(&q->out);
+
+    sendq_init(q);
+    sendq_set_rate(q, burst, interval);
+}
+
+void sendq_set_rate (struct sendq *q, unsigned int burst, unsigned int interval)
+{
+    q->burst = burst;
+    q->interval = interval;
+    q->credit = (long long)burst * interval;
+    q->last = 0;
+}
+
+void sendq_printfv (struct sendq *q, enum sendq_class class, const char *target, const char *format, va_list lst)
+{
+    struct sendq_line *line;
+    size_t target_len = 0;
+    va_list cpy;
+    int len;
+
+    fassert(class < SENDQ_CLASS_COUNT);
+
+    va_copy(cpy, lst);
+    len = vsnprintf(NULL, 0, format, cpy);
+    va_end(cpy);
+
+    if (len < 0)
+        return ;
+
+    if (target && target != SENDQ_TARGET_LIST)
+        target_len = strlen(target) + 1;
+
+    line = malloc(sizeof(*line) + len + sizeof(SENDQ_EOL) + target_len);
+    if (!line)
+        return ;
+
+    vsnprintf(line->buf, len + 1, format, lst);
+    memcpy(line->buf + len, SENDQ_EOL, sizeof(SENDQ_EOL));
+    line->len = len + sizeof(SENDQ_EOL) - 1;
+
+    line->target = NULL;
+    line->target_list = (target == SENDQ_TARGET_LIST);
+    if (target_len) {
+        memcpy(line->buf + line->len + 1, target, target_len);
+        line->target = line->buf + line->len + 1;
+    }
+
+    sendq_list_append(q->waiting + class, line);
+    q->bytes += line->len;
+}
+
+void sendq_printf (struct sendq *q, enum sendq_class class, const char *target, const char *format, ...)
+{
+    va_list lst;
+
+    va_start(lst, format);
+    sendq_printfv(q, class, target, format, lst);
+    va_end(lst);
+}
+
+/* Splits the next entry off of a comma separated list, like strsep() */
+static char *sendq_next_entry (char **list)
+{
+    char *entry = *list, *comma;
+
+    if (!entry)
+        return NULL;
+
+    comma = strchr(entry, ',');
+    if (comma)
+        *comma++ = '\0';
+    *list = comma;
+
+    return entry;
+}
+
+/* Returns a copy of a SENDQ_TARGET_LIST line without the targets (And keys)
+ * that 'match' accepts. If none match the line itself is returned, and if
+ * they all do then NULL is. */
+static struct sendq_line *sendq_drop_from_list (struct sendq_line *line, int (*match) (const char *target, void *data), void *data)
+{
+    struct sendq_line *new;
+    size_t body_len = line->len - (sizeof(SENDQ_EOL) - 1), keys_len = 0;
+    char *body, *kept_keys, *targets, *keys, *target, *key, *out;
+    int kept = 0, dropped = 0;
+
+    body = malloc(body_len + 1);
+    kept_keys = malloc(body_len + 1);
+    new = malloc(sizeof(*new) + body_len + sizeof(SENDQ_EOL));
+    if (!body || !kept_keys || !new)
+        goto keep;
+
+    memcpy(body, line->buf, body_len);
+    body[body_len] = '\0';
+
+    targets = strchr(body, ' ');
+    if (!targets)
+        goto keep;
+    *targets++ = '\0';
+
+    keys = strchr(targets, ' ');
+    if (keys)
+        *keys++ = '\0';
+
+    out = stpcpy(new->buf, body);
+    *out++ = ' ';
+
+    while ((target = sendq_next_entry(&targets)) != NULL) {
+        key = sendq_next_entry(&keys);
+
+        if (match(target, data)) {
+            dropped++;
+            continue;
+        }
+
+        if (kept++)
+            *out++ = ',';
+        out = stpcpy(out, target);
+
+        if (key) {
+            if (keys_len)
+                kept_keys[keys_len++] = ',';
+            memcpy(kept_keys + keys_len, key, strlen(key));
+            keys_len += strlen(key);
+        }
+    }
+
+    if (!dropped)
+        goto keep;
+
+    free(body);
+
+    if (!kept) {
+        free(kept_keys);
+        free(new);
+        return NULL;
+    }
+
+    if (keys_len) {
+        *out++ = ' ';
+        memcpy(out, kept_keys, keys_len);
+        out += keys_len;
+    }
+    free(kept_keys);
+
+    memcpy(out, SENDQ_EOL, sizeof(SENDQ_EOL));
+    new->len = out - new->buf + sizeof(SENDQ_EOL) - 1;
+    new->target = NULL;
+    new->target_list = 1;
+
+    return new;
+
+  keep:
+    free(body);
+    free(kept_keys);
+    free(new);
+    return line;
+}
+
+void sendq_drop (struct sendq *q, int (*match) (const char *target, void *data), void *data)
+{
+    struct sendq_line **cur, *line, *new;
+    int i;
+
+    for (i = 0; i < SENDQ_CLASS_COUNT; i++) {
+        cur = &q->waiting[i].head;
+        while ((line = *cur) != NULL) {
+            if (line->target_list) {
+                new = sendq_drop_from_list(line, match, data);
+                if (new == line) {
+                    cur = &line->next;
+                    continue;
+                }
+
+                q->bytes -= line->len;
+                *cur = line->next;
+                free(line);
+
+                if (new) {
+                    new->next = *cur;
+                    *cur = new;
+                    q->bytes += new->len;
+                    cur = &new->next;
+                }
+                continue;
+            }
+
+            if (!line->target || !match(line->target, data)) {
+                cur = &line->next;
+                continue;
+            }
+
+            *cur = line->next;
+            q->bytes -= line->len;
+            free(line);
+        }
+
+        q->waiting[i].tail = cur;
+    }
+}
+
+static void sendq_refill (struct sendq *q, long long now)
+{
+    long long max = (long long)q->burst * q->interval;
+
+    if (now > q->last) {
+        q->credit += now - q->last;
+        q->last = now;
+    }
+
+    if (q->credit > max)
+        q->credit = max;
+}
+
+/* Moves lines from the waiting lists onto the end of 'out', highest class
+ * first, for as long as there are tokens left. Urgent lines don't wait on
+ * the bucket at all, since a late PONG gets us disconnected, but they still
+ * use up tokens (Going into debt if need be), so the lines behind them are
+ * held back to make up for it. */
+static void sendq_release (struct sendq *q, long long now)
+{
+    struct sendq_list *list;
+    struct sendq_line *line;
+    int i;
+
+    if (q->interval)
+        sendq_refill(q, now);
+
+    for (i = 0; i < SENDQ_CLASS_COUNT; i++) {
+        list = q->waiting + i;
+
+        while (list->head) {
+            if (q->interval) {
+                if (i != SENDQ_URGENT && q->credit < q->interval)
+                    return ;
+                q->credit -= q->interval;
+            }
+
+            line = list->head;
+            list->head = line->next;
+            if (!list->head)
+                list->tail = &list->head;
+
+            sendq_list_append(&q->out, line);
+        }
+    }
+}
+
+int sendq_next_release (struct sendq *q, long long now)
+{
+    int i;
+
+    for (i = 0; i < SENDQ_CLASS_COUNT; i++)
+        if (q->waiting[i].head)
+            break;
+
+    if (i == SENDQ_CLASS_COUNT)
+        return -1;
+
+    if (!q->interval)
+        return 0;
+
+    sendq_refill(q, now);
+    if (q->credit >= q->interval)
+        return 0;
+
+    return q->interval - q->credit;
+}
+
+int sendq_empty (struct sendq *q)
+{
+    return q->bytes == 0;
+}
+
+/* Drops 'len' sent bytes off the front of the queue */
+static void sendq_consume (struct sendq *q, size_t len)
+{
+    struct sendq_line *line;
+
+    q->bytes -= len;
+
+    while (len > 0) {
+        line = q->out.head;
+
+        if (len < line->len - q->offset) {
+            q->offset += len;
+            return ;
+        }
+
+        len -= line->len - q->offset;
+        q->offset = 0;
+
+        q->out.head = line->next;
+        if (!q->out.head)
+            q->out.tail = &q->out.head;
+        free(line);
+    }
+}
+
+int sendq_write (struct sendq *q, int fd, long long now)
+{
+    struct iovec iov[SENDQ_MAX_IOV];
+    struct msghdr msg;
+    struct sendq_line *line;
+    ssize_t ret;
+    int count;
+
+    sendq_release(q, now);
+
+    while (q->out.head) {
+        count = 0;
+        for (line = q->out.head; line != NULL && count < SENDQ_MAX_IOV; line = line->next) {
+            iov[count].iov_base = line->buf;
+            iov[count].iov_len = line->len;
+            count++;
+        }
+
+        iov[0].iov_base = q->out.head->buf + q->offset;
+        iov[0].iov_len = q->out.head->len - q->offset;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        /* MSG_NOSIGNAL, since a closed connection should be an error and
+         * not a SIGPIPE */
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            DEBUG_PRINT("Write to %d failed: %s", fd, strerror(errno));
+            return -1;
+        }
+
+        sendq_consume(q, ret);
+    }
+
+    return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * ./timer.c -- One-shot timers for the event loop
+ *
+ * Pending timers are kept on a hierarchical timing wheel (Varghese and
+ * Lauck), so adding and deleting a timer never looks at any other timer.
+ *
+ * The wheel has a current time, 'wheel_now', and each level has a slot for
+ * every TIMER_WHEEL_SIZE^level milliseconds. A timer goes on the lowest
+ * level whose slots reach out to its expiry time. Whenever the slots of a
+ * level come back around to zero, the current slot of the next level up is
+ * emptied and its timers are put back onto the lower levels ("cascading"),
+ * so that a timer always ends up in a level 0 slot by the time it expires.
+ *
+ * A bitmap of the non-empty slots on each level means finding the next
+ * timer, and skipping over stretches of time with nothing in them, don't
+ * have to look at every slot.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "fassert.h"
+#include "timer.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+
+/* The span of one slot on 'level', and of the whole wheel */
+#define TIMER_LEVEL_SPAN(level) (1LL << (TIMER_WHEEL_BITS * (level)))
+#define TIMER_WHEEL_SPAN TIMER_LEVEL_SPAN(TIMER_WHEEL_LEVELS)
+
+static struct timer *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
+static uint64_t occupied[TIMER_WHEEL_LEVELS];
+
+/* Every slot before 'wheel_now' has been run */
+static long long wheel_now;
+static int wheel_started = 0;
+static unsigned int timer_count = 0;
+
+long long timer_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_wheel_start (void)
+{
+    if (wheel_started)
+        return ;
+
+    wheel_now = timer_now();
+    wheel_started = 1;
+}
+
+static int timer_slot_index (long long expires, int level)
+{
+    return (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+}
+
+/* Puts 'timer' in the slot for its expiry time, relative to 'wheel_now' */
+static void timer_insert (struct timer *timer)
+{
+    long long expires = timer->expires, delta;
+    struct timer **head;
+    int level;
+
+    if (expires < wheel_now)
+        expires = wheel_now;
+
+    /* Too far out for the wheel, so it waits in the last slot and is put
+     * back once that slot comes around */
+    delta = expires - wheel_now;
+    if (delta >= TIMER_WHEEL_SPAN) {
+        expires = wheel_now + TIMER_WHEEL_SPAN - 1;
+        delta = TIMER_WHEEL_SPAN - 1;
+    }
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++)
+        if (delta < TIMER_LEVEL_SPAN(level + 1))
+            break;
+
+    timer->level = level;
+    timer->slot = timer_slot_index(expires, level);
+
+    head = &wheel[level][timer->slot];
+    timer->next = *head;
+    timer->prev = head;
+    if (*head)
+        (*head)->prev = &timer->next;
+    *head = timer;
+
+    occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+static void timer_unlink (struct timer *timer)
+{
+    *timer->prev = timer->next;
+    if (timer->next)
+        timer->next->prev = timer->prev;
+
+    if (!wheel[timer->level][timer->slot])
+        occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+void timer_init (struct timer *timer)
+{
+    memset(timer, 0, sizeof(struct timer));
+}
+
+void timer_del (struct timer *timer)
+{
+    if (!timer->pending)
+        return ;
+
+    timer_unlink(timer);
+    timer->pending = 0;
+    timer_count--;
+}
+
+void timer_add (struct timer *timer, unsigned int ms, timer_handler handler)
+{
+    fassert(timer);
+    fassert(handler);
+
+    timer_del(timer);
+    timer_wheel_start();
+
+    timer->expires = timer_now() + ms;
+    timer->handler = handler;
+
+    timer_insert(timer);
+    timer->pending = 1;
+    timer_count++;
+}
+
+/* Returns the slot on 'level' that comes up next after the current one, or
+ * -1 if the level is empty */
+static int timer_next_slot (int level, int from)
+{
+    uint64_t bits = occupied[level];
+    int shift = from & TIMER_WHEEL_MASK;
+
+    if (!bits)
+        return -1;
+
+    /* Rotated so that bit 0 is the slot 'from' */
+    if (shift)
+        bits = (bits >> shift) | (bits << (TIMER_WHEEL_SIZE - shift));
+
+    return (from + __builtin_ctzll(bits)) & TIMER_WHEEL_MASK;
+}
+
+int timer_timeout (void)
+{
+    struct timer *timer;
+    long long next = -1, diff;
+    int level, slot, from;
+
+    if (!timer_count)
+        return -1;
+
+    /* Every timer in a level 0 slot expires right at that slot's time */
+    slot = timer_next_slot(0, timer_slot_index(wheel_now, 0));
+    if (slot != -1)
+        next = wheel_now + ((slot - wheel_now) & TIMER_WHEEL_MASK);
+
+    /* On the higher levels, the first non-empty slot holds that level's
+     * earliest timers, but the level below might still have something
+     * sooner. The current slot has already been cascaded, unless the wheel
+     * is sitting right at its start, so the search starts after it. */
+    for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        from = timer_slot_index(wheel_now, level);
+        if (wheel_now & (TIMER_LEVEL_SPAN(level) - 1))
+            from++;
+
+        slot = timer_next_slot(level, from);
+        if (slot == -1)
+            continue;
+
+        for (timer = wheel[level][slot]; timer != NULL; timer = timer->next)
+            if (next == -1 || timer->expires < next)
+                next = timer->expires;
+    }
+
+    diff = next - timer_now();
+    if (diff < 0)
+        return 0;
+    if (diff > TIMER_WHEEL_SPAN)
+        return TIMER_WHEEL_SPAN;
+
+    return diff;
+}
+
+/* Called when 'wheel_now' is at the start of a level 1 slot. The highest
+ * level that's also at the start of a slot goes first, so the timers it
+ * moves down get moved again by the levels below it. */
+static void timer_cascade (void)
+{
+    struct timer *timer, *list;
+    int level, top, slot;
+
+    for (top = 1; top < TIMER_WHEEL_LEVELS - 1; top++)
+        if (timer_slot_index(wheel_now, top) != 0)
+            break;
+
+    for (level = top; level > 0; level--) {
+        slot = timer_slot_index(wheel_now, level);
+        list = wheel[level][slot];
+        wheel[level][slot] = NULL;
+        occupied[level] &= ~((uint64_t)1 << slot);
+
+        while ((timer = list) != NULL) {
+            list = timer->next;
+            timer_insert(timer);
+        }
+    }
+}
+
+void timer_run (void)
+{
+    struct timer **head, *timer;
+    long long now = timer_now(), next, slot_time;
+    int level, slot;
+
+    if (!wheel_started)
+        return ;
+
+    while (wheel_now <= now) {
+        if (timer_slot_index(wheel_now, 0) == 0)
+            timer_cascade();
+
+        /* The handler is free to re-add its timer, or add and delete others,
+         * so the head is looked at again each time around */
+        head = &wheel[0][timer_slot_index(wheel_now, 0)];
+        while ((timer = *head) != NULL) {
+            timer_unlink(timer);
+            timer->pending = 0;
+            timer_count--;
+
+            (timer->handler) (timer);
+        }
+
+        /* Skip ahead to the next slot that could have something in it, but
+         * never past the start of a level 1 slot, since that's when the
+         * higher levels cascade. If the lowest levels are empty, the next
+         * thing that can happen is the first level that isn't cascading. */
+        for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+            if (occupied[level])
+                break;
+
+        if (level == TIMER_WHEEL_LEVELS) {
+            wheel_now = now + 1;
+            break;
+        }
+
+        next = (wheel_now | (TIMER_LEVEL_SPAN(level ? level: 1) - 1)) + 1;
+
+        if (level == 0) {
+            slot = timer_next_slot(0, timer_slot_index(wheel_now + 1, 0));
+            slot_time = wheel_now + 1 + ((slot - wheel_now - 1) & TIMER_WHEEL_MASK);
+            if (slot_time < next)
+                next = slot_time;
+        }
+
+        wheel_now = (next < now + 1)? next: now + 1;
+    }
+}
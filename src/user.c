@@ -41,13 +41,20 @@ void irc_user_format_nick(struct irc_user *user)
         user->formatted = strdup(user->nick);
 }
 
-void irc_user_conv(struct irc_user *user, char *name)
+void irc_user_conv(struct irc_user *user, const struct isupport *is, char *name)
 {
-    free(user->nick);
-    if (IS_USER_CHAR(name[0])) {
-        user->nick = strdup(name + 1);
-    } else {
-        user->nick = strdup(name);
+    unsigned char class;
+
+    user->flags = (struct irc_user_flags){ 0 };
+
+    for (; (class = isupport_class(is, *name)) & ISUPPORT_PREFIX; name++) {
+        if (class & ISUPPORT_OP)
+            user->flags.is_op = 1;
+        if (class & ISUPPORT_VOICE)
+            user->flags.is_voice = 1;
     }
+
+    free(user->nick);
+    user->nick = strdup(name);
 }
 
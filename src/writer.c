@@ -0,0 +1,414 @@
+/*
+ * ./writer.c -- Writes to the log and state files from a helper thread
+ *
+ * A write to a slow disk (Ex. over NFS) blocks, and on the event-loop thread
+ * that stops every network from being read, long enough for servers to time
+ * us out. Instead, the event loop only formats its output and queues it, and
+ * a helper thread does the actual writing.
+ *
+ * Records are passed through a single-producer, single-consumer ring. Only
+ * the event loop adds records and only the thread takes them, so the ring
+ * itself needs no locks. The lock and conditions are only used for the
+ * thread to sleep while there's nothing to do, and for 'writer_sync' to wait
+ * for it to finish.
+ *
+ * Appends are limited to WRITER_MAX_BYTES queued at once. Past that they're
+ * refused, and the outbuf keeps them pending (Dropping them if it fills up),
+ * so a stalled disk costs a bounded amount of memory.
+ *
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+
+#include "global.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "debug.h"
+#include "writer.h"
+
+#define WRITER_RING_MASK (WRITER_RING_SIZE - 1)
+
+enum writer_type {
+    WRITER_WRITE,
+    WRITER_REPLACE,
+    WRITER_REPLACE_AT,
+    WRITER_OPEN_AT,
+    WRITER_UNLINK_AT,
+    WRITER_CALL,
+    WRITER_CLOSE
+};
+
+struct writer_rec {
+    enum writer_type type;
+    int fd;
+    char *path;
+    char *buf;
+    size_t len;
+
+    /* For WRITER_OPEN_AT, 'fd' is the placeholder the file is opened onto.
+     * WRITER_UNLINK_AT only uses 'dirfd', 'path' and 'flags'. */
+    int dirfd;
+    int flags;
+
+    writer_fn fn;
+    void *arg;
+};
+
+/* 'ring_head' is only written by the thread, and 'ring_tail' only by the
+ * event loop. A record belongs to the thread from when 'ring_tail' is moved
+ * past it, until the thread has written it out and moved 'ring_head' past
+ * it. */
+static struct writer_rec ring[WRITER_RING_SIZE];
+static unsigned int ring_head = 0, ring_tail = 0;
+static size_t queued_bytes = 0;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int thread_sleeping = 0, thread_stop = 0, thread_running = 0;
+
+/* '/dev/null', which placeholders for 'writer_open_at' are dup'd from */
+static int null_fd = -1;
+
+static void writer_all (int fd, const char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret == -1) {
+            if (errno == EINTR)
+                continue;
+            DEBUG_PRINT("Dropping %zu bytes of output to fd %d", len, fd);
+            return ;
+        }
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void writer_do (struct writer_rec *rec)
+{
+    int fd;
+
+    switch (rec->type) {
+    case WRITER_WRITE:
+        writer_all(rec->fd, rec->buf, rec->len);
+        break;
+
+    case WRITER_REPLACE:
+        ftruncate(rec->fd, 0);
+        lseek(rec->fd, 0, SEEK_SET);
+        writer_all(rec->fd, rec->buf, rec->len);
+        break;
+
+    case WRITER_REPLACE_AT:
+        fd = openat(rec->fd, rec->path, O_WRONLY | O_CREAT | O_TRUNC, 0750);
+        if (fd != -1) {
+            writer_all(fd, rec->buf, rec->len);
+            close(fd);
+        }
+        break;
+
+    case WRITER_OPEN_AT:
+        /* The placeholder now refers to the file, and the writes queued
+         * after this go to it */
+        fd = openat(rec->dirfd, rec->path, rec->flags, 0750);
+        if (fd == -1) {
+            DEBUG_PRINT("Unable to open %s", rec->path);
+            break;
+        }
+        dup2(fd, rec->fd);
+        close(fd);
+        break;
+
+    case WRITER_UNLINK_AT:
+        unlinkat(rec->dirfd, rec->path, rec->flags);
+        break;
+
+    case WRITER_CALL:
+        rec->fn(rec->arg, rec->buf, rec->len);
+        break;
+
+    case WRITER_CLOSE:
+        close(rec->fd);
+        break;
+    }
+
+    free(rec->buf);
+    free(rec->path);
+}
+
+static int writer_empty (void)
+{
+    return __atomic_load_n(&ring_head, __ATOMIC_SEQ_CST) == __atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST);
+}
+
+static void *writer_thread (void *arg)
+{
+    struct writer_rec *rec;
+    unsigned int head;
+    size_t len;
+
+    while (1) {
+        if (writer_empty()) {
+            /* 'thread_sleeping' is set before looking at the ring again, so
+             * a record added in between either shows up here, or sees the
+             * flag and wakes us */
+            pthread_mutex_lock(&lock);
+            pthread_cond_broadcast(&idle_cond);
+
+            __atomic_store_n(&thread_sleeping, 1, __ATOMIC_SEQ_CST);
+            while (writer_empty() && !thread_stop)
+                pthread_cond_wait(&work_cond, &lock);
+            __atomic_store_n(&thread_sleeping, 0, __ATOMIC_SEQ_CST);
+
+            if (writer_empty() && thread_stop) {
+                pthread_mutex_unlock(&lock);
+                break;
+            }
+            pthread_mutex_unlock(&lock);
+        }
+
+        head = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        rec = ring + (head & WRITER_RING_MASK);
+
+        len = (rec->type == WRITER_WRITE || rec->type == WRITER_CALL)? rec->len: 0;
+        writer_do(rec);
+        __atomic_sub_fetch(&queued_bytes, len, __ATOMIC_RELAXED);
+
+        __atomic_store_n(&ring_head, head + 1, __ATOMIC_SEQ_CST);
+    }
+
+    return NULL;
+}
+
+/* Returns -1 if the ring is full */
+static int writer_push (const struct writer_rec *rec)
+{
+    unsigned int tail = __atomic_load_n(&ring_tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE) == WRITER_RING_SIZE)
+        return -1;
+
+    ring[tail & WRITER_RING_MASK] = *rec;
+    __atomic_store_n(&ring_tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&thread_sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&lock);
+        pthread_cond_signal(&work_cond);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return 0;
+}
+
+/* For the records that can't be refused. If the ring is full, waits for the
+ * thread to empty it. Without the thread, the record is just done now. */
+static void writer_push_wait (struct writer_rec *rec)
+{
+    if (!thread_running) {
+        writer_do(rec);
+        return ;
+    }
+
+    if (writer_push(rec) == 0)
+        return ;
+
+    writer_sync();
+    writer_push(rec);
+}
+
+int writer_init (void)
+{
+    sigset_t all, old;
+
+    null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1)
+        return -1;
+
+    /* Signals should only ever be handled on the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    thread_stop = 0;
+    thread_running = (pthread_create(&thread, NULL, writer_thread, NULL) == 0);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!thread_running) {
+        close(null_fd);
+        null_fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+void writer_clear (void)
+{
+    if (!thread_running)
+        return ;
+
+    pthread_mutex_lock(&lock);
+    thread_stop = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+    thread_running = 0;
+
+    close(null_fd);
+    null_fd = -1;
+}
+
+int writer_running (void)
+{
+    return thread_running;
+}
+
+/* Queues a record carrying 'rec->len' bytes of data. Unless 'wait' is set,
+ * it's subject to WRITER_MAX_BYTES and refused when the queue is full. With
+ * it, the caller waits for room instead, and the limit is ignored. */
+static int writer_push_data (struct writer_rec *rec, int wait)
+{
+    if (!thread_running) {
+        writer_do(rec);
+        return 0;
+    }
+
+    if (!wait && __atomic_load_n(&queued_bytes, __ATOMIC_RELAXED) + rec->len > WRITER_MAX_BYTES)
+        return -1;
+
+    /* Counted before it's pushed, since the thread takes it off right after */
+    __atomic_add_fetch(&queued_bytes, rec->len, __ATOMIC_RELAXED);
+    if (wait) {
+        writer_push_wait(rec);
+    } else if (writer_push(rec) == -1) {
+        __atomic_sub_fetch(&queued_bytes, rec->len, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    return 0;
+}
+
+int writer_write (int fd, char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_WRITE, fd, NULL, buf, len };
+
+    return writer_push_data(&rec, 0);
+}
+
+void writer_write_wait (int fd, char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_WRITE, fd, NULL, buf, len };
+
+    writer_push_data(&rec, 1);
+}
+
+int writer_call (writer_fn fn, void *arg, char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_CALL, -1, NULL, buf, len };
+
+    rec.fn = fn;
+    rec.arg = arg;
+
+    return writer_push_data(&rec, len == 0);
+}
+
+void writer_call_wait (writer_fn fn, void *arg, char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_CALL, -1, NULL, buf, len };
+
+    rec.fn = fn;
+    rec.arg = arg;
+
+    writer_push_data(&rec, 1);
+}
+
+void writer_replace (int fd, const char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_REPLACE, fd, NULL, NULL, len };
+
+    rec.buf = malloc(len + 1);
+    if (!rec.buf)
+        return ;
+    memcpy(rec.buf, buf, len);
+
+    writer_push_wait(&rec);
+}
+
+void writer_replace_at (int dirfd, const char *path, const char *buf, size_t len)
+{
+    struct writer_rec rec = { WRITER_REPLACE_AT, dirfd, NULL, NULL, len };
+
+    rec.buf = malloc(len + 1);
+    if (!rec.buf)
+        return ;
+    memcpy(rec.buf, buf, len);
+    rec.path = strdup(path);
+
+    writer_push_wait(&rec);
+}
+
+int writer_open_at (int dirfd, const char *path, int flags)
+{
+    struct writer_rec rec = { WRITER_OPEN_AT, -1, NULL, NULL, 0, dirfd, flags };
+
+    if (!thread_running)
+        return openat(dirfd, path, flags, 0750);
+
+    rec.fd = dup(null_fd);
+    if (rec.fd == -1)
+        return -1;
+
+    rec.path = strdup(path);
+    if (!rec.path) {
+        close(rec.fd);
+        return -1;
+    }
+
+    writer_push_wait(&rec);
+    return rec.fd;
+}
+
+void writer_unlink_at (int dirfd, const char *path, int flags)
+{
+    struct writer_rec rec = { WRITER_UNLINK_AT, -1, NULL, NULL, 0, dirfd, flags };
+
+    rec.path = strdup(path);
+    if (!rec.path)
+        return ;
+
+    writer_push_wait(&rec);
+}
+
+void writer_close (int fd)
+{
+    struct writer_rec rec = { WRITER_CLOSE, fd, NULL, NULL, 0 };
+
+    if (fd == -1)
+        return ;
+
+    writer_push_wait(&rec);
+}
+
+void writer_sync (void)
+{
+    if (!thread_running)
+        return ;
+
+    pthread_mutex_lock(&lock);
+    while (!writer_empty())
+        pthread_cond_wait(&idle_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
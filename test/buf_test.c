@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "test.h"
+#include "buf.h"
+
+static void open_pipe(struct buf_fd *buf, int *wfd)
+{
+    int fds[2];
+
+    buf_init(buf);
+    pipe(fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK | fcntl(fds[0], F_GETFL));
+
+    buf->fd = fds[0];
+    *wfd = fds[1];
+}
+
+static void close_pipe(struct buf_fd *buf, int wfd)
+{
+    CLOSE_FD(wfd);
+    CLOSE_FD(buf->fd);
+    buf_free(buf);
+}
+
+static int check_line(struct buf_fd *buf, const char *expected)
+{
+    size_t len;
+    char *line = buf_next_line(buf, &len);
+
+    return TEST_ASSERT(line != NULL && strcmp(line, expected) == 0 && len == strlen(expected));
+}
+
+int buf_simple_lines(void)
+{
+    int ret = 0, wfd;
+    struct buf_fd buf;
+    const char input[] = "PING :test\r\nline two\n";
+
+    open_pipe(&buf, &wfd);
+
+    write(wfd, input, sizeof(input) - 1);
+    buf_handle_input(&buf);
+
+    ret += TEST_ASSERT(buf.has_line == 2);
+    ret += check_line(&buf, "PING :test");
+    ret += check_line(&buf, "line two");
+    ret += TEST_ASSERT(buf.has_line == 0);
+    ret += TEST_ASSERT(buf.closed_gracefully == 0);
+
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int buf_split_line(void)
+{
+    int ret = 0, wfd;
+    struct buf_fd buf;
+
+    open_pipe(&buf, &wfd);
+
+    write(wfd, "first ha", 8);
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 0);
+
+    write(wfd, "lf\nsecond", 9);
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 1);
+    ret += check_line(&buf, "first half");
+
+    write(wfd, " line\n", 6);
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 1);
+    ret += check_line(&buf, "second line");
+
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int buf_large_burst(void)
+{
+    int ret = 0, wfd, i, bad = 0;
+    struct buf_fd buf;
+    char line[64], *input;
+    size_t len = 0;
+    const int count = 1500;
+
+    open_pipe(&buf, &wfd);
+
+    input = malloc(count * sizeof(line));
+    for (i = 0; i < count; i++)
+        len += sprintf(input + len, ":server 353 nick = #chan :user%d\r\n", i);
+
+    /* Larger then a single block, and larger then the largest read, but
+     * still small enough to fit in the pipe */
+    ret += TEST_ASSERT(len > BUF_MAX_READ);
+    ret += TEST_ASSERT(write(wfd, input, len) == len);
+
+    buf_handle_input(&buf);
+
+    ret += TEST_ASSERT(buf.has_line == count);
+
+    for (i = 0; i < count; i++) {
+        char *got = buf_next_line(&buf, NULL);
+        sprintf(line, ":server 353 nick = #chan :user%d", i);
+        if (!got || strcmp(got, line) != 0)
+            bad++;
+    }
+
+    ret += TEST_ASSERT(bad == 0);
+    ret += TEST_ASSERT(buf.has_line == 0);
+
+    free(input);
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int buf_cross_block(void)
+{
+    int ret = 0, wfd;
+    struct buf_fd buf;
+    char *line, *scratch;
+    const char input[] = "short\nthis line is longer then one block\r\nend\n";
+
+    open_pipe(&buf, &wfd);
+    buf.block_size = buf.read_size = 16;
+
+    write(wfd, input, sizeof(input) - 1);
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 3);
+
+    /* Lines inside of one block point straight into it */
+    line = buf_next_line(&buf, NULL);
+    ret += TEST_ASSERT(line == buf.head->buf);
+    ret += TEST_ASSERT(strcmp(line, "short") == 0);
+
+    /* Lines crossing blocks are copied into the scratch area */
+    line = buf_next_line(&buf, NULL);
+    scratch = buf.scratch;
+    ret += TEST_ASSERT(line == scratch);
+    ret += TEST_ASSERT(strcmp(line, "this line is longer then one block") == 0);
+
+    ret += check_line(&buf, "end");
+    ret += TEST_ASSERT(buf_next_line(&buf, NULL) == NULL);
+
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int buf_closed(void)
+{
+    int ret = 0, wfd;
+    struct buf_fd buf;
+
+    open_pipe(&buf, &wfd);
+
+    write(wfd, "last line\n", 10);
+    CLOSE_FD(wfd);
+
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 1);
+
+    /* The short read stops the first pass, the second one sees the EOF */
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.closed_gracefully == 1);
+    ret += check_line(&buf, "last line");
+
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int buf_added_input(void)
+{
+    int ret = 0, wfd;
+    struct buf_fd buf;
+    char chunk[700], expected[sizeof(chunk) + 6];
+
+    open_pipe(&buf, &wfd);
+    buf.loop_reads = 1;
+
+    /* Nothing is read while the event loop is doing the reads */
+    write(wfd, "from the fd\n", 12);
+    buf_handle_input(&buf);
+    ret += TEST_ASSERT(buf.has_line == 0);
+
+    buf_add_input(&buf, "first ha", 8);
+    buf_add_input(&buf, "lf\nsecond", 9);
+    ret += TEST_ASSERT(buf.has_line == 1);
+    ret += check_line(&buf, "first half");
+
+    /* Bigger then a block, and split across the tail block's space */
+    memset(chunk, 'x', sizeof(chunk));
+    chunk[sizeof(chunk) - 1] = '\n';
+    buf_add_input(&buf, chunk, sizeof(chunk));
+    ret += TEST_ASSERT(buf.has_line == 1);
+
+    memcpy(expected, "second", 6);
+    memcpy(expected + 6, chunk, sizeof(chunk) - 1);
+    expected[sizeof(expected) - 1] = '\0';
+    ret += check_line(&buf, expected);
+    ret += TEST_ASSERT(buf.has_line == 0);
+
+    close_pipe(&buf, wfd);
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { buf_simple_lines, "Simple lines" },
+        { buf_split_line, "Line split across reads" },
+        { buf_large_burst, "Large burst" },
+        { buf_cross_block, "Line across blocks" },
+        { buf_closed, "Closed fd" },
+        { buf_added_input, "Input added by the event loop" },
+    };
+
+    ret = run_tests("buf", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
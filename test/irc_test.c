@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "irc.h"
+
+/* irc.c drops queued lines through the network, which isn't linked in */
+void network_drop_queued(struct network *net, const char *target)
+{
+
+}
+
+int irc_parse_ping(void)
+{
+    int ret = 0;
+    struct irc_reply rpl;
+    char line[] = "PING :irc.example.net";
+
+    ret += TEST_ASSERT(irc_parse_line(line, &rpl) == 0);
+    ret += TEST_ASSERT(rpl.code == CMD_PING);
+    ret += TEST_ASSERT(rpl.param_count == 0);
+    ret += TEST_ASSERT(strcmp(irc_reply_param(&rpl, 0), "irc.example.net") == 0);
+    ret += TEST_ASSERT(irc_reply_param(&rpl, 1) == NULL);
+
+    return ret;
+}
+
+int irc_parse_ping_bare(void)
+{
+    int ret = 0;
+    struct irc_reply rpl;
+    char line[] = "PING";
+
+    ret += TEST_ASSERT(irc_parse_line(line, &rpl) == 0);
+    ret += TEST_ASSERT(rpl.code == CMD_PING);
+    ret += TEST_ASSERT(rpl.param_count == 0);
+    ret += TEST_ASSERT(rpl.trailing == NULL);
+    ret += TEST_ASSERT(irc_reply_param(&rpl, 0) == NULL);
+
+    return ret;
+}
+
+int irc_parse_prefix(void)
+{
+    int ret = 0;
+    struct irc_reply rpl;
+    char line[] = "@time=12:00;bot :nick!user@host PRIVMSG #chan :hello there";
+
+    ret += TEST_ASSERT(irc_parse_line(line, &rpl) == 0);
+    ret += TEST_ASSERT(rpl.code == CMD_PRIVMSG);
+
+    ret += TEST_ASSERT(strcmp(rpl.prefix.nick, "nick") == 0);
+    ret += TEST_ASSERT(strcmp(rpl.prefix.user, "user") == 0);
+    ret += TEST_ASSERT(strcmp(rpl.prefix.host, "host") == 0);
+
+    ret += TEST_ASSERT(strcmp(irc_reply_tag(&rpl, "time"), "12:00") == 0);
+    ret += TEST_ASSERT(strcmp(irc_reply_tag(&rpl, "bot"), "") == 0);
+    ret += TEST_ASSERT(irc_reply_tag(&rpl, "account") == NULL);
+
+    ret += TEST_ASSERT(rpl.param_count == 1);
+    ret += TEST_ASSERT(strcmp(irc_reply_param(&rpl, 0), "#chan") == 0);
+    ret += TEST_ASSERT(strcmp(irc_reply_param(&rpl, 1), "hello there") == 0);
+
+    return ret;
+}
+
+int irc_parse_numeric(void)
+{
+    int ret = 0;
+    struct irc_reply rpl;
+    char line[] = ":irc.example.net 001 nick :Welcome";
+    char empty[] = ":irc.example.net";
+
+    ret += TEST_ASSERT(irc_parse_line(line, &rpl) == 0);
+    ret += TEST_ASSERT(rpl.code == 1);
+    ret += TEST_ASSERT(strcmp(rpl.prefix.nick, "irc.example.net") == 0);
+    ret += TEST_ASSERT(rpl.prefix.user == NULL);
+    ret += TEST_ASSERT(strcmp(irc_reply_param(&rpl, 0), "nick") == 0);
+    ret += TEST_ASSERT(strcmp(irc_reply_param(&rpl, 1), "Welcome") == 0);
+
+    /* A prefix without a command isn't a message */
+    ret += TEST_ASSERT(irc_parse_line(empty, &rpl) == -1);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { irc_parse_ping, "PING" },
+        { irc_parse_ping_bare, "PING without parameters" },
+        { irc_parse_prefix, "Prefix and tags" },
+        { irc_parse_numeric, "Numerics" },
+    };
+
+    ret = run_tests("irc", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "test.h"
+#include "isupport.h"
+
+int isupport_defaults(void)
+{
+    int ret = 0;
+    struct isupport is;
+
+    isupport_init(&is);
+
+    ret += TEST_ASSERT(isupport_is_channel(&is, "#a"));
+    ret += TEST_ASSERT(isupport_is_channel(&is, "&a"));
+    ret += TEST_ASSERT(!isupport_is_channel(&is, "nick"));
+
+    ret += TEST_ASSERT(isupport_class(&is, '@') == (ISUPPORT_PREFIX | ISUPPORT_OP));
+    ret += TEST_ASSERT(isupport_class(&is, '+') & ISUPPORT_VOICE);
+    ret += TEST_ASSERT(!isupport_is_prefix(&is, '&'));
+
+    ret += TEST_ASSERT(is.casemapping == CASEMAP_RFC1459);
+    ret += TEST_ASSERT(is.nicklen == ISUPPORT_DEFAULT_NICKLEN);
+    ret += TEST_ASSERT(is.modes == ISUPPORT_DEFAULT_MODES);
+    ret += TEST_ASSERT(is.join_targmax == 0);
+
+    return ret;
+}
+
+int isupport_prefix(void)
+{
+    int ret = 0;
+    struct isupport is;
+
+    isupport_init(&is);
+    isupport_parse(&is, "PREFIX=(qaohv)~&@%+");
+
+    /* Everything from 'o' up counts as an operator */
+    ret += TEST_ASSERT(isupport_class(&is, '~') & ISUPPORT_OP);
+    ret += TEST_ASSERT(isupport_class(&is, '&') & ISUPPORT_OP);
+    ret += TEST_ASSERT(isupport_class(&is, '@') & ISUPPORT_OP);
+    ret += TEST_ASSERT(isupport_class(&is, '%') == ISUPPORT_PREFIX);
+    ret += TEST_ASSERT((isupport_class(&is, '+') & ~ISUPPORT_CHANTYPE) == (ISUPPORT_PREFIX | ISUPPORT_VOICE));
+    ret += TEST_ASSERT(is.prefix_mode['%'] == 'h');
+
+    /* '&' is both a prefix and a channel type here */
+    ret += TEST_ASSERT(isupport_is_channel(&is, "&a"));
+
+    isupport_parse(&is, "-PREFIX");
+    ret += TEST_ASSERT(!isupport_is_prefix(&is, '~'));
+    ret += TEST_ASSERT(isupport_class(&is, '@') & ISUPPORT_OP);
+
+    return ret;
+}
+
+int isupport_chantypes(void)
+{
+    int ret = 0;
+    struct isupport is;
+
+    isupport_init(&is);
+    isupport_parse(&is, "CHANTYPES=#");
+
+    ret += TEST_ASSERT(isupport_is_channel(&is, "#a"));
+    ret += TEST_ASSERT(!isupport_is_channel(&is, "&a"));
+    ret += TEST_ASSERT(!isupport_is_channel(&is, ""));
+
+    isupport_parse(&is, "CHANTYPES=");
+    ret += TEST_ASSERT(!isupport_is_channel(&is, "#a"));
+
+    return ret;
+}
+
+int isupport_limits(void)
+{
+    int ret = 0;
+    struct isupport is;
+
+    isupport_init(&is);
+    isupport_parse(&is, "NICKLEN=30");
+    isupport_parse(&is, "MODES");
+    isupport_parse(&is, "TARGMAX=NAMES:1,LIST:1,JOIN:4,PRIVMSG:4");
+    isupport_parse(&is, "CHANLIMIT=#&:100,+:,!:10");
+    isupport_parse(&is, "CASEMAPPING=ascii");
+    isupport_parse(&is, "NETWORK=Test");
+
+    ret += TEST_ASSERT(is.nicklen == 30);
+    ret += TEST_ASSERT(is.modes == 0);
+    ret += TEST_ASSERT(is.join_targmax == 4);
+    ret += TEST_ASSERT(is.casemapping == CASEMAP_ASCII);
+
+    ret += TEST_ASSERT(is.chanlimit_group['#'] == 1);
+    ret += TEST_ASSERT(is.chanlimit_group['&'] == 1);
+    ret += TEST_ASSERT(is.chanlimit_group['+'] == 0);
+    ret += TEST_ASSERT(is.chanlimit_group['!'] == 2);
+    ret += TEST_ASSERT(is.chanlimit[0] == 100);
+    ret += TEST_ASSERT(is.chanlimit[1] == 10);
+
+    /* A mapping we don't know leaves the old one */
+    isupport_parse(&is, "CASEMAPPING=rfc7613");
+    ret += TEST_ASSERT(is.casemapping == CASEMAP_ASCII);
+
+    isupport_parse(&is, "-CASEMAPPING");
+    ret += TEST_ASSERT(is.casemapping == CASEMAP_RFC1459);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { isupport_defaults, "Defaults" },
+        { isupport_prefix, "PREFIX" },
+        { isupport_chantypes, "CHANTYPES" },
+        { isupport_limits, "Limits" },
+    };
+
+    ret = run_tests("isupport", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "test.h"
+#include "buf.h"
+#include "outbuf.h"
+#include "writer.h"
+
+static void open_pipe(struct outbuf *out, int *rfd)
+{
+    int fds[2];
+
+    outbuf_init(out);
+    pipe(fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK | fcntl(fds[0], F_GETFL));
+
+    out->fd = fds[1];
+    *rfd = fds[0];
+}
+
+static int check_read(int rfd, const char *expected)
+{
+    char buf[OUTBUF_FLUSH_SIZE * 2];
+    ssize_t len = read(rfd, buf, sizeof(buf));
+
+    if (expected == NULL)
+        return TEST_ASSERT(len == -1);
+
+    return TEST_ASSERT(len == (ssize_t)strlen(expected) && memcmp(buf, expected, len) == 0);
+}
+
+int outbuf_buffered(void)
+{
+    int ret = 0, rfd;
+    struct outbuf out;
+
+    open_pipe(&out, &rfd);
+
+    outbuf_printf(&out, "%s %d\n", "line", 1);
+    outbuf_puts(&out, "line 2\n");
+
+    /* Nothing is written until the flush */
+    ret += check_read(rfd, NULL);
+
+    outbuf_flush_all();
+    ret += check_read(rfd, "line 1\nline 2\n");
+    ret += TEST_ASSERT(out.len == 0);
+
+    outbuf_close(&out);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int outbuf_long_format(void)
+{
+    int ret = 0, rfd;
+    struct outbuf out;
+    char line[1001];
+
+    memset(line, 'a', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    open_pipe(&out, &rfd);
+
+    /* Longer then the initial buffer, so it has to be formatted twice */
+    outbuf_printf(&out, "%s\n", line);
+    ret += TEST_ASSERT(out.len == sizeof(line));
+
+    outbuf_flush(&out);
+    line[sizeof(line) - 1] = '\n';
+    ret += TEST_ASSERT(read(rfd, line, sizeof(line)) == sizeof(line));
+    ret += TEST_ASSERT(line[0] == 'a' && line[sizeof(line) - 1] == '\n');
+
+    outbuf_close(&out);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int outbuf_threshold(void)
+{
+    int ret = 0, rfd, i;
+    struct outbuf out;
+    char block[256];
+
+    memset(block, 'b', sizeof(block));
+
+    open_pipe(&out, &rfd);
+
+    /* Passing OUTBUF_FLUSH_SIZE writes everything out without a flush */
+    for (i = 0; i < OUTBUF_FLUSH_SIZE / (int)sizeof(block); i++)
+        outbuf_write(&out, block, sizeof(block));
+
+    ret += TEST_ASSERT(out.len == 0);
+    ret += TEST_ASSERT(read(rfd, block, sizeof(block)) == sizeof(block));
+
+    outbuf_close(&out);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int outbuf_closed(void)
+{
+    int ret = 0, rfd;
+    struct outbuf out;
+
+    open_pipe(&out, &rfd);
+
+    outbuf_puts(&out, "pending\n");
+    outbuf_close(&out);
+    ret += TEST_ASSERT(out.fd == -1);
+
+    /* Closing flushes, and nothing is queued afterwards */
+    ret += check_read(rfd, "pending\n");
+    outbuf_puts(&out, "dropped\n");
+    ret += TEST_ASSERT(out.len == 0);
+
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+static int check_file(int dirfd, const char *path, const char *expected)
+{
+    char buf[128];
+    ssize_t len;
+    int fd = openat(dirfd, path, O_RDONLY);
+
+    if (fd == -1)
+        return TEST_ASSERT(expected == NULL);
+
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    return TEST_ASSERT(expected && len == (ssize_t)strlen(expected) && memcmp(buf, expected, len) == 0);
+}
+
+int outbuf_lazy(void)
+{
+    int ret = 0, dirfd, i;
+    struct outbuf out[3];
+    char dir[] = "/tmp/outbuf_test.XXXXXX";
+    const char *names[] = { "a", "b", "c" };
+
+    mkdtemp(dir);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    outbuf_set_max_open(2);
+
+    for (i = 0; i < 3; i++) {
+        outbuf_init(out + i);
+        outbuf_open_at(out + i, dirfd, names[i]);
+    }
+
+    /* Nothing is opened until there's something to write */
+    ret += check_file(dirfd, "a", NULL);
+    ret += TEST_ASSERT(out[0].fd == -1);
+
+    outbuf_puts(out + 0, "a1\n");
+    outbuf_puts(out + 1, "b1\n");
+    outbuf_flush_all();
+    ret += TEST_ASSERT(out[0].fd != -1 && out[1].fd != -1);
+
+    /* 'a' was written longest ago, so it's the one closed to make room */
+    outbuf_puts(out + 1, "b2\n");
+    outbuf_flush(out + 1);
+    outbuf_puts(out + 2, "c1\n");
+    outbuf_flush(out + 2);
+    ret += TEST_ASSERT(out[0].fd == -1);
+    ret += TEST_ASSERT(out[1].fd != -1 && out[2].fd != -1);
+
+    /* And it's appended to when it's opened again */
+    outbuf_puts(out + 0, "a2\n");
+    outbuf_flush(out + 0);
+    ret += TEST_ASSERT(out[0].fd != -1 && out[1].fd == -1);
+
+    for (i = 0; i < 3; i++) {
+        outbuf_close(out + i);
+        ret += TEST_ASSERT(out[i].fd == -1);
+    }
+
+    ret += check_file(dirfd, "a", "a1\na2\n");
+    ret += check_file(dirfd, "b", "b1\nb2\n");
+    ret += check_file(dirfd, "c", "c1\n");
+
+    for (i = 0; i < 3; i++)
+        unlinkat(dirfd, names[i], 0);
+    close(dirfd);
+    rmdir(dir);
+
+    outbuf_set_max_open(OUTBUF_DEFAULT_MAX_OPEN);
+    return ret;
+}
+
+int outbuf_close_backpressure(void)
+{
+    int ret = 0, dirfd, fds[2], i;
+    size_t chunk = WRITER_MAX_BYTES / 4, got = 0;
+    struct outbuf out;
+    char dir[] = "/tmp/outbuf_test.XXXXXX", *buf, tmp[4096];
+    ssize_t len;
+
+    mkdtemp(dir);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    pipe(fds);
+    writer_init();
+
+    /* Nothing reads the pipe yet, so the writer is stuck and full */
+    for (i = 0; i < 4; i++) {
+        buf = malloc(chunk);
+        memset(buf, 'a', chunk);
+        writer_write(fds[1], buf, chunk);
+    }
+
+    outbuf_init(&out);
+    outbuf_open_at(&out, dirfd, "log");
+    outbuf_puts(&out, "last line\n");
+    outbuf_flush(&out);
+    ret += TEST_ASSERT(out.len == 10);
+
+    /* Closing can't leave it for later, so it's queued past the limit */
+    outbuf_close(&out);
+
+    while (got < chunk * 4 && (len = read(fds[0], tmp, sizeof(tmp))) > 0)
+        got += len;
+
+    writer_close(fds[1]);
+    writer_clear();
+    close(fds[0]);
+
+    ret += check_file(dirfd, "log", "last line\n");
+
+    unlinkat(dirfd, "log", 0);
+    close(dirfd);
+    rmdir(dir);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { outbuf_buffered, "Buffered until flush" },
+        { outbuf_long_format, "Long formatted line" },
+        { outbuf_threshold, "Flush threshold" },
+        { outbuf_closed, "Flush on close" },
+        { outbuf_lazy, "Lazy open and LRU close" },
+        { outbuf_close_backpressure, "Close while the writer is behind" },
+    };
+
+    ret = run_tests("outbuf", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
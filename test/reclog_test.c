@@ -0,0 +1,327 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "test.h"
+#include "outbuf.h"
+#include "writer.h"
+#include "reclog.h"
+
+#define RECORDS 1000
+
+static char dir[] = "/tmp/reclog_test.XXXXXX";
+static int dirfd;
+
+static void remove_log(void)
+{
+    unlinkat(dirfd, "chan/log", 0);
+    unlinkat(dirfd, "chan/log.idx", 0);
+}
+
+/* Record 'i' is at time 1000 + i / 3, so three records share each second */
+static void write_records(struct reclog *rl, int start, int count)
+{
+    char text[32];
+    int i;
+
+    for (i = start; i < start + count; i++) {
+        sprintf(text, "line %d", i);
+        reclog_append(rl, RECLOG_MSG, 1000 + i / 3, "nick", text);
+    }
+
+    outbuf_flush_all();
+}
+
+int reclog_read_back(void)
+{
+    int ret = 0;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+    char buf[128];
+
+    remove_log();
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+
+    reclog_append(&rl, RECLOG_MSG, 1000, "nick", "hello");
+    reclog_append(&rl, RECLOG_JOIN, 1001, "other", NULL);
+    reclog_append(&rl, RECLOG_TOPIC, 1002, NULL, "a topic");
+    reclog_close(&rl);
+
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    ret += TEST_ASSERT(rd.index_count == 1);
+
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0);
+    ret += TEST_ASSERT(rec.type == RECLOG_MSG && rec.seq == 0 && rec.time == 1000);
+    ret += TEST_ASSERT(strcmp(rec.nick, "nick") == 0 && strcmp(rec.text, "hello") == 0);
+
+    reclog_render(&rec, buf, sizeof(buf));
+    ret += TEST_ASSERT(strstr(buf, " <nick> : hello\n") != NULL);
+
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0);
+    ret += TEST_ASSERT(rec.type == RECLOG_JOIN && rec.seq == 1);
+    ret += TEST_ASSERT(strcmp(rec.nick, "other") == 0 && rec.text[0] == '\0');
+
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0);
+    ret += TEST_ASSERT(rec.type == RECLOG_TOPIC && rec.seq == 2);
+
+    reclog_render(&rec, buf, sizeof(buf));
+    ret += TEST_ASSERT(strstr(buf, " Topic is a topic\n") != NULL);
+
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == -1);
+
+    reclog_reader_close(&rd);
+    return ret;
+}
+
+int reclog_seek(void)
+{
+    int ret = 0;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+
+    remove_log();
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, 0, RECORDS);
+
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    ret += TEST_ASSERT(rd.index_count == (RECORDS + RECLOG_INDEX_INTERVAL - 1) / RECLOG_INDEX_INTERVAL);
+
+    reclog_seek_seq(&rd, 500);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 500);
+    ret += TEST_ASSERT(strcmp(rec.text, "line 500") == 0);
+
+    /* Right on an index entry */
+    reclog_seek_seq(&rd, RECLOG_INDEX_INTERVAL * 2);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECLOG_INDEX_INTERVAL * 2);
+
+    reclog_seek_seq(&rd, 0);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 0);
+
+    /* The first of the three records in that second */
+    reclog_seek_time(&rd, 1000 + 200);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 600 && rec.time == 1200);
+
+    reclog_seek_time(&rd, 0);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 0);
+
+    reclog_seek_seq(&rd, RECORDS);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == -1);
+
+    reclog_seek_time(&rd, 1000 + RECORDS);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == -1);
+
+    /* Records appended after the reader was opened are picked up */
+    write_records(&rl, RECORDS, 1);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECORDS);
+
+    reclog_reader_close(&rd);
+    reclog_close(&rl);
+    return ret;
+}
+
+int reclog_reopen(void)
+{
+    int ret = 0, fd;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+    struct stat st;
+    off_t size;
+
+    remove_log();
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, 0, 100);
+    reclog_close(&rl);
+
+    fstatat(dirfd, "chan/log", &st, 0);
+    size = st.st_size;
+
+    /* A record cut off part way through, as if we crashed writing it */
+    fd = openat(dirfd, "chan/log", O_WRONLY | O_APPEND);
+    write(fd, "\x40\0\0\0\1\0", 6);
+    close(fd);
+
+    /* Recovery waits for the first records */
+    reclog_open(&rl, dirfd, "chan");
+    fstatat(dirfd, "chan/log", &st, 0);
+    ret += TEST_ASSERT(st.st_size == size + 6);
+
+    write_records(&rl, 100, 1);
+    fstatat(dirfd, "chan/log", &st, 0);
+    ret += TEST_ASSERT(st.st_size > size && st.st_size < size + 64);
+
+    write_records(&rl, 101, 99);
+    reclog_close(&rl);
+
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    reclog_seek_seq(&rd, 150);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 150);
+    ret += TEST_ASSERT(strcmp(rec.text, "line 150") == 0);
+    ret += TEST_ASSERT(!rd.index_bad);
+
+    reclog_seek_seq(&rd, 99);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 99);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 100);
+    ret += TEST_ASSERT(strcmp(rec.text, "line 100") == 0);
+    reclog_reader_close(&rd);
+
+    return ret;
+}
+
+int reclog_bad_index(void)
+{
+    int ret = 0, fd;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+    struct reclog_index ent;
+
+    remove_log();
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, 0, RECORDS);
+    reclog_close(&rl);
+
+    /* Points the fourth entry into the middle of a record */
+    fd = openat(dirfd, "chan/log.idx", O_RDWR);
+    pread(fd, &ent, sizeof(ent), sizeof(ent) * 3);
+    ent.offset += 3;
+    pwrite(fd, &ent, sizeof(ent), sizeof(ent) * 3);
+    close(fd);
+
+    /* Seeks still land in the right place, just by scanning */
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    reclog_seek_seq(&rd, RECLOG_INDEX_INTERVAL * 3 + 5);
+    ret += TEST_ASSERT(rd.index_bad);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECLOG_INDEX_INTERVAL * 3 + 5);
+    reclog_reader_close(&rd);
+
+    /* And opening it for writing rebuilds the index. The last entry is
+     * checked first, so the whole index has to be bad to be noticed. */
+    fd = openat(dirfd, "chan/log.idx", O_WRONLY | O_APPEND);
+    write(fd, &ent, sizeof(ent));
+    close(fd);
+
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, RECORDS, 1);
+    reclog_close(&rl);
+
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    reclog_seek_seq(&rd, RECLOG_INDEX_INTERVAL * 3 + 5);
+    ret += TEST_ASSERT(!rd.index_bad);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECLOG_INDEX_INTERVAL * 3 + 5);
+    reclog_seek_seq(&rd, RECORDS);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECORDS);
+    reclog_reader_close(&rd);
+
+    return ret;
+}
+
+int reclog_missing_index(void)
+{
+    int ret = 0;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+
+    remove_log();
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, 0, RECORDS);
+    reclog_close(&rl);
+
+    unlinkat(dirfd, "chan/log.idx", 0);
+
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, RECORDS, RECLOG_INDEX_INTERVAL);
+    reclog_close(&rl);
+
+    /* Every entry is there, not only the ones for the new records */
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    ret += TEST_ASSERT(rd.index_count == (RECORDS + RECLOG_INDEX_INTERVAL * 2 - 1) / RECLOG_INDEX_INTERVAL);
+    ret += TEST_ASSERT(rd.index[1].seq == RECLOG_INDEX_INTERVAL);
+
+    reclog_seek_seq(&rd, 500);
+    ret += TEST_ASSERT(!rd.index_bad);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == 500);
+    reclog_seek_seq(&rd, RECORDS + 10);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECORDS + 10);
+    reclog_reader_close(&rd);
+
+    return ret;
+}
+
+int reclog_writer_thread(void)
+{
+    int ret = 0;
+    struct reclog rl;
+    struct reclog_reader rd;
+    struct reclog_rec rec;
+
+    remove_log();
+    ret += TEST_ASSERT(writer_init() == 0);
+
+    reclog_init(&rl);
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, 0, RECORDS);
+    reclog_close(&rl);
+
+    /* Opened again before the first close was written out */
+    reclog_open(&rl, dirfd, "chan");
+    write_records(&rl, RECORDS, 10);
+    reclog_close(&rl);
+
+    writer_clear();
+
+    ret += TEST_ASSERT(reclog_reader_open(&rd, dirfd, "chan") == 0);
+    reclog_seek_seq(&rd, RECORDS + 5);
+    ret += TEST_ASSERT(!rd.index_bad);
+    ret += TEST_ASSERT(reclog_next(&rd, &rec) == 0 && rec.seq == RECORDS + 5);
+    ret += TEST_ASSERT(strcmp(rec.text, "line 1005") == 0);
+    reclog_reader_close(&rd);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { reclog_read_back, "Read back records" },
+        { reclog_seek, "Seek by sequence and time" },
+        { reclog_reopen, "Reopen after a crash" },
+        { reclog_bad_index, "Bad index" },
+        { reclog_missing_index, "Missing index" },
+        { reclog_writer_thread, "On the writer thread" },
+    };
+
+    mkdtemp(dir);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    mkdirat(dirfd, "chan", 0775);
+
+    ret = run_tests("reclog", tests, sizeof(tests) / sizeof(tests[0]));
+
+    remove_log();
+    unlinkat(dirfd, "chan", AT_REMOVEDIR);
+    close(dirfd);
+    rmdir(dir);
+
+    return ret;
+}
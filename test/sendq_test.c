@@ -0,0 +1,279 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "test.h"
+#include "buf.h"
+#include "sendq.h"
+
+static void open_socks(int *wfd, int *rfd)
+{
+    int fds[2];
+
+    socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK | fcntl(fds[0], F_GETFL));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK | fcntl(fds[1], F_GETFL));
+
+    *wfd = fds[0];
+    *rfd = fds[1];
+}
+
+int sendq_lines(void)
+{
+    int ret = 0, wfd, rfd;
+    struct sendq q;
+    char buf[128];
+    const char expected[] = "NICK test\r\nUSER test 0 * :test\r\nJOIN #a\r\n";
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+
+    sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "NICK %s", "test");
+    sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "USER %s 0 * :%s", "test", "test");
+    sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "JOIN %s", "#a");
+    ret += TEST_ASSERT(q.bytes == sizeof(expected) - 1);
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(sendq_empty(&q) && q.bytes == 0);
+
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == sizeof(expected) - 1);
+    ret += TEST_ASSERT(memcmp(buf, expected, sizeof(expected) - 1) == 0);
+
+    sendq_clear(&q);
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int sendq_backpressure(void)
+{
+    int ret = 0, wfd, rfd, i;
+    struct sendq q;
+    char line[400], buf[4096];
+    size_t total = 0, got = 0;
+    ssize_t len;
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+
+    /* Far more then the socket buffer will hold */
+    for (i = 0; i < 2000; i++)
+        sendq_printf(&q, SENDQ_INTERACTIVE, "#a", "PRIVMSG #a :%s", line);
+    total = q.bytes;
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(!sendq_empty(&q) && q.bytes < total);
+
+    /* Nothing is lost, the rest goes out once there's room */
+    while (got < total) {
+        len = read(rfd, buf, sizeof(buf));
+        if (len > 0)
+            got += len;
+        else if (sendq_write(&q, wfd, 0) != 0)
+            break;
+    }
+
+    ret += TEST_ASSERT(got == total);
+    ret += TEST_ASSERT(sendq_empty(&q) && q.bytes == 0);
+
+    sendq_clear(&q);
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int sendq_closed(void)
+{
+    int ret = 0, wfd, rfd;
+    struct sendq q;
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+    CLOSE_FD(rfd);
+
+    sendq_printf(&q, SENDQ_URGENT, NULL, "QUIT");
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == -1);
+
+    sendq_clear(&q);
+    ret += TEST_ASSERT(sendq_empty(&q));
+
+    CLOSE_FD(wfd);
+    return ret;
+}
+
+int sendq_classes(void)
+{
+    int ret = 0, wfd, rfd;
+    struct sendq q;
+    char buf[128];
+    const char expected[] = "PONG :x\r\nPRIVMSG #a :hi\r\nJOIN #a\r\nJOIN #b\r\n";
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+
+    sendq_printf(&q, SENDQ_BULK, "#a", "JOIN #a");
+    sendq_printf(&q, SENDQ_BULK, "#b", "JOIN #b");
+    sendq_printf(&q, SENDQ_INTERACTIVE, "#a", "PRIVMSG #a :hi");
+    sendq_printf(&q, SENDQ_URGENT, NULL, "PONG :x");
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == sizeof(expected) - 1);
+    ret += TEST_ASSERT(memcmp(buf, expected, sizeof(expected) - 1) == 0);
+
+    sendq_clear(&q);
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int sendq_rate(void)
+{
+    int ret = 0, wfd, rfd, i;
+    struct sendq q;
+    char buf[128];
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+    sendq_set_rate(&q, 2, 1000);
+
+    for (i = 0; i < 4; i++)
+        sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "PING %d", i);
+
+    /* The burst goes out right away, the rest waits for tokens */
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == 16);
+    ret += TEST_ASSERT(sendq_next_release(&q, 0) == 1000);
+    ret += TEST_ASSERT(sendq_next_release(&q, 400) == 600);
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 999) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == -1);
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 1000) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == 8);
+    ret += TEST_ASSERT(memcmp(buf, "PING 2\r\n", 8) == 0);
+
+    /* A long wait doesn't allow more then a burst */
+    sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "PING 4");
+    sendq_printf(&q, SENDQ_INTERACTIVE, NULL, "PING 5");
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 60000) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == 16);
+    ret += TEST_ASSERT(sendq_next_release(&q, 60000) == 1000);
+
+    /* Urgent lines go out with the bucket empty, and the debt they leave
+     * holds back the next line */
+    sendq_printf(&q, SENDQ_URGENT, NULL, "PONG :1");
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 60000) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == 9);
+    ret += TEST_ASSERT(memcmp(buf, "PONG :1\r\n", 9) == 0);
+    ret += TEST_ASSERT(sendq_next_release(&q, 60000) == 2000);
+
+    sendq_clear(&q);
+    ret += TEST_ASSERT(sendq_next_release(&q, 0) == -1);
+
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+static int match_target(const char *target, void *data)
+{
+    return strcmp(target, data) == 0;
+}
+
+int sendq_drop_target(void)
+{
+    int ret = 0, wfd, rfd;
+    struct sendq q;
+    char buf[128];
+    const char expected[] = "PRIVMSG #b :2\r\nQUIT\r\n";
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+
+    sendq_printf(&q, SENDQ_INTERACTIVE, "#a", "PRIVMSG #a :1");
+    sendq_printf(&q, SENDQ_INTERACTIVE, "#b", "PRIVMSG #b :2");
+    sendq_printf(&q, SENDQ_INTERACTIVE, "#a", "PRIVMSG #a :3");
+    sendq_printf(&q, SENDQ_BULK, NULL, "QUIT");
+
+    sendq_drop(&q, match_target, "#a");
+    ret += TEST_ASSERT(q.bytes == sizeof(expected) - 1);
+
+    /* The list's tail has to survive the last line being dropped */
+    sendq_printf(&q, SENDQ_INTERACTIVE, "#a", "PRIVMSG #a :4");
+    sendq_drop(&q, match_target, "#a");
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == sizeof(expected) - 1);
+    ret += TEST_ASSERT(memcmp(buf, expected, sizeof(expected) - 1) == 0);
+
+    sendq_clear(&q);
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+/* A PART for a channel whose JOIN is still waiting in a packed line */
+int sendq_drop_from_list(void)
+{
+    int ret = 0, wfd, rfd;
+    struct sendq q;
+    char buf[128];
+    const char expected[] = "JOIN #a,#c,#d k1\r\nJOIN #e\r\n";
+
+    open_socks(&wfd, &rfd);
+    sendq_init(&q);
+
+    sendq_printf(&q, SENDQ_BULK, SENDQ_TARGET_LIST, "JOIN %s %s", "#a,#b,#c,#d", "k1,k2");
+    sendq_printf(&q, SENDQ_BULK, SENDQ_TARGET_LIST, "JOIN %s", "#f,#e");
+    sendq_printf(&q, SENDQ_BULK, SENDQ_TARGET_LIST, "JOIN %s", "#b");
+
+    /* '#b' goes along with its key, and a line left with no targets goes
+     * entirely */
+    sendq_drop(&q, match_target, "#b");
+    sendq_drop(&q, match_target, "#f");
+    sendq_drop(&q, match_target, "#x");
+
+    ret += TEST_ASSERT(q.bytes == sizeof(expected) - 1);
+
+    ret += TEST_ASSERT(sendq_write(&q, wfd, 0) == 0);
+    ret += TEST_ASSERT(read(rfd, buf, sizeof(buf)) == sizeof(expected) - 1);
+    ret += TEST_ASSERT(memcmp(buf, expected, sizeof(expected) - 1) == 0);
+
+    sendq_clear(&q);
+    CLOSE_FD(wfd);
+    CLOSE_FD(rfd);
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { sendq_lines, "Queued lines" },
+        { sendq_backpressure, "Backpressure" },
+        { sendq_closed, "Closed socket" },
+        { sendq_classes, "Priority classes" },
+        { sendq_rate, "Flood control" },
+        { sendq_drop_target, "Dropping a target" },
+        { sendq_drop_from_list, "Dropping one of a list of targets" },
+    };
+
+    ret = run_tests("sendq", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
@@ -3,6 +3,14 @@
 TESTS := confuse
 TESTS += confuse_dup_suite
 TESTS += confuse_validate_suite
+TESTS += buf
+TESTS += outbuf
+TESTS += sendq
+TESTS += timer
+TESTS += isupport
+TESTS += writer
+TESTS += reclog
+TESTS += irc
 #TESTS += confuse_list_suite # Currently not run, confuse has some seg fault
                              # issues with it
 
@@ -21,6 +29,14 @@ confuse.SRC := ./test/confuse_test.c ./src/confuse.c ./src/lex/lexer.c
 confuse_dup_suite.SRC := ./test/confuse_dup_test.c ./src/confuse.c ./src/lex/lexer.c
 confuse_validate_suite.SRC := ./test/confuse_validate_test.c ./src/confuse.c ./src/lex/lexer.c
 confuse_list_suite.SRC := ./test/confuse_list_test.c ./src/confuse.c ./src/lex/lexer.c
+buf.SRC := ./test/buf_test.c ./src/buf.c
+outbuf.SRC := ./test/outbuf_test.c ./src/outbuf.c ./src/writer.c
+sendq.SRC := ./test/sendq_test.c ./src/sendq.c
+timer.SRC := ./test/timer_test.c ./src/timer.c
+isupport.SRC := ./test/isupport_test.c ./src/isupport.c ./src/casemap.c
+writer.SRC := ./test/writer_test.c ./src/writer.c
+reclog.SRC := ./test/reclog_test.c ./src/reclog.c ./src/outbuf.c ./src/writer.c ./src/clock.c ./src/global.c
+irc.SRC := ./test/irc_test.c ./src/irc.c ./src/sendq.c
 
 # This template generates a list of the outputted test executables, as well as
 # rules for compiling them.
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "test.h"
+#include "timer.h"
+
+struct test_timer {
+    struct timer timer;
+    int id;
+    long long fired_at;
+};
+
+static int fired[16];
+static int fired_count;
+
+static void test_handler(struct timer *timer)
+{
+    struct test_timer *t = container_of(timer, struct test_timer, timer);
+
+    t->fired_at = timer_now();
+    fired[fired_count++] = t->id;
+}
+
+/* Waits on timer_timeout like the event loop does, until 'ms' have passed */
+static void run_for(int ms)
+{
+    long long end = timer_now() + ms;
+    int timeout;
+
+    while (timer_now() < end) {
+        timeout = timer_timeout();
+        if (timeout == -1 || timeout > end - timer_now())
+            timeout = end - timer_now();
+        poll(NULL, 0, timeout);
+        timer_run();
+    }
+}
+
+static void setup(struct test_timer *timers, int count)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        timer_init(&timers[i].timer);
+        timers[i].id = i;
+        timers[i].fired_at = 0;
+    }
+
+    fired_count = 0;
+}
+
+int timer_order(void)
+{
+    int ret = 0;
+    struct test_timer t[4];
+    long long start;
+
+    setup(t, 4);
+
+    start = timer_now();
+
+    /* Spread across the first two levels of the wheel */
+    timer_add(&t[2].timer, 150, test_handler);
+    timer_add(&t[0].timer, 5, test_handler);
+    timer_add(&t[3].timer, 200, test_handler);
+    timer_add(&t[1].timer, 70, test_handler);
+
+    ret += TEST_ASSERT(timer_timeout() >= 0 && timer_timeout() <= 5);
+
+    run_for(250);
+
+    ret += TEST_ASSERT(fired_count == 4);
+    ret += TEST_ASSERT(fired[0] == 0 && fired[1] == 1 && fired[2] == 2 && fired[3] == 3);
+    ret += TEST_ASSERT(t[1].fired_at - start >= 70 && t[1].fired_at - start < 120);
+    ret += TEST_ASSERT(t[3].fired_at - start >= 200);
+    ret += TEST_ASSERT(timer_timeout() == -1);
+
+    return ret;
+}
+
+int timer_delete(void)
+{
+    int ret = 0;
+    struct test_timer t[3];
+
+    setup(t, 3);
+
+    timer_add(&t[0].timer, 10, test_handler);
+    timer_add(&t[1].timer, 20, test_handler);
+    timer_add(&t[2].timer, 80, test_handler);
+
+    timer_del(&t[1].timer);
+    timer_del(&t[1].timer);
+    ret += TEST_ASSERT(!t[1].timer.pending);
+
+    /* Rescheduling moves it instead of adding it twice */
+    timer_add(&t[0].timer, 40, test_handler);
+
+    run_for(100);
+
+    ret += TEST_ASSERT(fired_count == 2);
+    ret += TEST_ASSERT(fired[0] == 0 && fired[1] == 2);
+    ret += TEST_ASSERT(timer_timeout() == -1);
+
+    return ret;
+}
+
+int timer_long(void)
+{
+    int ret = 0, timeout;
+    struct test_timer t[2];
+
+    setup(t, 2);
+
+    /* On the third and fourth levels of the wheel */
+    timer_add(&t[0].timer, 5000, test_handler);
+    timer_add(&t[1].timer, 600000, test_handler);
+
+    timeout = timer_timeout();
+    ret += TEST_ASSERT(timeout > 4900 && timeout <= 5000);
+
+    run_for(20);
+    ret += TEST_ASSERT(fired_count == 0);
+
+    timer_del(&t[0].timer);
+    timeout = timer_timeout();
+    ret += TEST_ASSERT(timeout > 599000 && timeout <= 600000);
+
+    timer_del(&t[1].timer);
+    ret += TEST_ASSERT(timer_timeout() == -1);
+
+    return ret;
+}
+
+static struct test_timer many[200];
+static int many_early, many_late;
+
+static void many_handler(struct timer *timer)
+{
+    struct test_timer *t = container_of(timer, struct test_timer, timer);
+    long long diff = timer_now() - t->fired_at;
+
+    /* 'fired_at' holds when it was supposed to go off */
+    if (diff < 0)
+        many_early++;
+    else if (diff > 20)
+        many_late++;
+}
+
+int timer_many(void)
+{
+    int ret = 0, i, ms;
+
+    many_early = many_late = 0;
+    srand(1);
+
+    /* Lots of timers crossing slot boundaries at every phase of the wheel */
+    for (i = 0; i < 200; i++) {
+        ms = rand() % 400;
+        timer_init(&many[i].timer);
+        many[i].fired_at = timer_now() + ms;
+        timer_add(&many[i].timer, ms, many_handler);
+    }
+
+    run_for(450);
+
+    ret += TEST_ASSERT(many_early == 0);
+    ret += TEST_ASSERT(many_late == 0);
+    ret += TEST_ASSERT(timer_timeout() == -1);
+
+    return ret;
+}
+
+static struct test_timer readd_timer;
+static int readd_count;
+
+static void readd_handler(struct timer *timer)
+{
+    if (++readd_count < 5)
+        timer_add(timer, 1, readd_handler);
+}
+
+int timer_readd(void)
+{
+    int ret = 0;
+
+    timer_init(&readd_timer.timer);
+    readd_count = 0;
+
+    timer_add(&readd_timer.timer, 1, readd_handler);
+    run_for(50);
+
+    ret += TEST_ASSERT(readd_count == 5);
+    ret += TEST_ASSERT(!readd_timer.timer.pending);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { timer_order, "Expiry order" },
+        { timer_delete, "Delete and reschedule" },
+        { timer_long, "Long timers" },
+        { timer_readd, "Re-adding from the handler" },
+        { timer_many, "Many timers" },
+    };
+
+    ret = run_tests("timer", tests, sizeof(tests) / sizeof(tests[0]));
+
+    return ret;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2013 Matt Kilgore
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License v2 as published by the
+ * Free Software Foundation.
+ */
+#include "global.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "test.h"
+#include "writer.h"
+
+static char dir[] = "/tmp/writer_test.XXXXXX";
+static int dirfd = -1;
+
+static int check_file(const char *path, const char *expected)
+{
+    char buf[128];
+    ssize_t len;
+    int fd = openat(dirfd, path, O_RDONLY);
+
+    if (fd == -1)
+        return TEST_ASSERT(expected == NULL);
+
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    return TEST_ASSERT(expected && len == (ssize_t)strlen(expected) && memcmp(buf, expected, len) == 0);
+}
+
+/* Runs all of the record types, and checks they end up in order */
+static int run_records(const char *path)
+{
+    int ret = 0, fd = writer_open_at(dirfd, path, O_WRONLY | O_CREAT | O_APPEND);
+
+    ret += TEST_ASSERT(writer_write(fd, strdup("line 1\n"), 7) == 0);
+    ret += TEST_ASSERT(writer_write(fd, strdup("line 2\n"), 7) == 0);
+    writer_sync();
+    ret += check_file(path, "line 1\nline 2\n");
+
+    writer_replace(fd, "replaced\n", 9);
+    ret += TEST_ASSERT(writer_write(fd, strdup("line 3\n"), 7) == 0);
+    writer_close(fd);
+
+    writer_replace_at(dirfd, "state", "state\n", 6);
+
+    writer_sync();
+    ret += check_file(path, "replaced\nline 3\n");
+    ret += check_file("state", "state\n");
+
+    /* A file that can't be opened swallows its writes, with the thread */
+    fd = writer_open_at(dirfd, "missing/c", O_WRONLY | O_CREAT | O_APPEND);
+    ret += TEST_ASSERT(fd != -1 || !writer_running());
+    if (fd != -1) {
+        ret += TEST_ASSERT(writer_write(fd, strdup("lost\n"), 5) == 0);
+        writer_close(fd);
+    }
+    writer_sync();
+    ret += check_file("missing/c", NULL);
+
+    /* Removing a file happens after what was queued for it */
+    fd = writer_open_at(dirfd, "d", O_WRONLY | O_CREAT | O_APPEND);
+    ret += TEST_ASSERT(writer_write(fd, strdup("gone\n"), 5) == 0);
+    writer_close(fd);
+    writer_unlink_at(dirfd, "d", 0);
+    writer_unlink_at(dirfd, path, 0);
+    writer_unlink_at(dirfd, "state", 0);
+    writer_sync();
+    ret += check_file("d", NULL);
+    ret += check_file(path, NULL);
+
+    return ret;
+}
+
+int writer_no_thread(void)
+{
+    int ret = 0;
+
+    ret += TEST_ASSERT(!writer_running());
+    ret += run_records("a");
+
+    return ret;
+}
+
+int writer_thread(void)
+{
+    int ret = 0;
+
+    ret += TEST_ASSERT(writer_init() == 0);
+    ret += TEST_ASSERT(writer_running());
+
+    ret += run_records("b");
+
+    writer_clear();
+    ret += TEST_ASSERT(!writer_running());
+
+    return ret;
+}
+
+int writer_backpressure(void)
+{
+    int ret = 0, fds[2], i;
+    size_t chunk = WRITER_MAX_BYTES / 4, got = 0;
+    char *buf, tmp[4096];
+    ssize_t len;
+
+    pipe(fds);
+    writer_init();
+
+    /* Too big to ever be taken */
+    buf = malloc(WRITER_MAX_BYTES + 1);
+    ret += TEST_ASSERT(writer_write(fds[1], buf, WRITER_MAX_BYTES + 1) == -1);
+    free(buf);
+
+    /* Nothing reads the pipe yet, so the thread is stuck on the first write
+     * and the rest stay queued, up to the limit */
+    for (i = 0; i < 4; i++) {
+        buf = malloc(chunk);
+        memset(buf, 'a' + i, chunk);
+        ret += TEST_ASSERT(writer_write(fds[1], buf, chunk) == 0);
+    }
+
+    buf = strdup("x");
+    ret += TEST_ASSERT(writer_write(fds[1], buf, 1) == -1);
+    free(buf);
+
+    while (got < chunk * 4 && (len = read(fds[0], tmp, sizeof(tmp))) > 0) {
+        if (got % chunk == 0)
+            ret += TEST_ASSERT(tmp[0] == 'a' + (int)(got / chunk));
+        got += len;
+    }
+
+    writer_sync();
+    ret += TEST_ASSERT(got == chunk * 4);
+
+    writer_close(fds[1]);
+    writer_clear();
+    close(fds[0]);
+
+    return ret;
+}
+
+int main()
+{
+    int ret;
+    struct unit_test tests[] = {
+        { writer_no_thread, "Without the thread" },
+        { writer_thread, "Writer thread" },
+        { writer_backpressure, "Backpressure" },
+    };
+
+    mkdtemp(dir);
+    dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    ret = run_tests("writer", tests, sizeof(tests) / sizeof(tests[0]));
+
+    close(dirfd);
+    rmdir(dir);
+
+    return ret;
+}